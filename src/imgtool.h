@@ -0,0 +1,193 @@
+/**
+ * $Id$
+ * imgtool.h
+ * In-process interface to the imgtool frame buffer engine (libimgtool.a)
+ * Copyright (C) 2007-2009 Chumby Industries. All rights reserved.
+**/
+
+#ifndef IMGTOOL_H
+#define IMGTOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frame buffer pixel formats
+enum imgtool_bitfmt {
+	IMGTOOL_RGB565,
+	IMGTOOL_RGB888,
+	IMGTOOL_BGR565,
+	IMGTOOL_ARGB8888,
+};
+
+// Capture encodings
+enum imgtool_format {
+	IMGTOOL_FMT_JPEG,
+	IMGTOOL_FMT_PNG,
+	IMGTOOL_FMT_RAW,		// Frame buffer contents as they are
+	IMGTOOL_FMT_RAW_HEADER,		// The same behind a struct imgtool_raw_header
+};
+
+// Header in front of IMGTOOL_FMT_RAW_HEADER (--fmt=rawhdr) captures.
+// Fields are little endian; height rows of stride bytes follow.
+#define IMGTOOL_RAW_MAGIC	"IMGR"
+struct imgtool_raw_header {
+	char magic[4];			// IMGTOOL_RAW_MAGIC, not terminated
+	uint32_t header_size;		// sizeof(struct imgtool_raw_header)
+	uint32_t width, height;
+	uint32_t stride;		// Bytes per row in the data
+	uint32_t format;		// enum imgtool_bitfmt
+	uint32_t reserved[2];
+};
+
+// Frame sequence written by --mode=bake and shown by --mode=play: frames
+// already in frame buffer format. Fields are little endian. The raw header
+// (magic IMGTOOL_SEQ_MAGIC) gives the geometry of every frame. The index
+// holds one entry per frame, each pointing at that frame's rectangles;
+// a rectangle is followed by h packed rows of w pixels. Key frames cover
+// the whole screen, so playback can start at any frame by going back to
+// the key frame before it. Frame 0 is always a key frame.
+#define IMGTOOL_SEQ_MAGIC	"IMGS"
+#define IMGTOOL_SEQ_KEY		1
+struct imgtool_seq_header {
+	struct imgtool_raw_header raw;	// header_size is that of this struct
+	uint32_t frames;
+	uint32_t frame_ns;		// Display time of every frame
+	uint32_t loops;			// Plays, 0 forever
+	uint32_t reserved;
+	uint64_t index;			// File offset of frames index entries
+};
+struct imgtool_seq_frame {
+	uint64_t offset;		// File offset of the first rectangle
+	uint32_t rects;			// 0 when nothing changed
+	uint32_t flags;			// IMGTOOL_SEQ_KEY
+};
+struct imgtool_seq_rect {
+	uint32_t x, y, w, h;
+};
+
+// Tiled image pyramid written by --mode=pyramid and shown by --mode=view.
+// Fields are little endian. The raw header (magic IMGTOOL_PYR_MAGIC) gives
+// the full size image and the frame buffer format of native tiles. Each
+// level is the one before halved (rounding up), the last fitting in one
+// tile. index points at one level entry per level, each pointing at its
+// cols x rows tile entries, row by row. A tile covers tile x tile pixels,
+// less at the right and bottom edges, and is a JPEG (IMGTOOL_PYR_JPEG) or
+// packed rows in the frame buffer format.
+#define IMGTOOL_PYR_MAGIC	"IMGP"
+#define IMGTOOL_PYR_JPEG	1
+struct imgtool_pyr_header {
+	struct imgtool_raw_header raw;	// header_size is that of this struct
+	uint32_t tile;			// Tile side in pixels
+	uint32_t levels;
+	uint32_t flags;			// IMGTOOL_PYR_JPEG
+	uint32_t reserved;
+	uint64_t index;			// File offset of the level entries
+};
+struct imgtool_pyr_level {
+	uint32_t width, height;
+	uint32_t cols, rows;		// Tiles across and down
+	uint64_t tiles;			// File offset of the tile entries
+};
+struct imgtool_pyr_tile {
+	uint64_t offset;
+	uint32_t size;			// Bytes stored
+	uint32_t reserved;
+};
+
+// Rectangle fills (--rect). Colors are 0xAARRGGBB as for imgtool_fill();
+// gradients run from argb[0] to argb[1], checkers alternate cell pixel
+// squares of the two starting with argb[0] at the top left.
+enum imgtool_pattern {
+	IMGTOOL_SOLID,
+	IMGTOOL_HGRADIENT,		// Left to right
+	IMGTOOL_VGRADIENT,		// Top to bottom
+	IMGTOOL_CHECKER,
+};
+struct imgtool_rect {
+	int x, y;			// May lie partly off screen; clipped
+	unsigned int w, h;
+	enum imgtool_pattern pattern;
+	uint32_t argb[2];
+	unsigned int cell;		// Checker square size, 0 for 8
+};
+
+// Frame buffer geometry. Zero fields in imgtool_open() are taken from the
+// device; a regular file standing in for a frame buffer needs them all.
+struct imgtool_geometry {
+	unsigned int width, height;
+	unsigned int stride;		// Bytes per line, 0 for packed rows
+	enum imgtool_bitfmt fmt;
+	int fmt_given;			// fmt is valid
+};
+
+// Another frame buffer that draws also go to (--also), with a geometry
+// and format of its own
+struct imgtool_target {
+	const char *path;
+	struct imgtool_geometry geom;	// Zero fields are taken from the device
+};
+
+// A context keeps the frame buffer mapped and the libjpeg objects, converter
+// state and scratch memory alive between calls. Calls on one context must
+// not overlap; use one context per thread.
+typedef struct imgtool_ctx imgtool_ctx;
+
+// Open fb_path (NULL for /dev/fb0). Returns NULL on failure.
+imgtool_ctx *imgtool_open( const char *fb_path, const struct imgtool_geometry *geom );
+void imgtool_close( imgtool_ctx *ctx );
+void imgtool_get_geometry( imgtool_ctx *ctx, struct imgtool_geometry *geom );
+
+// Options, same meaning as the command line switches
+void imgtool_set_resize( imgtool_ctx *ctx, unsigned int resize_options );	// --resize
+void imgtool_set_mirror( imgtool_ctx *ctx, int mirror );			// --mirrorh
+void imgtool_set_jpeg_quality( imgtool_ctx *ctx, int quality );		// --quality
+void imgtool_set_jpeg_scans( imgtool_ctx *ctx, int scans );		// --scans
+void imgtool_set_thumbnail( imgtool_ctx *ctx, int size );		// --thumb: longer side, 0 for none
+void imgtool_set_damage( imgtool_ctx *ctx, int damage );		// --damage
+// --crop: draw only the window w x h (0 for the screen's) at x,y of images
+void imgtool_set_crop( imgtool_ctx *ctx, int crop, unsigned int x, unsigned int y, unsigned int w, unsigned int h );
+int imgtool_add_target( imgtool_ctx *ctx, const char *fb_path, const struct imgtool_geometry *geom );	// --also
+void imgtool_set_tile_cache( imgtool_ctx *ctx, unsigned int tiles );	// --cache: 0 for two screens' worth
+void imgtool_set_capture_threads( imgtool_ctx *ctx, int threads );	// --jobs (capture)
+void imgtool_set_raw_packed( imgtool_ctx *ctx, int packed );		// --packed
+void imgtool_set_snapshot( imgtool_ctx *ctx, int mode );		// --snapshot: 0 off, 1 on, 2 vsync
+// --background[=nice], --budget: nice_level 0 for SCHED_IDLE, -1 for off.
+// Captures then run on a thread of their own at that priority; the calling
+// thread's scheduling is left alone.
+void imgtool_set_background( imgtool_ctx *ctx, int nice_level, uint64_t bytes_per_sec );
+void imgtool_set_verbose( imgtool_ctx *ctx, int verbose );			// Progress on stderr
+
+// All calls return 0 on success, -1 on failure (reported on stderr).
+// The image format is detected from content; path may be "-" for stdin.
+int imgtool_draw_file( imgtool_ctx *ctx, const char *path );
+int imgtool_draw_mem( imgtool_ctx *ctx, const void *data, size_t size );
+
+// Play an animated GIF, APNG or MJPEG stream (--mode=play). fps 0 keeps
+// the file's frame delays; loops 0 plays as often as the file says and
+// -1 forever, in which case the call does not return.
+int imgtool_play_file( imgtool_ctx *ctx, const char *path, int fps, int loops );
+
+// Show a view of a tiled pyramid (--mode=view): level 0 is full size, x,y
+// the top left corner in full size pixels. The pyramid stays open, and its
+// decoded tiles cached, until another path is viewed or the context closed.
+int imgtool_view_file( imgtool_ctx *ctx, const char *path, unsigned int level, unsigned int x, unsigned int y );
+
+// Fill the whole frame buffer with 0xAARRGGBB
+int imgtool_fill( imgtool_ctx *ctx, uint32_t argb );
+
+// Fill count rectangles, in order, in one pass over the frame buffer
+int imgtool_fill_rects( imgtool_ctx *ctx, const struct imgtool_rect *rects, int count );
+
+// Capture to path ("-" for stdout), or to a malloc()ed buffer the caller frees
+int imgtool_capture_file( imgtool_ctx *ctx, const char *path, enum imgtool_format fmt );
+int imgtool_capture_mem( imgtool_ctx *ctx, enum imgtool_format fmt, void **data, size_t *size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IMGTOOL_H
@@ -0,0 +1,328 @@
+/**
+ * $Id$
+ * imgtool_internal.h
+ * Definitions shared by the imgtool command line tool and libimgtool.
+ * Not installed; library users include imgtool.h.
+**/
+
+#ifndef IMGTOOL_INTERNAL_H
+#define IMGTOOL_INTERNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "imgtool.h"
+
+#define VER_DATA	1, 22
+#define VER_FMT		"%d.%02d"
+
+// Engine functions and data shared with the command line tool. libimgtool.a
+// is linked into other programs, so their link names carry the library's
+// prefix; only the imgtool_* API in imgtool.h is meant for outside use.
+#define bit_format_names	imgtool__bit_format_names
+#define trace_enabled		imgtool__trace_enabled
+#define BitFormatToEnum		imgtool__BitFormatToEnum
+#define fill_fb_defaults	imgtool__fill_fb_defaults
+#define FillRGB			imgtool__FillRGB
+#define FillRects		imgtool__FillRects
+#define ShowImage		imgtool__ShowImage
+#define PlayAnimation		imgtool__PlayAnimation
+#define CaptureJpeg		imgtool__CaptureJpeg
+#define CapturePng		imgtool__CapturePng
+#define CaptureRaw		imgtool__CaptureRaw
+#define RunBatch		imgtool__RunBatch
+#define BakeSequence		imgtool__BakeSequence
+#define BakePyramid		imgtool__BakePyramid
+#define ViewPyramid		imgtool__ViewPyramid
+#define StatsReport		imgtool__StatsReport
+#define TraceWrite		imgtool__TraceWrite
+#define RunBench		imgtool__RunBench
+
+
+// Global flags
+#define RESIZE_ANY	0xfff	 // Mask to check for any resize bits
+#define	RESIZE_STRETCH_X	0x01	// Stretch width to fit
+#define RESIZE_STRETCH_Y	0x02	// Stretch height to fit
+#define RESIZE_STRETCH_MAX	0x04	// Select larger of X and Y and stretch proportionally
+#define	RESIZE_STRETCH_MIN	0x08	// Select smaller of X and Y and stretch proportionally - clipping will occur
+#define RESIZE_SHRINK_X		0x10	// Reduce X if larger than screen
+#define	RESIZE_SHRINK_Y		0x20	// Reduce Y if larger
+#define	RESIZE_SHRINK_MAX	0x40	// Reduce proportionally larger of X and Y
+#define	RESIZE_SHRINK_MIN	0x80	// Reduce proportionally smaller of X and Y - clipping will occur
+#define	RESIZE_FIT_X		0x100	// Reduce or stretch X
+#define	RESIZE_FIT_Y		0x200	// Reduce or stretch Y
+#define	RESIZE_FIT_MAX		0x400	// Reduce or stretch larger
+#define	RESIZE_FIT_MIN		0x800	// Reduce or stretch smaller - clipping will occur
+#define X_STRETCH		0x01	// We are stretching X
+#define Y_STRETCH		0x02
+#define	X_SHRINK		0x04	// Shrinking X
+#define Y_SHRINK		0x08
+
+enum bit_format {
+	BF_RGB565 = IMGTOOL_RGB565,
+	BF_RGB888 = IMGTOOL_RGB888,
+	BF_BGR565 = IMGTOOL_BGR565,
+	BF_ARGB8888 = IMGTOOL_ARGB8888,
+};
+extern const char *bit_format_names[];
+
+enum operation {
+	OP_DRAW,
+	OP_CAPTURE,
+	OP_BATCH,
+	OP_PLAY,
+	OP_BAKE,
+	OP_PYRAMID,
+	OP_VIEW,
+};
+
+struct imgtool_conf {
+	char filename[2048];
+	char output[2048];
+	double gamma;
+	enum bit_format fmt;
+	int fmt_given;
+	unsigned int width, height;
+	unsigned int stride;	/* Bytes per line, 0 for packed rows */
+	int fb_num;
+	enum operation op;
+
+	int debug_level;
+
+	/* Filename extension of output type */
+	char output_format[16];
+
+	/* Resizing parameters */
+	int x_pct;
+	int y_pct;
+	unsigned int resize_options;
+	int resize;
+
+	/* I have no idea what these are for */
+	char disp_x[100];
+	char disp_y[100];
+
+	/* Raw capture: drop the stride padding from each row */
+	int packed;
+
+	/* Capture from a private copy of the frame buffer taken in one burst
+	   (SNAPSHOT_VSYNC: right after the next vertical sync) */
+	int snapshot;
+
+	/* Background capture: run at SCHED_IDLE (or background_nice when > 0),
+	   yielding between chunks of rows and reading at most budget frame
+	   buffer bytes per second (0 for no limit) */
+	int background;
+	int background_nice;
+	uint64_t budget;
+
+	/* Draw: skip when the state file says the frame buffer already shows
+	   this input with these settings (2: and it still hashes the same) */
+	int skip_same;
+
+	/* Draw: store only what differs from the frame buffer's contents */
+	int damage;
+
+	/* Draw: only this window of the image (image pixels; zero crop_w and
+	   crop_h for the screen's), the rest is neither kept nor converted */
+	int crop;
+	unsigned int crop_x, crop_y, crop_w, crop_h;
+
+	/* Draw: further frame buffers (--also) that get the same image,
+	   decoded once */
+	const struct imgtool_target *targets;
+	int ntargets;
+
+	/* JPEG settings */
+	int jpeg_quality;
+	int jpeg_scans;		/* Progressive: stop after this many scans, 0 for all */
+	int thumbnail;		/* Captures: embed an EXIF thumbnail this many pixels
+				   on its longer side, 0 for none */
+
+	/* BMP settings */
+	int bmp_mode;
+	int mirror_h;
+
+	/* Fill settings */
+	unsigned int fill_color;
+	const struct imgtool_rect *rects;	/* --rect fills, in order */
+	int nrects;
+
+	/* Playback: frames per second (0 for the file's own timing) and
+	   number of plays (0 as the file says, < 0 forever) */
+	int fps;
+	int loops;
+	unsigned int start_frame;	/* Sequences: first frame shown */
+
+	/* Bake: sequence file to write, and every keyframes'th frame stored
+	   whole (0 for only the first) */
+	char seq[2048];
+	int keyframes;
+
+	/* Pyramids: tile side (0 for PYR_DEFAULT_TILE). Views: level shown,
+	   at crop_x, crop_y in full size pixels, JPEG tiles kept decoded
+	   (0 for two screens' worth) and where further views are read from
+	   ("-" for stdin, empty for none) */
+	unsigned int tile;
+	unsigned int zoom;
+	unsigned int tile_cache;
+	char views[2048];
+
+	/* Per-phase statistics, NULL unless --stats was given */
+	struct imgtool_stats *stats;
+
+	/* Scratch memory for the current draw, capture or fill */
+	struct imgtool_arena *arena;
+
+	/* Progress messages on stderr (errors are always reported) */
+	int quiet;
+
+	/* Long-lived state owned by a library context, NULL for one-shot use */
+	struct fb_dev *fb;
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfo;
+
+	/* Captures are written here instead of to filename when set */
+	FILE *output_stream;
+
+	/* Batch settings */
+	char outdir[2048];
+	int jobs;		/* Worker threads, 0 for one per cpu in batch mode;
+				   captures use threads when > 1 */
+
+	/* Trace-event output, empty unless --trace was given */
+	char trace_file[2048];
+
+	/* Benchmark suite to run (imgtool-bench only) */
+	char bench[16];
+};
+
+#define PROGRESS(conf, ...)	do { if (!(conf)->quiet) fprintf( stderr, __VA_ARGS__ ); } while (0)
+
+static inline unsigned int BytesPerFBPixel(enum bit_format fmt)
+{
+	switch (fmt)
+	{
+		case BF_RGB565:
+		case BF_BGR565:
+		default:
+			return 2;
+		case BF_RGB888:
+			return 3;
+		case BF_ARGB8888:
+			return 4;
+	}
+}
+
+enum bit_format BitFormatToEnum( const char *name );
+
+// --snapshot: capture from a copy taken in one burst, optionally after vsync
+enum snapshot_mode {
+	SNAPSHOT_NONE,
+	SNAPSHOT_COPY,
+	SNAPSHOT_VSYNC,
+};
+
+// Statistics phases. Timings are accumulated from CLOCK_MONOTONIC across
+// every call made in that phase (e.g. once per row for convert)
+enum stat_phase {
+	PHASE_HEADER,
+	PHASE_DECODE,
+	PHASE_RESIZE,
+	PHASE_CONVERT,
+	PHASE_FB_READ,
+	PHASE_SNAPSHOT,
+	PHASE_FB_WRITE,
+	PHASE_ENCODE,
+	PHASE_COUNT
+};
+
+struct imgtool_stats {
+	int json;
+	uint64_t start_ns;
+	uint64_t phase_ns[PHASE_COUNT];
+	uint64_t phase_calls[PHASE_COUNT];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t rows;
+	uint64_t fb_syscalls;	/* write, writev and seeks streaming to the fb */
+	uint64_t first_pixel_ns;	/* when the first row reached the fb, 0 before */
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+};
+
+static inline uint64_t StatsNow(void)
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void StatsPhase( struct imgtool_stats *stats, enum stat_phase phase, uint64_t t0 )
+{
+	stats->phase_ns[phase] += StatsNow() - t0;
+	stats->phase_calls[phase]++;
+}
+
+// Instrumentation is a single predictable branch on conf->stats when --stats
+// is not given. Build with -DNO_STATS to remove it altogether.
+#ifndef NO_STATS
+#define STATS_BEGIN(conf)		((conf)->stats ? StatsNow() : 0)
+#define STATS_END(conf, phase, t0)	do { if ((conf)->stats) StatsPhase( (conf)->stats, (phase), (t0) ); } while (0)
+#define STATS_ADD(conf, field, n)	do { if ((conf)->stats) (conf)->stats->field += (n); } while (0)
+#define STATS_ALLOC(conf, bytes)	do { if ((conf)->stats) { (conf)->stats->allocs++; (conf)->stats->alloc_bytes += (bytes); } } while (0)
+#define STATS_MARK(conf, field)		do { if ((conf)->stats && !(conf)->stats->field) (conf)->stats->field = StatsNow(); } while (0)
+#else
+#define STATS_BEGIN(conf)		0
+#define STATS_END(conf, phase, t0)	do { (void)(t0); } while (0)
+#define STATS_ADD(conf, field, n)	do { } while (0)
+#define STATS_ALLOC(conf, bytes)	do { } while (0)
+#define STATS_MARK(conf, field)		do { } while (0)
+#endif
+
+// Per-operation arena. Row pointers, decoded rows, conversion scratch and
+// libpng's own allocations are carved out of one 64-byte aligned block that
+// is reserved up front from the image geometry. Nothing is freed piecemeal;
+// ArenaReset() drops everything at the start of the next operation. If an
+// estimate falls short, more blocks are chained on and merged into a single
+// block by the next reset.
+#define ARENA_ALIGN		64
+#define ARENA_ROUND(n)		(((size_t)(n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+};
+#define ARENA_HEADER		ARENA_ROUND(sizeof(struct arena_block))
+
+struct imgtool_arena {
+	struct arena_block *head;	// Current block, older ones follow
+	struct imgtool_stats *stats;	// Block allocations are counted here
+};
+
+// Engine entry points (libimgtool.c) used by the command line tool
+int fill_fb_defaults( struct imgtool_conf *conf );
+int FillRGB( struct imgtool_conf *conf );
+int FillRects( struct imgtool_conf *conf );
+int ShowImage( struct imgtool_conf *conf );
+int PlayAnimation( struct imgtool_conf *conf );
+int CaptureJpeg( struct imgtool_conf *conf );
+#ifndef NO_PNG
+int CapturePng( struct imgtool_conf *conf );
+#endif
+int RunBatch( struct imgtool_conf *conf );
+int BakeSequence( struct imgtool_conf *conf );
+int BakePyramid( struct imgtool_conf *conf );
+int ViewPyramid( struct imgtool_conf *conf );
+int CaptureRaw( struct imgtool_conf *conf, int header );
+void StatsReport( struct imgtool_stats *stats, const char *op, const char *filename, int result, FILE *f );
+extern int trace_enabled;
+int TraceWrite( const char *path );
+#ifdef IMGTOOL_BENCH
+int RunBench( struct imgtool_conf *conf );
+#endif
+
+#endif // IMGTOOL_INTERNAL_H
@@ -0,0 +1,9259 @@
+/**
+ * $Id$
+ * libimgtool.c
+ * Frame buffer draw, fill and capture engine behind imgtool, also usable
+ * in-process through the API in imgtool.h
+ * Copyright (C) 2007-2009 Chumby Industries. All rights reserved.
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fb.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#ifdef IMGTOOL_BENCH
+#include <linux/perf_event.h>
+#endif
+
+// libpng
+#ifndef NO_PNG
+#include <png.h>
+#include <zlib.h>
+#endif
+
+
+// jpeg
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "imgtool.h"
+#include "imgtool_internal.h"
+
+const char *bit_format_names[] = {
+	"rgb565",
+	"rgb888",
+	"bgr565",
+	"argb8888",
+	NULL
+};
+
+enum bit_format BitFormatToEnum( const char *name )
+{
+	int n;
+	for (n = 0; bit_format_names[n]; n++)
+		if (!strcasecmp( name, bit_format_names[n] ))
+			return (enum bit_format)n;
+	fprintf( stderr, "Error: unrecognized name %s\n", name );
+	fprintf( stderr, "Valid names are:\n" );
+	for (n = 0; bit_format_names[n]; n++)
+		fprintf( stderr, "  %s\n", bit_format_names[n] );
+	return (enum bit_format)-1;
+}
+
+// Statistics phase names, indexed by enum stat_phase
+static const char *stat_phase_names[] = {
+	"header",
+	"decode",
+	"resize",
+	"convert",
+	"fb_read",
+	"snapshot",
+	"fb_write",
+	"encode",
+	NULL
+};
+
+// Write a string as a JSON string literal
+static void JsonString( FILE *f, const char *s )
+{
+	fputc( '"', f );
+	for (; *s; s++)
+	{
+		unsigned char ch = (unsigned char)*s;
+		if (ch == '"' || ch == '\\')
+			fprintf( f, "\\%c", ch );
+		else if (ch < 0x20)
+			fprintf( f, "\\u%04x", ch );
+		else
+			fputc( ch, f );
+	}
+	fputc( '"', f );
+}
+
+// Report accumulated statistics, human-readable or as a single JSON object
+void StatsReport( struct imgtool_stats *stats, const char *op, const char *filename, int result, FILE *f )
+{
+	struct rusage ru;
+	int n;
+	double total_ms = (StatsNow() - stats->start_ns) / 1e6;
+
+	memset( &ru, 0, sizeof(ru) );
+	getrusage( RUSAGE_SELF, &ru );
+
+	if (stats->json)
+	{
+		fprintf( f, "{\"op\":" );
+		JsonString( f, op );
+		fprintf( f, ",\"file\":" );
+		JsonString( f, filename );
+		fprintf( f, ",\"result\":%d,\"total_ms\":%.3f,\"phases\":{", result, total_ms );
+		for (n = 0; n < PHASE_COUNT; n++)
+		{
+			fprintf( f, "%s\"%s\":{\"ms\":%.3f,\"calls\":%llu}", n ? "," : "",
+				stat_phase_names[n], stats->phase_ns[n] / 1e6,
+				(unsigned long long)stats->phase_calls[n] );
+		}
+		fprintf( f, "},\"bytes_read\":%llu,\"bytes_written\":%llu,\"rows\":%llu,\"fb_syscalls\":%llu,"
+			"\"first_pixel_ms\":%.3f,\"peak_rss_kb\":%ld,\"allocs\":%llu,\"alloc_bytes\":%llu}\n",
+			(unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+			(unsigned long long)stats->rows, (unsigned long long)stats->fb_syscalls,
+			stats->first_pixel_ns ? (stats->first_pixel_ns - stats->start_ns) / 1e6 : -1.0, ru.ru_maxrss,
+			(unsigned long long)stats->allocs, (unsigned long long)stats->alloc_bytes );
+		return;
+	}
+
+	fprintf( f, "Stats for %s %s (result %d): total %.3f ms\n", op, filename, result, total_ms );
+	for (n = 0; n < PHASE_COUNT; n++)
+	{
+		if (!stats->phase_calls[n])
+			continue;
+		fprintf( f, "  %-10s %10.3f ms  %8llu calls\n", stat_phase_names[n],
+			stats->phase_ns[n] / 1e6, (unsigned long long)stats->phase_calls[n] );
+	}
+	fprintf( f, "  bytes read %llu, bytes written %llu, rows %llu\n",
+		(unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+		(unsigned long long)stats->rows );
+	if (stats->fb_syscalls)
+		fprintf( f, "  frame buffer write syscalls %llu\n", (unsigned long long)stats->fb_syscalls );
+	if (stats->first_pixel_ns)
+		fprintf( f, "  first pixel at %.3f ms\n", (stats->first_pixel_ns - stats->start_ns) / 1e6 );
+	fprintf( f, "  peak rss %ld KiB, allocations %llu (%llu bytes)\n", ru.ru_maxrss,
+		(unsigned long long)stats->allocs, (unsigned long long)stats->alloc_bytes );
+}
+
+
+#define ARENA_MIN_BLOCK		(64*1024)
+
+static struct arena_block *ArenaNewBlock( struct imgtool_arena *a, size_t size )
+{
+	struct arena_block *b;
+	void *p;
+
+	if (posix_memalign( &p, ARENA_ALIGN, ARENA_HEADER + size ))
+		return NULL;
+	b = (struct arena_block *)p;
+	b->size = size;
+	b->used = 0;
+	b->next = a->head;
+	a->head = b;
+#ifndef NO_STATS
+	if (a->stats)
+	{
+		a->stats->allocs++;
+		a->stats->alloc_bytes += size;
+	}
+#endif
+	return b;
+}
+
+static void *ArenaAlloc( struct imgtool_arena *a, size_t bytes )
+{
+	struct arena_block *b = a->head;
+	void *p;
+
+	bytes = ARENA_ROUND(bytes ? bytes : 1);
+	if (!b || b->size - b->used < bytes)
+	{
+		b = ArenaNewBlock( a, bytes > ARENA_MIN_BLOCK ? bytes : ARENA_MIN_BLOCK );
+		if (!b)
+			return NULL;
+	}
+	p = (unsigned char *)b + ARENA_HEADER + b->used;
+	b->used += bytes;
+	return p;
+}
+
+// Make sure the next bytes worth of allocations come from one block
+static int ArenaReserve( struct imgtool_arena *a, size_t bytes )
+{
+	bytes = ARENA_ROUND(bytes);
+	if (a->head && a->head->size - a->head->used >= bytes)
+		return 0;
+	if (a->head && !a->head->used && !a->head->next)
+	{
+		free( a->head );
+		a->head = NULL;
+	}
+	return ArenaNewBlock( a, bytes ) ? 0 : -1;
+}
+
+static void ArenaReset( struct imgtool_arena *a )
+{
+	struct arena_block *b, *next;
+	size_t total = 0;
+
+	if (a->head && a->head->next)
+	{
+		for (b = a->head; b; b = next)
+		{
+			next = b->next;
+			total += b->size;
+			free( b );
+		}
+		a->head = NULL;
+		ArenaNewBlock( a, total );
+	}
+	else if (a->head)
+		a->head->used = 0;
+}
+
+// Trace events (--trace=path), written as Chrome trace-event JSON.
+// Each thread appends fixed-size records to its own ring buffer without
+// locking, overwriting its oldest events once full, so tracing can stay on
+// in a long-running process. Buffers are linked onto a global list with a
+// compare-and-swap the first time a thread records an event; when the
+// thread exits its buffer is left to the next new thread, events and all,
+// so worker threads created per call do not add a buffer each. Nothing is
+// formatted until TraceWrite().
+#define TRACE_MAX_EVENTS	65536	// Per buffer; older events are overwritten and counted as dropped
+
+struct trace_event {
+	const char *cat;	// Static strings only
+	const char *name;
+	uint64_t ts_ns;
+	uint32_t arg;		// Row number (or 0)
+	pid_t tid;		// Buffers outlive their threads
+	char ph;		// 'B'egin or 'E'nd
+};
+
+struct trace_buffer {
+	struct trace_buffer *next;
+	int in_use;		// Owned by a live thread
+	uint64_t count;		// Events ever recorded; the last TRACE_MAX_EVENTS are kept
+	struct trace_event events[TRACE_MAX_EVENTS];
+};
+
+int trace_enabled;
+static struct trace_buffer *trace_buffers;
+static __thread struct trace_buffer *trace_local;
+static __thread pid_t trace_tid;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+// Thread exit: the buffer is free for the next thread
+static void TraceRelease( void *arg )
+{
+	struct trace_buffer *buf = (struct trace_buffer *)arg;
+	__sync_lock_release( &buf->in_use );
+}
+
+static void TraceKeyCreate(void)
+{
+	pthread_key_create( &trace_key, TraceRelease );
+}
+
+static struct trace_buffer *TraceBuffer(void)
+{
+	struct trace_buffer *buf = trace_local;
+	if (buf)
+		return buf;
+	pthread_once( &trace_once, TraceKeyCreate );
+	for (buf = trace_buffers; buf; buf = buf->next)
+		if (__sync_bool_compare_and_swap( &buf->in_use, 0, 1 ))
+			break;
+	if (!buf)
+	{
+		buf = (struct trace_buffer *)calloc( 1, sizeof(*buf) );
+		if (!buf)
+			return NULL;
+		buf->in_use = 1;
+		do {
+			buf->next = trace_buffers;
+		} while (!__sync_bool_compare_and_swap( &trace_buffers, buf->next, buf ));
+	}
+	trace_tid = (pid_t)syscall( SYS_gettid );
+	trace_local = buf;
+	pthread_setspecific( trace_key, buf );
+	return buf;
+}
+
+static void TraceEvent( const char *cat, const char *name, char ph, uint32_t arg )
+{
+	struct trace_buffer *buf = TraceBuffer();
+	struct trace_event *ev;
+	if (!buf)
+		return;
+	ev = &buf->events[buf->count % TRACE_MAX_EVENTS];
+	ev->cat = cat;
+	ev->name = name;
+	ev->ph = ph;
+	ev->arg = arg;
+	ev->tid = trace_tid;
+	ev->ts_ns = StatsNow();
+	buf->count++;
+}
+
+#ifndef NO_TRACE
+#define TRACE_BEGIN(cat, name, arg)	do { if (trace_enabled) TraceEvent( (cat), (name), 'B', (arg) ); } while (0)
+#define TRACE_END(cat, name, arg)	do { if (trace_enabled) TraceEvent( (cat), (name), 'E', (arg) ); } while (0)
+#else
+#define TRACE_BEGIN(cat, name, arg)	do { } while (0)
+#define TRACE_END(cat, name, arg)	do { } while (0)
+#endif
+
+// Row batches group the per-row events; a batch boundary is emitted every
+// TRACE_BATCH_ROWS source rows
+#define TRACE_BATCH_ROWS	16
+#define TRACE_BATCH(row)	do { if (((row) % TRACE_BATCH_ROWS) == 0) { \
+					if (row) TRACE_END( "rows", "row_batch", (row) - TRACE_BATCH_ROWS ); \
+					TRACE_BEGIN( "rows", "row_batch", (row) ); } } while (0)
+#define TRACE_BATCH_DONE(row)	do { if (row) TRACE_END( "rows", "row_batch", ((row) - 1) / TRACE_BATCH_ROWS * TRACE_BATCH_ROWS ); } while (0)
+
+// Write all recorded events to path as Chrome trace-event JSON
+int TraceWrite( const char *path )
+{
+	struct trace_buffer *buf;
+	struct trace_event *ev;
+	FILE *f = fopen( path, "w" );
+	int pid = getpid();
+	int first = 1;
+	pid_t tid;
+	uint64_t n, start, dropped = 0;
+
+	if (!f)
+	{
+		fprintf( stderr, "Error: cannot open %s for trace output, errno=%d (%s)\n", path, errno, strerror(errno) );
+		return -1;
+	}
+	fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	for (buf = trace_buffers; buf; buf = buf->next)
+	{
+		// Oldest kept event first; a thread name whenever the owner changes
+		start = buf->count > TRACE_MAX_EVENTS ? buf->count - TRACE_MAX_EVENTS : 0;
+		dropped += start;
+		for (n = start, tid = 0; n < buf->count; n++)
+		{
+			ev = &buf->events[n % TRACE_MAX_EVENTS];
+			if (ev->tid != tid)
+			{
+				tid = ev->tid;
+				fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", pid, (int)tid, tid == pid ? "main" : "worker" );
+				first = 0;
+			}
+			fprintf( f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"row\":%u}}",
+				ev->name, ev->cat, ev->ph, (unsigned long long)(ev->ts_ns / 1000), (unsigned int)(ev->ts_ns % 1000),
+				pid, (int)ev->tid, ev->arg );
+		}
+	}
+	fprintf( f, "\n],\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped );
+	fclose( f );
+	if (dropped)
+		fprintf( stderr, "Warning: %llu oldest trace events overwritten (ring of %d per thread)\n",
+			(unsigned long long)dropped, TRACE_MAX_EVENTS );
+	return 0;
+}
+
+// Frame buffer is <x_size> x <y_size> 16bpp r5 g6 b5
+// or <x_size> x <y_size> 24bpp r8 g8 b8
+// or <x_size> x <y_size> 32bpp a8 r8 g8 b8
+
+// Header on disk for BMP files
+#if 0
+#pragma pack(2)
+typedef struct _BitmapInfoHeader {
+// Offsets are from start of file
+// All values are little-endian with low order byte coming first. Use GetWord or GetDword
+	static unsigned short GetWord( const unsigned char *b ) { return b[0] | (b[1]<<8); }
+	static void SetWord( unsigned char *pb, unsigned short w ) { pb[0] = w&0xff; pb[1] = (w&0xff00)>>8; }
+	static unsigned long GetDword( const unsigned char *b ) { return b[0] | (b[1]<<8) | (b[2]<<16) | (b[3]<<24); }
+	static void SetDword( unsigned char *pb, unsigned long dw ) { pb[0] = dw&0xff; pb[1] = (dw&0xff00)>>8; pb[2] = (dw&0xff0000)>>16; pb[3] = (dw&0xff000000)>>24; }
+//14 0x0e 4 size of BITMAPINFOHEADER structure which includes the header size, normally 40
+	unsigned char dwHeaderSize[4];
+	unsigned long GetHeaderSize() const { return GetDword(dwHeaderSize); }
+	void SetHeaderSize( unsigned long dw ) { SetDword(dwHeaderSize,dw); }
+//18 0x12 4 image width in pixels
+	unsigned char dwImageWidth[4];
+	unsigned long GetImageWidth() const { return GetDword(dwImageWidth); }
+	void SetImageWidth( unsigned long dw ) { SetDword(dwImageWidth,dw); }
+//22 0x16 4 image height in pixels
+	unsigned char dwImageHeight[4];
+	unsigned long GetImageHeight() const { return GetDword(dwImageHeight); }
+	void SetImageHeight( unsigned long dw ) { SetDword(dwImageHeight,dw); }
+//26 0x1a 2 number of planes in the image, must be 1
+	unsigned char wPlanes[2];
+	unsigned short GetPlanes() const { return GetWord(wPlanes); }
+	void SetPlanes( unsigned short w ) { SetWord(wPlanes,w); }
+//28 0x1c 2 number of bits per pixel (1, 4, 8, or 24)
+	unsigned char wBitsPerPixel[2];
+	unsigned short GetBitsPerPixel() const { return GetWord(wBitsPerPixel); }
+	void SetBitsPerPixel( unsigned short w ) { SetWord(wBitsPerPixel,w); }
+//30 0x1e 4 compression type (0=none, 1=RLE-8, 2=RLE-4)
+	unsigned char dwCompressionType[4];
+	unsigned long GetCompressionType() const { return GetDword(dwCompressionType); }
+	void SetCompressionType( unsigned long dw ) { SetDword(dwCompressionType,dw); }
+//34 0x22 4 size of image data in bytes (including padding)
+	unsigned char dwImageDataLength[4];
+	unsigned long GetImageDataLength() const { return GetDword(dwImageDataLength); }
+	void SetImageDataLength( unsigned long dw ) { SetDword(dwImageDataLength,dw); }
+//38 0x26 4 horizontal resolution in pixels per meter (unreliable)
+	unsigned char dwHorizontalPixPerMeter[4];
+//42 0x2a 4 vertical resolution in pixels per meter (unreliable)
+	unsigned char dwVerticalPixPerMeter[4];
+//46 0x2e 4 number of colors in image, or zero
+	unsigned char dwColors[4];
+//50 0x32 4 number of important colors, or zero
+	unsigned char dwImportantColors[4];
+//54 0x36 0-16 undefined
+//70 0x46 usual start of data
+} BitmapInfoHeader_t;
+
+// What to read from start of file to get the image data offset. This is always followed
+// immediately by the bitmap info header (Windows) or bitmap core header (OS/2)
+typedef struct _BMPFileHeader {
+// All values are little-endian with low order byte coming first. Use GetWord or GetDword
+//0  0x00 2  signature, must be 'BM'
+	unsigned char wSig[2];
+	bool IsBMP() const { return wSig[0]=='B' && wSig[1]=='M'; }
+//2  0x02 4 size of BMP file in bytes (unreliable)
+	unsigned char dwFilesize[4];
+	void SetFilesize(unsigned long dw) { BitmapInfoHeader_t::SetDword(dwFilesize,dw); }
+//6  0x06 2 reserved, must be zero
+	unsigned char _rsvd1[2];
+//8  0x08 2 reserved, must be zero
+	unsigned char _rsvd2[2];
+//10 0x0a 4 offset to start of image data in bytes
+	unsigned char dwImageDataOffset[4];
+	unsigned long GetImageDataOffset() const { return BitmapInfoHeader_t::GetDword(dwImageDataOffset); }
+	void SetImageDataOffset(unsigned long dw) { BitmapInfoHeader_t::SetDword(dwImageDataOffset,dw); }
+} BMPFileHeader_t;
+
+// Structure containing the minimum we should find at start of file
+typedef struct _BMPHeader {
+	BMPFileHeader_t fileHeader;
+	BitmapInfoHeader_t infoHeader;
+} BMPHeader_t;
+#pragma pack()
+#endif
+
+// Open output file in specified format. Existing files are not truncated
+// here; FBOpen() decides whether one can stand in for a frame buffer.
+static int OpenOutput(int width, int height, char *dest, uint8_t isOutput)
+{
+	int openFlags = isOutput ? O_RDWR | O_CREAT : O_RDONLY;
+	return open( dest, openFlags, 0644 );
+}
+
+
+// Generic write to frame buffer.
+// Returns bytes written
+static int WriteFB( int fb_handle, void *data, int length )
+{
+	unsigned char *_data = (unsigned char *)data;
+	return write( fb_handle, _data, length );
+}
+
+// Frame buffer backend.
+// A frame buffer device is mapped, using the line length it reports as the
+// stride. A regular file (or memfd) at least stride*height bytes long is
+// mapped as a stand-in with the configured geometry, bit format and stride.
+// Anything else - pipe, socket, new or short file - is streamed with packed
+// rows. A library context keeps its mapping in conf->fb, which FBOpen()
+// lends out and FBClose() leaves alone.
+//
+// Streamed rows are gathered into wbuf and handed to writev() in batches
+// rather than one write() per row, which is what a network-exported frame
+// buffer pays for. Zero rows cost nothing to gather: on a pipe or socket
+// they point at fb_zero, and on a regular file they are skipped with
+// lseek() and left as holes, with ftruncate() extending a trailing run.
+#define FB_WRITE_BYTES	(256*1024)	// Converted rows gathered per writev()
+#define FB_WRITE_IOVS	64		// iovecs per writev()
+#define FB_ZERO_BYTES	(64*1024)
+
+// Never written, so its pages stay mapped to the kernel's shared zero page
+static unsigned char fb_zero[FB_ZERO_BYTES];
+
+struct fb_dev {
+	int fd;
+	enum bit_format fmt;
+	unsigned int width, height;
+	unsigned int row_bytes;		// width * bytes per pixel
+	unsigned int stride;		// Bytes from the start of one line to the next
+	unsigned char *mem;		// Mapping, NULL when streaming
+	size_t size;			// Length of mapping
+	int shared;			// Borrowed from conf->fb
+
+	// Streaming only
+	unsigned char *wbuf;		// Rows waiting for writev(), FB_WRITE_BYTES
+	size_t wlen;			// Bytes of wbuf in use
+	struct iovec iov[FB_WRITE_IOVS];
+	int iovcnt;
+	off_t hole;			// Zero bytes to skip before the next write
+	int sparse;			// Regular file: zero rows become holes
+	int werr;			// errno of the first failed write, sticky
+	struct imgtool_stats *stats;
+
+	// Snapshot: mem is a private copy and map the real mapping (if any)
+	int snapshot;
+	unsigned char *map;
+	uint64_t snap_done_ns;
+	int quiet;
+
+	// Damage tracking (--damage, mapped output only)
+	int device;			// A frame buffer device, not a stand-in file
+	int damage;
+	int flush;			// msync() each damaged rectangle
+	unsigned int dmg_x0, dmg_y0, dmg_x1, dmg_y1;	// Open band of changed rows
+	unsigned int dmg_rects;
+	uint64_t dmg_bytes;
+};
+
+// What a frame buffer shows is recorded (--skipsame) in a state file named
+// for its device and inode, so links and aliases of one device share it.
+// Anything opening the frame buffer for output removes the file first.
+#ifndef IMGTOOL_STATE_DIR
+#define IMGTOOL_STATE_DIR	"/run/imgtool"
+#endif
+
+static void DrawStatePath( char *path, size_t len, const struct stat *st )
+{
+	snprintf( path, len, IMGTOOL_STATE_DIR "/fb-%llx-%llx", (unsigned long long)st->st_dev,
+		(unsigned long long)st->st_ino );
+}
+
+static void DrawStateForget( const struct stat *st )
+{
+	char path[256];
+
+	DrawStatePath( path, sizeof(path), st );
+	unlink( path );
+}
+
+static int FBOpenDevice( struct fb_dev *fb, struct imgtool_conf *conf, int isOutput )
+{
+	struct stat st;
+	struct fb_fix_screeninfo fix;
+
+	if (conf->fb)
+	{
+		*fb = *conf->fb;
+		fb->shared = 1;
+		return 0;
+	}
+	memset( fb, 0, sizeof(*fb) );
+	fb->fmt = conf->fmt;
+	fb->width = conf->width;
+	fb->height = conf->height;
+	fb->row_bytes = BytesPerFBPixel(conf->fmt) * conf->width;
+	fb->stride = conf->stride > fb->row_bytes ? conf->stride : fb->row_bytes;
+	fb->stats = conf->stats;
+	PROGRESS( conf, "Opening %s for %s\n", isOutput ? "output" : "input", conf->output );
+	fb->fd = OpenOutput( conf->width, conf->height, conf->output, isOutput );
+	if (fb->fd < 0)
+	{
+		fprintf( stderr, "Error: could not open %s, errno=%d (%s)\n", conf->output, errno, strerror(errno) );
+		return -1;
+	}
+	if (fstat( fb->fd, &st ) == -1)
+		memset( &st, 0, sizeof(st) );
+	else if (isOutput)
+		DrawStateForget( &st );
+
+	if (S_ISCHR( st.st_mode ))
+	{
+		fb->device = 1;
+		if (ioctl( fb->fd, FBIOGET_FSCREENINFO, &fix ) == 0 && fix.line_length >= fb->row_bytes)
+			fb->stride = fix.line_length;
+	}
+	else if (!S_ISREG( st.st_mode ) || st.st_size < (off_t)fb->stride * fb->height)
+	{
+		// Stream; files are rewritten from the start as open(O_TRUNC) did
+		if (S_ISREG( st.st_mode ) && isOutput && ftruncate( fb->fd, 0 ) == -1)
+			fprintf( stderr, "Warning: could not truncate %s, errno=%d (%s)\n", conf->output, errno, strerror(errno) );
+		else if (S_ISREG( st.st_mode ) && isOutput)
+			fb->sparse = 1;
+		return 0;
+	}
+
+	fb->size = (size_t)fb->stride * fb->height;
+	fb->mem = (unsigned char *)mmap( 0, fb->size, isOutput ? PROT_READ | PROT_WRITE : PROT_READ,
+				MAP_SHARED, fb->fd, 0 );
+	if (fb->mem == MAP_FAILED)
+	{
+		PROGRESS( conf, "Unable to mmap %s (errno=%d), using write()\n", conf->output, errno );
+		fb->mem = NULL;
+		fb->size = 0;
+	}
+	return 0;
+}
+
+// Write out everything gathered so far, then any hole owed before the next
+// row. Returns 0, or -1 with fb->werr set once any write has failed.
+static int FBFlush( struct fb_dev *fb )
+{
+	struct iovec *iov = fb->iov;
+	int cnt = fb->iovcnt;
+	ssize_t n;
+
+	while (cnt > 0 && !fb->werr)
+	{
+		n = writev( fb->fd, iov, cnt );
+		STATS_ADD(fb, fb_syscalls, 1);
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			fb->werr = n < 0 ? errno : EIO;
+			break;
+		}
+		// Partial write (pipe, socket): step over what went
+		while (cnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	fb->iovcnt = 0;
+	fb->wlen = 0;
+	return fb->werr ? -1 : 0;
+}
+
+// Append len bytes at base to the pending writev(), flushing first if full.
+// Runs that continue the previous iovec (successive rows in wbuf) extend it.
+static int FBQueue( struct fb_dev *fb, const void *base, size_t len )
+{
+	struct iovec *last = fb->iovcnt ? &fb->iov[fb->iovcnt - 1] : NULL;
+
+	if (last && (const char *)last->iov_base + last->iov_len == (const char *)base)
+	{
+		last->iov_len += len;
+		return 0;
+	}
+	if (fb->iovcnt == FB_WRITE_IOVS && FBFlush( fb ) < 0)
+		return -1;
+	fb->iov[fb->iovcnt].iov_base = (void *)base;
+	fb->iov[fb->iovcnt].iov_len = len;
+	fb->iovcnt++;
+	return 0;
+}
+
+// Skip a pending hole in a sparse output before writing past it
+static int FBSeekHole( struct fb_dev *fb )
+{
+	if (!fb->hole)
+		return 0;
+	if (FBFlush( fb ) < 0)
+		return -1;
+	STATS_ADD(fb, fb_syscalls, 1);
+	if (lseek( fb->fd, fb->hole, SEEK_CUR ) == (off_t)-1)
+	{
+		fb->werr = errno;
+		return -1;
+	}
+	fb->hole = 0;
+	return 0;
+}
+
+// Damage-aware drawing (--damage). Each row is compared with what the
+// mapping already shows and only the span from the first to the last byte
+// that differs is stored; rows that are the same are not touched at all.
+// Consecutive changed rows make up a damaged rectangle. On a frame buffer
+// device each rectangle is msync()ed as it closes, which is what makes
+// deferred I/O drivers (SPI, USB panels) push the pages that were written,
+// so the bytes sent to the panel follow what actually changed.
+#define FB_DAMAGE_REPORT	16	// Rectangles listed before just counting
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// First of len bytes at a and b that differs, len if none
+static size_t FBDiffLeft( const unsigned char *a, const unsigned char *b, size_t len )
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16)
+	{
+		unsigned int m = 0xffff ^ _mm_movemask_epi8( _mm_cmpeq_epi8(
+			_mm_loadu_si128( (const __m128i *)(a + i) ), _mm_loadu_si128( (const __m128i *)(b + i) ) ) );
+		if (m)
+			return i + __builtin_ctz( m );
+	}
+#endif
+	while (i < len && a[i] == b[i])
+		i++;
+	return i;
+}
+
+// One past the last of len bytes at a and b that differs, no lower than stop
+static size_t FBDiffRight( const unsigned char *a, const unsigned char *b, size_t len, size_t stop )
+{
+	size_t i = len;
+
+#ifdef __SSE2__
+	for (; i >= stop + 16; i -= 16)
+	{
+		unsigned int m = 0xffff ^ _mm_movemask_epi8( _mm_cmpeq_epi8(
+			_mm_loadu_si128( (const __m128i *)(a + i - 16) ), _mm_loadu_si128( (const __m128i *)(b + i - 16) ) ) );
+		if (m)
+			return i - 16 + 32 - __builtin_clz( m );
+	}
+#endif
+	while (i > stop && a[i - 1] == b[i - 1])
+		i--;
+	return i;
+}
+
+// Close the open band of changed rows
+static void FBDamageClose( struct fb_dev *fb )
+{
+	unsigned int bpp = BytesPerFBPixel(fb->fmt);
+	size_t start, end, page;
+
+	if (fb->dmg_y1 <= fb->dmg_y0)
+		return;
+	fb->dmg_rects++;
+	if (!fb->quiet && fb->dmg_rects <= FB_DAMAGE_REPORT)
+		fprintf( stderr, "Damaged %ux%u+%u+%u\n", fb->dmg_x1 - fb->dmg_x0, fb->dmg_y1 - fb->dmg_y0,
+			fb->dmg_x0, fb->dmg_y0 );
+	if (fb->flush)
+	{
+		page = sysconf( _SC_PAGESIZE );
+		start = ((size_t)fb->dmg_y0 * fb->stride + (size_t)fb->dmg_x0 * bpp) & ~(page - 1);
+		end = (size_t)(fb->dmg_y1 - 1) * fb->stride + (size_t)fb->dmg_x1 * bpp;
+		STATS_ADD(fb, fb_syscalls, 1);
+		// Drivers without deferred I/O have nothing to sync: stop asking
+		if (msync( fb->mem + start, end - start, MS_SYNC ) == -1)
+			fb->flush = 0;
+	}
+	fb->dmg_y0 = fb->dmg_y1 = 0;
+}
+
+// Store the part of src that differs from what row shows
+static void FBDamageRow( struct fb_dev *fb, unsigned int row, const unsigned char *src )
+{
+	unsigned char *dst = fb->mem + (size_t)row * fb->stride;
+	unsigned int bpp = BytesPerFBPixel(fb->fmt), x0, x1;
+	size_t l = FBDiffLeft( dst, src, fb->row_bytes ), r;
+
+	if (l == fb->row_bytes)
+	{
+		FBDamageClose( fb );
+		return;
+	}
+	r = FBDiffRight( dst, src, fb->row_bytes, l );
+	x0 = l / bpp;
+	x1 = (r + bpp - 1) / bpp;
+	memcpy( dst + (size_t)x0 * bpp, src + (size_t)x0 * bpp, (size_t)(x1 - x0) * bpp );
+	fb->dmg_bytes += (size_t)(x1 - x0) * bpp;
+	if (fb->dmg_y1 > fb->dmg_y0 && fb->dmg_y1 == row)
+	{
+		fb->dmg_y1++;
+		if (x0 < fb->dmg_x0)
+			fb->dmg_x0 = x0;
+		if (x1 > fb->dmg_x1)
+			fb->dmg_x1 = x1;
+		return;
+	}
+	FBDamageClose( fb );
+	fb->dmg_y0 = row;
+	fb->dmg_y1 = row + 1;
+	fb->dmg_x0 = x0;
+	fb->dmg_x1 = x1;
+}
+
+// Write one packed row. Rows must be written in order when streaming.
+// Returns bytes written (or accepted for the next flush), -1 on error
+static int FBWriteRow( struct fb_dev *fb, unsigned int row, const unsigned char *data )
+{
+	STATS_MARK(fb, first_pixel_ns);
+	if (fb->mem)
+	{
+		if (row >= fb->height)
+			return 0;
+		if (fb->damage)
+			FBDamageRow( fb, row, data );
+		else
+			memcpy( fb->mem + (size_t)row * fb->stride, data, fb->row_bytes );
+		return fb->row_bytes;
+	}
+	if (fb->werr || FBSeekHole( fb ) < 0)
+		return -1;
+	if (!fb->wbuf && fb->row_bytes <= FB_WRITE_BYTES)
+		fb->wbuf = (unsigned char *)malloc( FB_WRITE_BYTES );
+	if (!fb->wbuf)
+	{
+		// Nowhere to gather: write it straight out behind anything pending
+		if (FBFlush( fb ) < 0)
+			return -1;
+		STATS_ADD(fb, fb_syscalls, 1);
+		return WriteFB( fb->fd, (void *)data, fb->row_bytes );
+	}
+	if (fb->wlen + fb->row_bytes > FB_WRITE_BYTES && FBFlush( fb ) < 0)
+		return -1;
+	memcpy( fb->wbuf + fb->wlen, data, fb->row_bytes );
+	if (FBQueue( fb, fb->wbuf + fb->wlen, fb->row_bytes ) < 0)
+		return -1;
+	fb->wlen += fb->row_bytes;
+	return fb->row_bytes;
+}
+
+// Write count rows of zeros starting at row. Returns 0, -1 on error
+static int FBWriteZeroRows( struct fb_dev *fb, unsigned int row, unsigned int count )
+{
+	size_t len = (size_t)count * fb->row_bytes;
+	size_t n;
+
+	if (fb->mem)
+	{
+		for (; count && row < fb->height; count--, row++)
+			if (fb->damage && fb->row_bytes <= FB_ZERO_BYTES)
+				FBDamageRow( fb, row, fb_zero );
+			else
+				memset( fb->mem + (size_t)row * fb->stride, 0, fb->row_bytes );
+		return 0;
+	}
+	if (fb->werr)
+		return -1;
+	if (fb->sparse)
+	{
+		fb->hole += len;
+		return 0;
+	}
+	while (len)
+	{
+		struct iovec *last = fb->iovcnt ? &fb->iov[fb->iovcnt - 1] : NULL;
+		if (last && last->iov_base == fb_zero && last->iov_len < FB_ZERO_BYTES)
+		{
+			// Top up the previous zero run as far as fb_zero reaches
+			n = FB_ZERO_BYTES - last->iov_len;
+			if (n > len)
+				n = len;
+			last->iov_len += n;
+		}
+		else
+		{
+			n = len < FB_ZERO_BYTES ? len : FB_ZERO_BYTES;
+			if (FBQueue( fb, fb_zero, n ) < 0)
+				return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+// Get one row in native format: a pointer into the mapping, or buf filled by
+// read() when streaming. Returns NULL on a short read.
+static const unsigned char *FBReadRow( struct fb_dev *fb, unsigned int row, unsigned char *buf )
+{
+	unsigned int got = 0;
+	int n;
+
+	if (fb->mem)
+		return row < fb->height ? fb->mem + (size_t)row * fb->stride : NULL;
+	while (got < fb->row_bytes)
+	{
+		n = read( fb->fd, buf + got, fb->row_bytes - got );
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return NULL;
+		}
+		got += n;
+	}
+	return buf;
+}
+
+// Flush anything still gathered and close. Returns 0, or -1 if any
+// streamed write failed along the way.
+static int FBClose( struct fb_dev *fb )
+{
+	off_t end;
+
+	if (fb->snapshot)
+	{
+		if (!fb->quiet)
+			fprintf( stderr, "Encoded from snapshot in %.3f ms\n", (StatsNow() - fb->snap_done_ns) / 1e6 );
+		free( fb->mem );
+		fb->mem = fb->map;
+		fb->snapshot = 0;
+	}
+	if (fb->damage)
+	{
+		FBDamageClose( fb );
+		if (!fb->quiet)
+			fprintf( stderr, "Damage: %u rectangle%s, %llu of %llu bytes written\n", fb->dmg_rects,
+				fb->dmg_rects == 1 ? "" : "s", (unsigned long long)fb->dmg_bytes,
+				(unsigned long long)fb->row_bytes * fb->height );
+		fb->damage = 0;
+	}
+	if (fb->shared)
+		return 0;
+	if (fb->mem)
+		munmap( fb->mem, fb->size );
+	else if (fb->fd >= 0 && FBFlush( fb ) == 0 && fb->hole)
+	{
+		// A trailing zero run: extend the file over it
+		end = lseek( fb->fd, 0, SEEK_CUR );
+		STATS_ADD(fb, fb_syscalls, 2);
+		if (end == (off_t)-1 || ftruncate( fb->fd, end + fb->hole ) == -1)
+			fb->werr = errno;
+		fb->hole = 0;
+	}
+	if (fb->werr)
+		fprintf( stderr, "Error: write to frame buffer failed, errno=%d (%s)\n", fb->werr, strerror(fb->werr) );
+	if (fb->fd >= 0)
+		close( fb->fd );
+	free( fb->wbuf );
+	fb->wbuf = NULL;
+	fb->mem = NULL;
+	fb->fd = -1;
+	return fb->werr ? -1 : 0;
+}
+
+// Snapshot copy. Frame buffer memory is usually mapped write-combining or
+// uncached, where ordinary loads crawl; SSE4.1 streaming loads (MOVNTDQA)
+// fetch whole lines from it instead. Elsewhere memcpy() already uses the
+// widest loads the CPU has.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <smmintrin.h>
+
+__attribute__((target("sse4.1")))
+static void FBCopyStream( unsigned char *dst, const unsigned char *src, size_t len )
+{
+	size_t n;
+
+	for (n = 0; n + 64 <= len; n += 64)
+	{
+		__m128i a = _mm_stream_load_si128( (__m128i *)(src + n) );
+		__m128i b = _mm_stream_load_si128( (__m128i *)(src + n + 16) );
+		__m128i c = _mm_stream_load_si128( (__m128i *)(src + n + 32) );
+		__m128i d = _mm_stream_load_si128( (__m128i *)(src + n + 48) );
+		_mm_storeu_si128( (__m128i *)(dst + n), a );
+		_mm_storeu_si128( (__m128i *)(dst + n + 16), b );
+		_mm_storeu_si128( (__m128i *)(dst + n + 32), c );
+		_mm_storeu_si128( (__m128i *)(dst + n + 48), d );
+	}
+	memcpy( dst + n, src + n, len - n );
+}
+
+static const char *FBCopy( unsigned char *dst, const unsigned char *src, size_t len )
+{
+	if (!((uintptr_t)src & 15) && __builtin_cpu_supports( "sse4.1" ))
+	{
+		FBCopyStream( dst, src, len );
+		return "streaming loads";
+	}
+	memcpy( dst, src, len );
+	return "memcpy";
+}
+#else
+static const char *FBCopy( unsigned char *dst, const unsigned char *src, size_t len )
+{
+	memcpy( dst, src, len );
+	return "memcpy";
+}
+#endif
+
+// Copy the whole frame buffer to private memory in one burst, optionally
+// just after a vertical sync, and point mem at the copy so the encoder
+// reads a frame that cannot change under it. A streamed frame buffer is
+// read in one go. Falls back to live reads if memory is short.
+static void FBSnapshot( struct fb_dev *fb, struct imgtool_conf *conf )
+{
+	unsigned char *copy;
+	const char *how = "read";
+	size_t len = fb->mem ? fb->size : (size_t)fb->row_bytes * fb->height;
+	size_t got = 0;
+	uint64_t t0, t1;
+	__u32 crtc = 0;
+	ssize_t n;
+
+	if (posix_memalign( (void **)&copy, 64, len ))
+	{
+		fprintf( stderr, "Warning: no memory for a %zu byte snapshot, reading live\n", len );
+		return;
+	}
+	STATS_ALLOC(conf, len);
+
+	t0 = StatsNow();
+	if (conf->snapshot == SNAPSHOT_VSYNC && ioctl( fb->fd, FBIO_WAITFORVSYNC, &crtc ) == -1)
+		PROGRESS( conf, "No vsync from %s (errno=%d), copying now\n", conf->output, errno );
+	t1 = StatsNow();
+
+	if (fb->mem)
+		how = FBCopy( copy, fb->mem, len );
+	else
+	{
+		while (got < len)
+		{
+			n = read( fb->fd, copy + got, len - got );
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+					continue;
+				// Short frame: leave the rest to FBReadRow()'s error path
+				memset( copy + got, 0, len - got );
+				fprintf( stderr, "Warning: snapshot short by %zu bytes\n", len - got );
+				break;
+			}
+			got += n;
+		}
+		fb->stride = fb->row_bytes;
+		fb->size = len;
+	}
+	fb->snap_done_ns = StatsNow();
+	if (conf->stats)
+	{
+		conf->stats->phase_ns[PHASE_SNAPSHOT] += fb->snap_done_ns - t1;
+		conf->stats->phase_calls[PHASE_SNAPSHOT]++;
+	}
+	PROGRESS( conf, "Snapshot of %zu bytes in %.3f ms (%s)", len, (fb->snap_done_ns - t1) / 1e6, how );
+	if (conf->snapshot == SNAPSHOT_VSYNC)
+		PROGRESS( conf, " after %.3f ms waiting for vsync", (t1 - t0) / 1e6 );
+	PROGRESS( conf, "\n" );
+
+	fb->map = fb->mem;
+	fb->mem = copy;
+	fb->snapshot = 1;
+	fb->quiet = conf->quiet;
+}
+
+// Open the frame buffer; captures with --snapshot get the copy
+static int FBOpen( struct fb_dev *fb, struct imgtool_conf *conf, int isOutput )
+{
+	if (FBOpenDevice( fb, conf, isOutput ) < 0)
+		return -1;
+	if (!isOutput && conf->snapshot)
+		FBSnapshot( fb, conf );
+	fb->damage = isOutput && conf->damage && fb->mem;
+	if (fb->damage)
+	{
+		fb->flush = fb->device;
+		fb->quiet = conf->quiet;
+		fb->dmg_y0 = fb->dmg_y1 = fb->dmg_rects = 0;
+		fb->dmg_bytes = 0;
+	}
+	return 0;
+}
+
+// Seed pixel display vector based on percentage
+static void SetDisplayVector( int pct, char *v )
+{
+	memset( v, 0, 100 );
+	// Eliminate 0 and 100% cases
+	if (pct == 0) return;
+	if (pct >= 100)
+	{
+		memset( v, 1, 100 );
+		return;
+	}
+	// Try to distribute as evenly as possible
+	int skip = 100 / pct;
+	int n;
+	int numSet = 0;
+	for (n = 0; n < 100; n += skip)
+	{
+		v[n] = 1;
+		numSet++;
+		// Adjust skip factor
+		if (numSet < pct)
+		{
+			skip = (100-n-1) / (pct-numSet);
+		}
+		if (skip <= 0)
+		{
+			skip = 1;
+		}
+	}
+	// If any left over, stick them in anywhere
+	char *firstUnset = (char*)memchr( v, 0, 100 );
+	while (pct - numSet > 0 && firstUnset)
+	{
+		*firstUnset = 1;
+		numSet++;
+		firstUnset = (char*)memrchr( v, 0, 100 );
+	}
+}
+
+static void DumpVector( const char *label, char *v )
+{
+	char mask[128];
+	memset( mask, '.', 100 );
+	int n;
+	for (n = 0; n < 100; n++)
+	{
+		if (v[n]) mask[n] = 'X';
+	}
+	mask[100] = '\0';
+	fprintf( stderr, "%s: %s\n", label, mask );
+}
+
+// Adjust output size and width based on resize flags. true if resizing
+static int AdjustOutputSize( unsigned int *width, unsigned int *height, struct imgtool_conf *conf )
+{
+	conf->x_pct = 100;
+	conf->y_pct = 100;
+	conf->resize = 0;
+	if (!(conf->resize_options & RESIZE_ANY))
+	{
+		return 0;
+	}
+	// Reject bogus proportions
+	if (*width <= 0 || *height <= 0)
+	{
+		return 0;
+	}
+	if ((RESIZE_SHRINK_X & conf->resize_options) && *width > conf->width)
+	{
+		conf->x_pct = (conf->width*100L / ((unsigned long)*width));
+		*width = conf->width;
+	}
+	if ((RESIZE_SHRINK_Y & conf->resize_options) && *height > conf->height)
+	{
+		conf->y_pct = (conf->height*100L / ((unsigned long)*height));
+		*height = conf->height;
+	}
+	if ((RESIZE_SHRINK_MAX & conf->resize_options) && (*width > conf->width || *height > conf->height))
+	{
+		conf->x_pct = (conf->width*100L / ((unsigned long)*width));
+		conf->y_pct = (conf->height*100L / ((unsigned long)*height));
+		if (conf->y_pct < conf->x_pct)
+		{
+			*height = conf->height;
+			*width = (conf->width*100L * *width) / 100L;
+		}
+		else
+		{
+			if (*width > conf->width)
+			{
+				*width = conf->width;
+			}
+			*height = (conf->height*100L * *height) / 100L;
+		}
+
+	}
+	if (conf->x_pct < 100) conf->resize |= X_SHRINK;
+	if (conf->x_pct > 100) conf->resize |= X_STRETCH;
+	if (conf->y_pct < 100) conf->resize |= Y_SHRINK;
+	if (conf->y_pct > 100) conf->resize |= Y_STRETCH;
+	// Seed display vectors. If we wanted non-proportionate scaling we'd use separate scale factors
+	SetDisplayVector( conf->x_pct, conf->disp_x );
+	SetDisplayVector( conf->y_pct, conf->disp_y );
+	if (conf->debug_level)
+	{
+		if (conf->x_pct!=100) DumpVector( "X vector", conf->disp_x );
+		if (conf->y_pct!=100) DumpVector( "Y vector", conf->disp_y );
+	}
+	return (conf->resize != 0);
+}
+
+
+#ifndef NO_PNG
+
+
+
+///////////////////////// png ////////////////////////
+
+static void user_error_fn(png_structp png_ptr,
+	png_const_charp error_msg)
+{
+	fprintf( stderr, "libpng fatal error: %s\n", error_msg );
+	longjmp(png_jmpbuf(png_ptr), 1);
+}
+
+#define NON_PROGRESSIVE
+
+#ifndef NON_PROGRESSIVE
+
+info_callback(png_structp png_ptr, png_infop info)
+{
+/* do any setup here, including setting any of the transformations
+ * mentioned in the Reading PNG files section.  For now, you _must_
+ * call either png_start_read_image() or png_read_update_info()
+ * after all the transformations are set (even if you don't set
+ * any).  You may start getting rows before png_process_data()
+ * returns, so this is your last chance to prepare for that.
+ */
+}
+
+row_callback(png_structp png_ptr, png_bytep new_row,
+   png_uint_32 row_num, int pass)
+{
+/*
+ * This function is called for every row in the image.  If the
+ * image is interlaced, and you turned on the interlace handler,
+ * this function will be called for every row in every pass.
+ *
+ * In this function you will receive a pointer to new row data from
+ * libpng called new_row that is to replace a corresponding row (of
+ * the same data format) in a buffer allocated by your application.
+ *
+ * The new row data pointer new_row may be NULL, indicating there is
+ * no new data to be replaced (in cases of interlace loading).
+ *
+ * If new_row is not NULL then you need to call
+ * png_progressive_combine_row() to replace the corresponding row as
+ * shown below:
+ */
+   /* Check if row_num is in bounds. */
+   if((row_num >= 0) && (row_num < height) && row_num < conf->height)
+   {
+     /* Get pointer to corresponding row in our
+      * PNG read buffer.
+      */
+     png_bytep old_row = ((png_bytep *)our_data)[row_num];
+
+     /* If both rows are allocated then copy the new row
+      * data to the corresponding row data.
+      */
+     if((old_row != NULL) && (new_row != NULL))
+     png_progressive_combine_row(png_ptr, old_row, new_row);
+   }
+/*
+ * The rows and passes are called in order, so you don't really
+ * need the row_num and pass, but I'm supplying them because it
+ * may make your life easier.
+ *
+ * For the non-NULL rows of interlaced images, you must call
+ * png_progressive_combine_row() passing in the new row and the
+ * old row, as demonstrated above.  You can call this function for
+ * NULL rows (it will just return) and for non-interlaced images
+ * (it just does the png_memcpy for you) if it will make the code
+ * easier.  Thus, you can just do this for all cases:
+ */
+
+   png_progressive_combine_row(png_ptr, old_row, new_row);
+
+/* where old_row is what was displayed for previous rows.  Note
+ * that the first pass (pass == 0 really) will completely cover
+ * the old row, so the rows do not have to be initialized.  After
+ * the first pass (and only for interlaced images), you will have
+ * to pass the current row as new_row, and the function will combine
+ * the old row and the new row.
+ */
+}
+
+void end_callback(png_structp png_ptr, png_infop info)
+{
+/* this function is called when the whole image has been read,
+ * including any chunks after the image (up to and including
+ * the IEND).  You will usually have the same info chunk as you
+ * had in the header, although some data may have been added
+ * to the comments and time fields.
+ *
+ * Most people won't do much here, perhaps setting a flag that
+ * marks the image as finished.
+ */
+}
+
+#endif
+
+static void user_warning_fn(png_structp png_ptr,
+        png_const_charp warning_msg)
+{
+	fprintf( stderr, "libpng warning: %s\n", warning_msg );
+}
+
+#endif
+
+static void ARGB8888toRGB565( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns )
+{
+	// Source is in R8G8B8 (alpha should be stripped)
+	// Destination is in R5G6B5 or B5G6R5
+	int bytes_per_pixel = 4;
+	// Fill to end of row
+	memset( dest, 0, BytesPerFBPixel(conf->fmt)*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width && conf->resize == 0)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	int ri = 2, gi = 1, bi = 0;
+	if (conf->fmt == BF_BGR565)
+	{
+		ri = 0;
+		//gi = 1;
+		bi = 2;
+	}
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// Check horizontal display vector if resizing
+		if ((conf->resize & X_SHRINK) == 0 || conf->disp_x[col%100])
+		{
+			// src: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			// dst: rrrrrggg gggbbbbb
+			unsigned char r, g, b;
+			r = src[ri] >> 3;
+			g = src[gi] >> 2;
+			b = src[bi] >> 3;
+
+			int pixIndex = conf->mirror_h ? 2 * (conf->width - dcol) : 2 * dcol;
+			// hg - not sure why these appear to be in little-endian order?
+			dest[pixIndex + 1] = (r << 3) | (g >> 3);
+			dest[pixIndex + 0] = (g << 5) | b;
+			dcol++;
+		}
+
+		src += bytes_per_pixel;
+	}
+}
+
+// line copy for rgb888
+static void ARGB8888toRGB888( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns )
+{
+	// Source is in R8G8B8 (alpha should be stripped)
+	// Destination is in R8G8B8
+	int bytes_per_pixel = 4;
+	// Fill to end of row
+	memset( dest, 0, 3*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width && conf->resize == 0)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// Check horizontal display vector if resizing
+		if ((conf->resize & X_SHRINK) == 0 || conf->disp_x[col%100])
+		{
+			// src: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			// dst: rrrrrrrr gggggggg bbbbbbbb
+			unsigned char r, g, b;
+			r = src[2];
+			g = src[1];
+			b = src[0];
+			int pixIndex = conf->mirror_h ? 3 * (conf->width - dcol) : 3 * dcol;
+			dest[pixIndex + 2] = b;
+			dest[pixIndex + 1] = g;
+			dest[pixIndex + 0] = r;
+			dcol++;
+		}
+
+		src += bytes_per_pixel;
+	}
+}
+
+// line copy for argb888
+static void ARGB8888toARGB8888( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns )
+{
+	// Source is in A8R8G8B8
+	// Destination is in A8R8G8B8
+	int bytes_per_pixel = 4;
+	// Fill to end of row
+	memset( dest, 0, 4*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width && conf->resize == 0)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// Check horizontal display vector if resizing
+		if ((conf->resize & X_SHRINK) == 0 || conf->disp_x[col%100])
+		{
+			// src: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			// dst: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			*((unsigned int*)dest) = *((unsigned int*)src) | 0xff000000L;
+			dest += 4;
+			dcol++;
+		}
+
+		src += bytes_per_pixel;
+	}
+}
+
+// bitmap-format agnostic form of line copy
+static void ARGB8888toFB( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, int nColumns )
+{
+	switch (conf->fmt)
+	{
+		case BF_RGB565:
+		case BF_BGR565:
+			ARGB8888toRGB565( conf, dest, src, nColumns );
+			break;
+		case BF_RGB888:
+			ARGB8888toRGB888( conf, dest, src, nColumns );
+			break;
+		case BF_ARGB8888:
+			ARGB8888toARGB8888( conf, dest, src, nColumns );
+			break;
+		default:
+			// Formats are checked where they come in (imgtool_open(),
+			// --bitfmt, file headers); leave a blank row, never exit
+			memset( dest, 0, BytesPerFBPixel(conf->fmt) * conf->width );
+			break;
+	}
+}
+
+#ifndef NO_PNG
+static void RGB8toR5G6B5( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns, int nPalette, png_colorp pal )
+{
+	// Source is in R8G8B8 (alpha should be stripped)
+	// Destination is in R5G6B5
+	int bytes_per_pixel = nPalette > 0 ? 1 : 3;
+	int nStart = 0;
+
+	unsigned int col, dcol;
+	unsigned char r, g, b;
+	unsigned char *high = &r;
+	unsigned char *mid = &g;
+	unsigned char *low = &b;
+	int dest_hi = 1;
+	int dest_lo = 0;
+	if (conf->fmt == BF_BGR565) {
+		high = &b;
+		low = &r;
+		dest_hi = 0;
+		dest_lo = 1;
+	}
+
+	src += (bytes_per_pixel * nStart);
+	// Fill to end of row
+	memset(dest, 0, BytesPerFBPixel(conf->fmt)*conf->width);
+
+	// Check for clipping required
+	if (nColumns > conf->width && conf->resize == 0)
+		nColumns = conf->width;
+
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++) {
+
+		// Check horizontal display vector if resizing
+		if ((conf->resize & X_SHRINK) == 0 || conf->disp_x[col%100]) {
+			int pixIndex = conf->mirror_h ? 2 * (conf->width - dcol) : dcol * 2;
+
+			// src: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			// dst: rrrrrggg gggbbbbb
+			if (nPalette) {
+				int pi = *src % nPalette;
+				r = pal[pi].red >> 3;
+				g = pal[pi].green >> 2;
+				b = pal[pi].blue >> 3;
+			}
+
+			else {
+				r = src[0] >> 3;
+				g = src[1] >> 2;
+				b = src[2] >> 3;
+			}
+
+			// hg - not sure why these appear to be in little-endian order?
+			dest[pixIndex + dest_hi] = (*high << 3) | (*mid >> 3);
+			dest[pixIndex + dest_lo] = (*mid << 5) | *low;
+			dcol++;
+		}
+
+		src += bytes_per_pixel;
+	}
+}
+
+static void RGB8toR8G8B8( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns, int nPalette, png_colorp pal )
+{
+	// Source is in R8G8B8 (alpha should be stripped) or indexed
+	// Destination is in R8G8B8
+	int bytes_per_pixel = nPalette > 0 ? 1 : 3;
+	// Fill to end of row
+	memset( dest, 0, BytesPerFBPixel(conf->fmt)*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width && conf->resize == 0)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// Check horizontal display vector if resizing
+		if ((conf->resize & X_SHRINK) == 0 || conf->disp_x[col%100])
+		{
+			// src: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			// dst: rrrrrrrr gggggggg bbbbbbbb
+			unsigned char r, g, b;
+			if (nPalette)
+			{
+				int pi = *src % nPalette;
+				r = pal[pi].red;
+				g = pal[pi].green;
+				b = pal[pi].blue;
+			}
+			else
+			{
+				r = src[0];
+				g = src[1];
+				b = src[2];
+			}
+			int pixIndex = conf->mirror_h ? 3 * (conf->width - dcol) : dcol * 3;
+			dest[pixIndex + 2] = r;
+			dest[pixIndex + 1] = g;
+			dest[pixIndex + 0] = b;
+			dcol++;
+		}
+
+		src += bytes_per_pixel;
+	}
+}
+
+static void RGB8toARGB8888( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, int unsigned nColumns, int nPalette, png_colorp pal )
+{
+	// Source is in R8G8B8 (alpha should be stripped) or indexed
+	// Destination is in R8G8B8
+	int bytes_per_pixel = nPalette > 0 ? 1 : 3;
+	// Fill to end of row
+	memset( dest, 0, BytesPerFBPixel(conf->fmt)*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width && conf->resize == 0)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// Check horizontal display vector if resizing
+		if ((conf->resize & X_SHRINK) == 0 || conf->disp_x[col%100])
+		{
+			// src: rrrrrrrr gggggggg bbbbbbbb aaaaaaaa
+			// dst: rrrrrrrr gggggggg bbbbbbbb
+			unsigned char r, g, b, a;
+			if (nPalette)
+			{
+				int pi = *src % nPalette;
+				r = pal[pi].red;
+				g = pal[pi].green;
+				b = pal[pi].blue;
+				a = 255;
+			}
+			else
+			{
+				r = src[0];
+				g = src[1];
+				b = src[2];
+				a = src[3];
+			}
+			int pixIndex = conf->mirror_h ? 4 * (conf->width - dcol) : dcol * 4;
+			dest[pixIndex + 3] = a;
+			dest[pixIndex + 2] = r;
+			dest[pixIndex + 1] = g;
+			dest[pixIndex + 0] = b;
+			dcol++;
+		}
+
+		src += bytes_per_pixel;
+	}
+}
+
+// Bit format-agnostic form
+static void RGB8toFBPng( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, int nColumns, int nPalette, png_colorp pal )
+{
+	switch (conf->fmt)
+	{
+		case BF_RGB565:
+		case BF_BGR565:
+			RGB8toR5G6B5( conf, dest, src, nColumns, nPalette, pal );
+			break;
+		case BF_RGB888:
+			RGB8toR8G8B8( conf, dest, src, nColumns, nPalette, pal );
+			break;
+		case BF_ARGB8888:
+			RGB8toARGB8888( conf, dest, src, nColumns, nPalette, pal );
+			break;
+		default:
+			memset( dest, 0, BytesPerFBPixel(conf->fmt) * conf->width );
+			break;
+	}
+}
+#endif
+
+// Get a single pixel row capture from the frame buffer and convert to RGB888
+static void RGB565toRGB888( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns )
+{
+	// Source is in R5G6B5 (alpha should be stripped)
+	// Destination is in R8G8B8
+	int bytes_per_pixel = 3;
+	// Fill to end of row
+	memset( dest, 0, bytes_per_pixel*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// src: rrrrrggg gggbbbbb
+		// dst: rrrrrrrr gggggggg bbbbbbbb
+		unsigned char r, g, b;
+		r = src[1] >> 3;
+		g = (src[1] << 3) | (src[0] >> 5);
+		b = src[0] & 0x1f;
+
+		// hg - not sure why these appear to be in little-endian order?
+		// Scale values from  5/6 bits to 8 bits
+		dest[0] = r << 3; //(r << 3) | (g >> 3);
+		dest[1] = g << 2;
+		dest[2] = b << 3; //(g << 5) | b;
+		dest += bytes_per_pixel;
+		dcol++;
+
+		src += 2;
+	}
+}
+
+// Get a single pixel row capture from the frame buffer and convert to RGB888
+static void RGB888toRGB888( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, unsigned int nColumns )
+{
+	// Source is in R8G8B8 (alpha should be stripped)
+	// Destination is in R8G8B8
+	int bytes_per_pixel = 3;
+	// Fill to end of row
+	memset( dest, 0, bytes_per_pixel*conf->width );
+	int nStart = 0;
+	// Check for clipping required
+	if (nColumns > conf->width)
+	{
+		nColumns = conf->width;
+	}
+	unsigned int col, dcol;
+	src += (bytes_per_pixel * nStart);
+	for (col = nStart, dcol = 0; dcol < conf->width && col < nColumns; col++)
+	{
+		// src: rrrrrrrr gggggggg bbbbbbbb
+		// dst: rrrrrrrr gggggggg bbbbbbbb
+		unsigned char r, g, b;
+		r = src[2];
+		g = src[1];
+		b = src[0];
+
+		// Scale values from  5/6 bits to 8 bits
+		dest[0] = r;
+		dest[1] = g;
+		dest[2] = b;
+		dest += bytes_per_pixel;
+		dcol++;
+
+		src += 3;
+	}
+}
+
+// Bitformat-agnostic method to get a single pixel row as RGB888
+static void FBtoRGB888( struct imgtool_conf *conf, unsigned char *dest, unsigned const char *src, int nColumns )
+{
+	switch (conf->fmt)
+	{
+		case BF_RGB565:
+		case BF_BGR565:
+			RGB565toRGB888( conf, dest, src, nColumns );
+			break;
+		case BF_RGB888:
+			RGB888toRGB888( conf, dest, src, nColumns );
+			break;
+		case BF_ARGB8888:
+			ARGB8888toRGB888( conf, dest, src, nColumns );
+			break;
+		default:
+			memset( dest, 0, 3 * conf->width );
+			break;
+	}
+}
+
+// Dump a display row in hex
+static void HexDump( int rowNum, const char *rowId, unsigned char *rowBuff, int rowBytes )
+{
+	int n;
+	// Space for 4 hex bytes per pixel, 2 characters per hex byte, plus leadin
+	char outBuff[320*4*2+128];
+	int endLine;
+	if (rowBytes > 320*4)
+	{
+		rowBytes = 320*4;
+	}
+	endLine = sprintf( outBuff, "%s[%3d] ", rowId, rowNum );
+	for (n = 0; n < rowBytes; n++)
+	{
+		endLine += sprintf( &outBuff[endLine], "%02x", rowBuff[n] );
+	}
+	puts( outBuff );
+}
+
+// Draw input stream: a file, or stdin when the name is "-", read through a
+// large buffer so pipes feed the decoders directly. The format is sniffed
+// from the first bytes, which are replayed to the decoder by InputRead().
+// Regular files are mapped instead, so decoding from page cache costs no
+// read() calls or stdio copy.
+#define INPUT_BUFFER_SIZE	(256*1024)
+#define INPUT_MAGIC_SIZE	32	// Signature plus PNG IHDR
+
+enum input_format {
+	INPUT_UNKNOWN,
+	INPUT_PNG,
+	INPUT_JPEG,
+	INPUT_BMP,
+	INPUT_GIF,
+	INPUT_SEQ,
+	INPUT_PYR,
+};
+
+static const char *input_format_names[] = { "unknown", "png", "jpeg", "bmp", "gif", "sequence", "pyramid" };
+
+struct img_input {
+	FILE *fp;
+	const char *name;	// for messages
+	enum input_format format;
+	unsigned char magic[INPUT_MAGIC_SIZE];
+	size_t magic_len;	// bytes sniffed
+	size_t magic_pos;	// sniffed bytes already handed out
+	uint64_t bytes;		// total bytes handed to the decoder
+	const unsigned char *map;	// whole file when mapped, else NULL
+	size_t map_size;
+	int borrowed;			// map belongs to the caller
+	int thumbnail;			// EXIF thumbnail of another input
+};
+
+static enum input_format InputSniff( const unsigned char *p, size_t len )
+{
+	static const unsigned char png_sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+	if (len >= sizeof(png_sig) && !memcmp( p, png_sig, sizeof(png_sig) ))
+		return INPUT_PNG;
+	if (len >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff)
+		return INPUT_JPEG;
+	if (len >= 2 && p[0] == 'B' && p[1] == 'M')
+		return INPUT_BMP;
+	if (len >= 6 && (!memcmp( p, "GIF87a", 6 ) || !memcmp( p, "GIF89a", 6 )))
+		return INPUT_GIF;
+	if (len >= 4 && !memcmp( p, IMGTOOL_SEQ_MAGIC, 4 ))
+		return INPUT_SEQ;
+	if (len >= 4 && !memcmp( p, IMGTOOL_PYR_MAGIC, 4 ))
+		return INPUT_PYR;
+	return INPUT_UNKNOWN;
+}
+
+static int InputOpen( struct img_input *in, const char *filename )
+{
+	struct stat st;
+	void *map;
+
+	memset( in, 0, sizeof(*in) );
+	if (!strcmp( filename, "-" ))
+	{
+		in->fp = stdin;
+		in->name = "<stdin>";
+	}
+	else
+	{
+		in->fp = fopen( filename, "rb" );
+		in->name = filename;
+	}
+	if (!in->fp)
+	{
+		fprintf( stderr, "Error: unable to open %s, errno=%d (%s)\n", filename, errno, strerror(errno) );
+		return -1;
+	}
+
+	if (fstat( fileno(in->fp), &st ) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+		(map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in->fp), 0 )) != MAP_FAILED)
+	{
+		// Decoders walk the file front to back: read ahead aggressively and
+		// drop pages behind us
+		madvise( map, st.st_size, MADV_SEQUENTIAL );
+		madvise( map, st.st_size, MADV_WILLNEED );
+		in->map = (const unsigned char *)map;
+		in->map_size = st.st_size;
+		in->format = InputSniff( in->map, in->map_size );
+		return 0;
+	}
+
+	setvbuf( in->fp, NULL, _IOFBF, INPUT_BUFFER_SIZE );
+	in->magic_len = fread( in->magic, 1, INPUT_MAGIC_SIZE, in->fp );
+	in->format = InputSniff( in->magic, in->magic_len );
+	return 0;
+}
+
+static size_t InputRead( struct img_input *in, void *buf, size_t len )
+{
+	size_t got = 0;
+
+	if (in->map)
+	{
+		got = in->map_size - in->bytes;
+		if (got > len)
+			got = len;
+		memcpy( buf, in->map + in->bytes, got );
+		in->bytes += got;
+		return got;
+	}
+	if (in->magic_pos < in->magic_len)
+	{
+		got = in->magic_len - in->magic_pos;
+		if (got > len)
+			got = len;
+		memcpy( buf, &in->magic[in->magic_pos], got );
+		in->magic_pos += got;
+	}
+	if (got < len)
+		got += fread( (unsigned char *)buf + got, 1, len - got, in->fp );
+	in->bytes += got;
+	return got;
+}
+
+// Image size from the PNG IHDR, which must directly follow the signature.
+// Used to size the arena before libpng starts allocating.
+static int InputPngSize( struct img_input *in, unsigned int *width, unsigned int *height )
+{
+	const unsigned char *p = in->map ? in->map : in->magic;
+	size_t len = in->map ? in->map_size : in->magic_len;
+
+	if (in->format != INPUT_PNG || len < 24 || memcmp( p + 12, "IHDR", 4 ))
+		return -1;
+	*width = (p[16] << 24) | (p[17] << 16) | (p[18] << 8) | p[19];
+	*height = (p[20] << 24) | (p[21] << 16) | (p[22] << 8) | p[23];
+	return 0;
+}
+
+// Image already in memory (library callers): handled like a mapped file
+static void InputOpenMem( struct img_input *in, const void *data, size_t size )
+{
+	memset( in, 0, sizeof(*in) );
+	in->name = "<memory>";
+	in->map = (const unsigned char *)data;
+	in->map_size = size;
+	in->borrowed = 1;
+	in->format = InputSniff( in->map, in->map_size );
+}
+
+static void InputClose( struct img_input *in )
+{
+	if (in->map && !in->borrowed)
+		munmap( (void *)in->map, in->map_size );
+	in->map = NULL;
+	if (in->fp && in->fp != stdin)
+		fclose( in->fp );
+	in->fp = NULL;
+}
+
+#ifndef NO_PNG
+
+// libpng memory callbacks: everything comes from conf->arena and is
+// released by ArenaReset(), so png_free() has nothing to do
+static png_voidp PngArenaMalloc( png_structp png_ptr, png_size_t size )
+{
+	return ArenaAlloc( (struct imgtool_arena *)png_get_mem_ptr( png_ptr ), size );
+}
+
+static void PngArenaFree( png_structp png_ptr, png_voidp ptr )
+{
+}
+
+// Arena needed by libpng itself: zlib state and window, row and filter
+// buffers for rows of up to row_bytes
+#define PNG_ARENA_INFLATE	(64*1024)
+#define PNG_ARENA_DEFLATE	(320*1024)
+#define PNG_ARENA_ROWS(row_bytes)	(8 * ARENA_ROUND((row_bytes) + 1))
+
+// libpng always copies into its own buffer, so a mapped input is handed
+// out in slices straight from the mapping
+static void PngInputRead( png_structp png_ptr, png_bytep data, png_size_t length )
+{
+	struct img_input *in = (struct img_input *)png_get_io_ptr( png_ptr );
+
+	if (in->map)
+	{
+		if (length > in->map_size - in->bytes)
+			png_error( png_ptr, "Read Error" );
+		memcpy( data, in->map + in->bytes, length );
+		in->bytes += length;
+	}
+	else if (InputRead( in, data, length ) != length)
+		png_error( png_ptr, "Read Error" );
+}
+
+///////////////////////// viewport ////////////////////////
+
+// --crop draws a window of an image too big to keep whole, such as a map
+// to pan around. Decoders skip what lies outside the window as cheaply as
+// they can: JPEG rows above it are not entropy decoded (where libjpeg-turbo
+// allows) and columns beside it not inverse transformed; PNG rows outside
+// it are decoded into one scratch row and never converted.
+
+// Clip the --crop window to an image of *w x *h and return it in *x, *y,
+// *w and *h. The image may be scaled by num/denom from the one --crop
+// was given for.
+static int CropWindow( struct imgtool_conf *conf, const char *name, unsigned int num, unsigned int denom,
+	unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h )
+{
+	uint64_t cx = (uint64_t)conf->crop_x * num / denom;
+	uint64_t cy = (uint64_t)conf->crop_y * num / denom;
+	uint64_t cw = (uint64_t)(conf->crop_w ? conf->crop_w : conf->width) * num / denom;
+	uint64_t ch = (uint64_t)(conf->crop_h ? conf->crop_h : conf->height) * num / denom;
+
+	if (cx >= *w || cy >= *h)
+	{
+		fprintf( stderr, "Error: %s: crop window at %u,%u lies outside the image\n", name, conf->crop_x, conf->crop_y );
+		return -1;
+	}
+	if (cw > *w - cx)
+		cw = *w - cx;
+	if (ch > *h - cy)
+		ch = *h - cy;
+	PROGRESS( conf, "Cropping %ux%u+%u+%u of %ux%u\n", (unsigned int)cw, (unsigned int)ch,
+		(unsigned int)cx, (unsigned int)cy, *w, *h );
+	*x = cx;
+	*y = cy;
+	*w = cw ? cw : 1;
+	*h = ch ? ch : 1;
+	return 0;
+}
+
+///////////////////////// several frame buffers ////////////////////////
+
+// A draw can also go to further frame buffers (--also), as on units that
+// show one picture on two screens of different size and format. The image
+// is decoded once into rows of RGB8. Each extra frame buffer gets a copy of
+// conf with its own geometry and converter, and is resized, converted and
+// written on a thread of its own while the calling thread draws conf's.
+
+// A decoded image: rows of RGB8, or of palette indices when nPalette
+struct decoded_image {
+	png_bytep *rows;
+	unsigned int width, height;
+	int fill;		// Clear the frame buffer rows below the image
+	int nPalette;
+	png_colorp palette;
+};
+
+struct draw_target {
+	pthread_t thread;
+	int started;
+	struct imgtool_conf conf;
+	struct imgtool_stats stats;
+	const struct decoded_image *img;
+	unsigned char *fbRow;
+	int ret;
+};
+
+// Convert and write the image to conf's frame buffer, resized as
+// AdjustOutputSize() left conf. fbRow has room for a frame buffer row and
+// one pixel more, as --mirrorh rows start a pixel past the end.
+static int DrawDecoded( struct imgtool_conf *conf, const struct decoded_image *img, unsigned char *fbRow )
+{
+	struct fb_dev fb;
+	uint64_t t0;
+	int ret = 0;
+
+	if (FBOpen( &fb, conf, 1 ) < 0)
+		return -1;
+	unsigned int row;
+	unsigned int maxRow = img->height-1;
+	unsigned int minRow = 0;
+	unsigned int fillRows = 0;
+	if (!conf->resize)
+	{
+		// Clip oversized rows
+		if (maxRow < img->height-1)
+		{
+			minRow = img->height-conf->height;
+		}
+	}
+	unsigned int dispRow = minRow;
+	// Fill empty space
+	if (maxRow - minRow < conf->height-1)
+	{
+		fillRows = conf->height - 1 - maxRow - minRow;
+	}
+	PROGRESS( conf, "Displaying rows from %d to %d inclusive\n", (int)minRow, (int)maxRow );
+	for (row = minRow; row<=maxRow && dispRow < conf->height; row++)
+	{
+		TRACE_BATCH(row - minRow);
+
+		// If resizing, determine whether we skip this one
+		if (conf->resize & Y_SHRINK)
+		{
+			// Determine rows to skip
+			if (conf->disp_y[row%100] == 0)
+			{
+				// Skip this one
+				continue;
+			}
+		}
+
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("convert", "RGB8toFBPng", row);
+		RGB8toFBPng( conf, fbRow, img->rows[row], img->width, img->nPalette, img->palette );
+		TRACE_END("convert", "RGB8toFBPng", row);
+		STATS_END(conf, PHASE_CONVERT, t0);
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("fb", "WriteFB", dispRow);
+		FBWriteRow( &fb, dispRow, fbRow );
+		TRACE_END("fb", "WriteFB", dispRow);
+		STATS_END(conf, PHASE_FB_WRITE, t0);
+		STATS_ADD(conf, bytes_written, BytesPerFBPixel(conf->fmt) * conf->width);
+		STATS_ADD(conf, rows, 1);
+		dispRow++;
+		if (conf->debug_level && dispRow <= 10)
+		{
+			HexDump( row, "r8g8b8", img->rows[row], img->width*3 );
+			HexDump( row, "r5g6b5", fbRow, img->width*2 );
+		}
+	}
+	TRACE_BATCH_DONE(row - minRow);
+	// Every row of the image that fits must have gone out
+	if (!(conf->resize & Y_SHRINK) && dispRow < (img->height < conf->height ? img->height : conf->height))
+	{
+		fprintf( stderr, "Error: drew %u of %u image rows\n", dispRow, img->height );
+		ret = -1;
+	}
+	if (img->fill)
+	{
+		if (dispRow < conf->height-1)
+		{
+			fillRows = conf->height - dispRow;
+		}
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("fb", "fill_rows", fillRows);
+		FBWriteZeroRows( &fb, dispRow, fillRows );
+		TRACE_END("fb", "fill_rows", fillRows);
+		STATS_END(conf, PHASE_FB_WRITE, t0);
+		STATS_ADD(conf, bytes_written, (uint64_t)fillRows * BytesPerFBPixel(conf->fmt) * conf->width);
+	}
+	PROGRESS( conf, "Closing frame buffer\n" );
+	return FBClose( &fb ) < 0 ? -1 : ret;
+}
+
+static void *DrawTargetWorker( void *arg )
+{
+	struct draw_target *t = (struct draw_target *)arg;
+
+	t->ret = DrawDecoded( &t->conf, t->img, t->fbRow );
+	return NULL;
+}
+
+// Fold a draw thread's statistics into the caller's
+static void StatsAddUp( struct imgtool_stats *to, const struct imgtool_stats *from )
+{
+#ifndef NO_STATS
+	int n;
+
+	for (n = 0; n < PHASE_COUNT; n++)
+	{
+		to->phase_ns[n] += from->phase_ns[n];
+		to->phase_calls[n] += from->phase_calls[n];
+	}
+	to->bytes_written += from->bytes_written;
+	to->rows += from->rows;
+	to->fb_syscalls += from->fb_syscalls;
+	if (from->first_pixel_ns && (!to->first_pixel_ns || from->first_pixel_ns < to->first_pixel_ns))
+		to->first_pixel_ns = from->first_pixel_ns;
+#endif
+}
+
+// Set up target n of conf->targets in t: its geometry and format from the
+// device unless given, and its own resize and conversion row
+static int DrawTargetInit( struct draw_target *t, struct imgtool_conf *conf, int n, const struct decoded_image *img )
+{
+	const struct imgtool_target *target = &conf->targets[n];
+	struct imgtool_conf *c = &t->conf;
+	unsigned int width = img->width, height = img->height;
+	uint64_t t0;
+
+	memset( &t->stats, 0, sizeof(t->stats) );
+	*c = *conf;
+	c->targets = NULL;
+	c->ntargets = 0;
+	c->fb = NULL;
+	snprintf( c->output, sizeof(c->output), "%s", target->path );
+	c->width = target->geom.width;
+	c->height = target->geom.height;
+	c->stride = target->geom.stride;
+	c->fmt = (enum bit_format)target->geom.fmt;
+	c->fmt_given = target->geom.fmt_given;
+	fill_fb_defaults( c );
+	if (!c->width || !c->height)
+	{
+		fprintf( stderr, "Error: no geometry for %s\n", c->output );
+		return -1;
+	}
+	if (conf->stats)
+	{
+		t->stats.start_ns = conf->stats->start_ns;
+		c->stats = &t->stats;
+	}
+
+	t0 = STATS_BEGIN(c);
+	if (AdjustOutputSize( &width, &height, c ))
+	{
+		PROGRESS( c, "Scaling from %dX%d to %dX%d (%d%%/%d%%) for %s\n",
+			(int)img->width, (int)img->height, width, height, c->x_pct, c->y_pct, c->output );
+	}
+	STATS_END(c, PHASE_RESIZE, t0);
+	t->img = img;
+	if (!(t->fbRow = (unsigned char *)ArenaAlloc( conf->arena, BytesPerFBPixel(c->fmt)*(c->width + 1) )))
+	{
+		fprintf( stderr, "Error: cannot allocate a row for %s\n", c->output );
+		return -1;
+	}
+	PROGRESS( conf, "Drawing to %s as well (%ux%u %s)\n", c->output, c->width, c->height, bit_format_names[c->fmt] );
+	return 0;
+}
+
+// Draw the image to conf's frame buffer and, alongside, to every --also
+// target. Targets that cannot get a thread are drawn after conf's.
+static int DrawTargets( struct imgtool_conf *conf, const struct decoded_image *img, unsigned char *fbRow )
+{
+	struct draw_target *t;
+	int n, ret;
+
+	if (!conf->ntargets)
+		return DrawDecoded( conf, img, fbRow );
+	t = (struct draw_target *)ArenaAlloc( conf->arena, conf->ntargets * sizeof(*t) );
+	if (!t)
+	{
+		fprintf( stderr, "Error: cannot allocate memory for %d more frame buffers\n", conf->ntargets );
+		return -1;
+	}
+	for (n = 0; n < conf->ntargets; n++)
+	{
+		t[n].started = 0;
+		t[n].ret = DrawTargetInit( &t[n], conf, n, img );
+		if (t[n].ret == 0 && pthread_create( &t[n].thread, NULL, DrawTargetWorker, &t[n] ) == 0)
+			t[n].started = 1;
+	}
+
+	ret = DrawDecoded( conf, img, fbRow );
+
+	for (n = 0; n < conf->ntargets; n++)
+	{
+		if (t[n].started)
+			pthread_join( t[n].thread, NULL );
+		else if (t[n].ret == 0)
+			DrawTargetWorker( &t[n] );
+		if (t[n].ret)
+			ret = -1;
+		if (conf->stats)
+			StatsAddUp( conf->stats, &t[n].stats );
+	}
+	return ret;
+}
+
+static int ShowPng(struct imgtool_conf *conf, struct img_input *in)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   unsigned int sig_read = 0;
+   png_uint_32 width, height;
+   int bit_depth, color_type, interlace_type;
+   unsigned int hdrWidth = 0, hdrHeight = 0;
+   uint64_t t0;
+   int ret = 0, stopped = 0;
+
+   /* One arena block for libpng, the decoded image (alpha and 16 bit are
+    * stripped, so at most 3 bytes a pixel) and the frame buffer row. A
+    * --crop window keeps only its own rows and a scratch row. */
+   ArenaReset( conf->arena );
+   InputPngSize( in, &hdrWidth, &hdrHeight );
+   unsigned int keepRows = hdrHeight;
+   if (conf->crop && (conf->crop_h ? conf->crop_h : conf->height) < hdrHeight)
+      keepRows = (conf->crop_h ? conf->crop_h : conf->height) + 1;
+   if (ArenaReserve( conf->arena, PNG_ARENA_INFLATE + PNG_ARENA_ROWS(hdrWidth * 8)
+		+ (size_t)keepRows * (sizeof(png_bytep) + ARENA_ROUND(hdrWidth * 3))
+		+ ARENA_ROUND(BytesPerFBPixel(conf->fmt) * (conf->width + 1)) ))
+   {
+      fprintf( stderr, "Error: cannot allocate memory for %ux%u image\n", hdrWidth, hdrHeight );
+      return -1;
+   }
+
+   /* Create and initialize the png_struct with the desired error handler
+    * functions.  If you want to use the default stderr and longjump method,
+    * you can supply NULL for the last three parameters.  We also supply the
+    * the compiler header file version, so that we know if the application
+    * was compiled with a compatible version of the library.  REQUIRED
+    */
+  void * user_error_ptr = 0;
+   png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+      user_error_ptr, user_error_fn, user_warning_fn,
+      conf->arena, PngArenaMalloc, PngArenaFree);
+
+   if (png_ptr == NULL)
+   {
+      fprintf( stderr, "Failed to create read struct\n" );
+      return -1;
+   }
+
+   /* Allocate/initialize the memory for image information.  REQUIRED. */
+   info_ptr = png_create_info_struct(png_ptr);
+   if (info_ptr == NULL)
+   {
+      png_destroy_read_struct(&png_ptr, png_infopp_NULL, png_infopp_NULL);
+      fprintf( stderr, "Failed to create info struct\n" );
+      return -1;
+   }
+
+   /* libpng errors come back here; all memory is in the arena */
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+      return -1;
+   }
+
+   /* Read through the sniffing input stream, which replays the signature */
+   png_set_read_fn(png_ptr, in, PngInputRead);
+
+   /* If we have already read some of the signature */
+   png_set_sig_bytes(png_ptr, sig_read);
+
+   t0 = STATS_BEGIN(conf);
+   TRACE_BEGIN("decode", "png_read_info", 0);
+
+   /* The call to png_read_info() gives us all of the information from the
+    * PNG file before the first IDAT (image data chunk).  REQUIRED
+    */
+   png_read_info(png_ptr, info_ptr);
+
+	//png_uint32 width, height;
+	//int bit_depth, color_type, interlace_type;
+   png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+       &interlace_type, int_p_NULL, int_p_NULL);
+
+	PROGRESS( conf, "Image %dx%d %dbpp color type=%d interlace=%d\n", (int)width, (int)height, (int)bit_depth, color_type, interlace_type );
+
+   /* tell libpng to strip 16 bit/color files down to 8 bits/color */
+	if (bit_depth == 16)
+		png_set_strip_16(png_ptr);
+
+   png_colorp palette = NULL;
+   int num_palette = 0;
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+		//png_set_palette_to_rgb(png_ptr);
+		png_get_PLTE(png_ptr, info_ptr, &palette,
+                            &num_palette);
+   }
+
+	// Also strip alpha
+	if (color_type & PNG_COLOR_MASK_ALPHA)
+		png_set_strip_alpha(png_ptr);
+
+	// More stuff here suchas setting alpha and background
+
+
+   /* Tell libpng to handle the gamma conversion for you.  The final call
+    * is a good guess for PC generated images, but it should be configurable
+    * by the user at run time by the user.  It is strongly suggested that
+    * your application support gamma correction.
+    */
+
+   int intent;
+
+   if (png_get_sRGB(png_ptr, info_ptr, &intent))
+      png_set_gamma(png_ptr, conf->gamma, 0.45455);
+   else
+   {
+      double image_gamma;
+      if (png_get_gAMA(png_ptr, info_ptr, &image_gamma))
+         png_set_gamma(png_ptr, conf->gamma, image_gamma);
+      else
+         png_set_gamma(png_ptr, conf->gamma, 0.45455);
+   }
+
+
+
+	// More bit diddling stuff that might be useful
+
+
+
+#define NON_PROGRESSIVE
+#define SUCK_IN_ONE_GO
+
+#ifndef NON_PROGRESSIVE
+   /* Turn on interlace handling.  REQUIRED if you are not using
+    * png_read_image().  To see how to handle interlacing passes,
+    * see the png_read_row() method below:
+    */
+	int
+   number_passes = png_set_interlace_handling(png_ptr);
+#endif
+
+   /* Optional call to gamma correct and add the background to the palette
+    * and update info structure.  REQUIRED if you are expecting libpng to
+    * update the palette for you (ie you selected such a transform above).
+    */
+   png_read_update_info(png_ptr, info_ptr);
+   TRACE_END("decode", "png_read_info", 0);
+   STATS_END(conf, PHASE_HEADER, t0);
+
+	// --crop: rows of the window are kept, the rest decoded into a
+	// scratch row after them
+	unsigned int cropX = 0, cropY = 0, imgWidth = width, imgHeight = height;
+	if (conf->crop && CropWindow( conf, in->name, 1, 1, &cropX, &cropY, &imgWidth, &imgHeight ))
+	{
+		png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+		return -1;
+	}
+	png_uint_32 nRows = imgHeight + (conf->crop != 0);
+
+#ifdef NON_PROGRESSIVE
+   /* Allocate the memory to hold the image using the fields of info_ptr. */
+
+	PROGRESS( conf, "non-progressive: allocating %d row buffers\n", (int)nRows );
+
+   /* The easiest way to read the image: */
+	png_uint_32 row;
+	png_bytep *row_pointers = (png_bytep*)ArenaAlloc(conf->arena, nRows*sizeof(png_bytep));
+	int memory_failed = (row_pointers == NULL);
+	if (memory_failed)
+	{
+		fprintf( stderr, "Error: failed to allocate %d row pointers\n", (int)nRows );
+	}
+	else
+	{
+
+		size_t row_bytes = png_get_rowbytes( png_ptr, info_ptr );
+		PROGRESS( conf, "allocating %d bytes per row\n", (int)row_bytes );
+		for (row = 0; row < nRows; row++)
+		{
+			if (!(row_pointers[row] = (png_byte*)ArenaAlloc(conf->arena, row_bytes)))
+			{
+				fprintf( stderr, "Error: memory allocate failed on row %d\n", (int)row );
+				memory_failed = 1;
+				break;
+			}
+			//else fprintf( stderr, "row_pointers[%d] = %lx\n", row, (unsigned long)row_pointers[row] );
+		}
+	}
+
+	if (memory_failed)
+	{
+		/* Row memory goes back with the arena */
+		png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+
+		return -1;
+	}
+
+#ifdef SUCK_IN_ONE_GO
+	PROGRESS( conf, "Reading entire set of rows in one pass: base pointer = %lx\n", (unsigned long)row_pointers );
+	t0 = STATS_BEGIN(conf);
+	{
+		// Equivalent of png_read_image(), one png_read_row() at a time so the
+		// decoder calls show up in traces
+		int pass, number_passes = png_set_interlace_handling(png_ptr);
+		for (pass = 0; pass < number_passes; pass++)
+		{
+			for (row = 0; row < height; row++)
+			{
+				// Nothing more is needed past the window of a one pass image
+				if (row >= cropY + imgHeight && number_passes == 1)
+				{
+					stopped = 1;
+					break;
+				}
+				TRACE_BATCH(row);
+				TRACE_BEGIN("decode", "png_read_row", row);
+				png_read_row(png_ptr, row < cropY || row >= cropY + imgHeight ?
+					row_pointers[imgHeight] : row_pointers[row - cropY], NULL);
+				TRACE_END("decode", "png_read_row", row);
+			}
+			TRACE_BATCH_DONE(row);
+		}
+	}
+	STATS_END(conf, PHASE_DECODE, t0);
+	if (cropX)
+		for (row = 0; row < imgHeight; row++)
+			row_pointers[row] += cropX * (png_get_rowbytes( png_ptr, info_ptr ) / width);
+
+	// Determine resizing
+	unsigned int scaledWidth, scaledHeight;
+	scaledWidth = imgWidth;
+	scaledHeight = imgHeight;
+	t0 = STATS_BEGIN(conf);
+	if (AdjustOutputSize( &scaledWidth, &scaledHeight, conf))
+	{
+		PROGRESS( conf, "Scaling from %dX%d to %dX%d (%d%%/%d%%)\n",
+			(int)imgWidth, (int)imgHeight,
+			scaledWidth, scaledHeight,
+			conf->x_pct, conf->y_pct );
+	}
+	STATS_END(conf, PHASE_RESIZE, t0);
+
+   // Convert rows from R8G8B8 to frame buffer format
+	unsigned char *fbRow = (unsigned char *)ArenaAlloc( conf->arena, BytesPerFBPixel(conf->fmt)*(conf->width + 1) );
+	if (!fbRow)
+	{
+		fprintf( stderr, "malloc() failed, errno=%d (%s)\n", errno, strerror(errno) );
+		png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+		return -1;
+	}
+	struct decoded_image img = { row_pointers, imgWidth, imgHeight, 1, num_palette, palette };
+	ret = DrawTargets( conf, &img, fbRow );
+#else
+
+   /* The other way to read images - deal with interlacing: */
+	int pass, y;
+	int number_of_rows = 12;
+   for (pass = 0; pass < number_passes; pass++)
+   {
+      for (y = 0; y < height; y += number_of_rows)
+      {
+#ifdef sparkle /* Read the image using the "sparkle" effect. */
+         png_read_rows(png_ptr, &row_pointers[y], png_bytepp_NULL,
+            number_of_rows);
+#else //no_sparkle /* Read the image using the "rectangle" effect */
+         png_read_rows(png_ptr, png_bytepp_NULL, &row_pointers[y],
+            number_of_rows);
+#endif //no_sparkle /* use only one of these two methods */
+      }
+
+      /* if you want to display the image after every pass, do
+         so here */
+	  // Rows are in RGB format. Convert to frame buffer format
+   }
+#endif // Suck in one go
+
+   /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("decode", "png_read_end", 0);
+   if (!stopped)
+      png_read_end(png_ptr, info_ptr);
+	TRACE_END("decode", "png_read_end", 0);
+	STATS_END(conf, PHASE_DECODE, t0);
+
+#else
+	// Progressive reader
+
+           /* This one's new.  You can provide functions
+              to be called when the header info is valid,
+              when each row is completed, and when the image
+              is finished.  If you aren’t using all functions,
+              you can specify NULL parameters.  Even when all
+              three functions are NULL, you need to call
+              png_set_progressive_read_fn().  You can use
+              any struct as the user_ptr (cast to a void pointer
+              for the function call), and retrieve the pointer
+              from inside the callbacks using the function
+
+                 png_get_progressive_ptr(png_ptr);
+
+              which will return a void pointer, which you have
+              to cast appropriately.
+            */
+		void *user_ptr = NULL;
+           png_set_progressive_read_fn(png_ptr, (void *)user_ptr,
+               info_callback, row_callback, end_callback);
+
+
+#endif
+
+	// Row pointers and rows live in the arena until the next operation
+
+      /* Release the png_ptr and info_ptr (a no-op for arena memory) */
+      png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+
+	STATS_ADD(conf, bytes_read, in->bytes);
+
+	return ret;
+}
+
+#endif
+
+// libjpeg error manager that returns to the caller's setjmp() instead of
+// calling exit(), so a bad image does not take a library user down with it
+struct jpeg_jmp_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+METHODDEF(void)
+jpeg_jmp_error_exit (j_common_ptr cinfo)
+{
+  struct jpeg_jmp_error *err = (struct jpeg_jmp_error *) cinfo->err;
+
+  (*cinfo->err->output_message) (cinfo);
+  longjmp(err->jmp, 1);
+}
+
+static struct jpeg_error_mgr *
+jpeg_jmp_error (struct jpeg_jmp_error *err)
+{
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = jpeg_jmp_error_exit;
+  return &err->pub;
+}
+
+// EXIF (APP1) layout: a TIFF header then IFDs of 12 byte entries
+#define EXIF_IFD_ENTRY		12
+#define EXIF_TAG_ORIENTATION	0x0112
+#define EXIF_TAG_COMPRESSION	0x0103
+#define EXIF_TAG_JPEG_OFFSET	0x0201
+#define EXIF_TAG_JPEG_LENGTH	0x0202
+
+#ifndef NO_PNG
+/*******************************************************
+ Jpeg support functions
+********************************************************/
+
+// Data source manager reading through struct img_input. Same behaviour as
+// jpeg_stdio_src(), but with a larger buffer and the sniffed bytes replayed.
+// A mapped input is handed over in one piece, like jpeg_mem_src(). The
+// manager is allocated once per decompress object so long-lived objects
+// can be reused for any number of images.
+struct input_jpeg_src {
+	struct jpeg_source_mgr pub;
+	struct img_input *in;
+	JOCTET *buffer;
+};
+
+METHODDEF(void)
+input_init_source (j_decompress_ptr cinfo)
+{
+}
+
+METHODDEF(boolean)
+input_fill_input_buffer (j_decompress_ptr cinfo)
+{
+  struct input_jpeg_src *src = (struct input_jpeg_src *) cinfo->src;
+  size_t nbytes;
+
+  if (src->in->map && src->in->bytes < src->in->map_size) {
+    src->pub.next_input_byte = src->in->map + src->in->bytes;
+    src->pub.bytes_in_buffer = src->in->map_size - src->in->bytes;
+    src->in->bytes = src->in->map_size;
+    return TRUE;
+  }
+  if (src->in->map) {
+    nbytes = 0;
+  } else {
+    if (src->buffer == NULL)
+      src->buffer = (JOCTET *) (*cinfo->mem->alloc_large)
+        ((j_common_ptr) cinfo, JPOOL_PERMANENT, INPUT_BUFFER_SIZE);
+    nbytes = InputRead(src->in, src->buffer, INPUT_BUFFER_SIZE);
+  }
+  if (nbytes == 0) {
+    /* Insert a fake EOI marker, as jdatasrc.c does */
+    static const JOCTET fake_eoi[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+    WARNMS(cinfo, JWRN_JPEG_EOF);
+    src->pub.next_input_byte = fake_eoi;
+    src->pub.bytes_in_buffer = 2;
+    return TRUE;
+  }
+  src->pub.next_input_byte = src->buffer;
+  src->pub.bytes_in_buffer = nbytes;
+  return TRUE;
+}
+
+METHODDEF(void)
+input_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr *src = cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+  while (num_bytes > (long) src->bytes_in_buffer) {
+    num_bytes -= (long) src->bytes_in_buffer;
+    (void) (*src->fill_input_buffer) (cinfo);
+  }
+  src->next_input_byte += (size_t) num_bytes;
+  src->bytes_in_buffer -= (size_t) num_bytes;
+}
+
+METHODDEF(void)
+input_term_source (j_decompress_ptr cinfo)
+{
+}
+
+static void
+jpeg_input_src (j_decompress_ptr cinfo, struct img_input *in)
+{
+  struct input_jpeg_src *src;
+
+#ifdef MEM_SRCDST_SUPPORTED
+  /* jpeg_mem_src() refuses an object that already has another manager */
+  if (in->map && cinfo->src == NULL) {
+    jpeg_mem_src(cinfo, (unsigned char *) in->map, in->map_size);
+    in->bytes = in->map_size;
+    return;
+  }
+#endif
+  if (cinfo->src == NULL || cinfo->src->init_source != input_init_source) {
+    src = (struct input_jpeg_src *) (*cinfo->mem->alloc_small)
+      ((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(struct input_jpeg_src));
+    /* The stream buffer is allocated on first use; a mapping needs none */
+    src->buffer = NULL;
+    cinfo->src = &src->pub;
+  }
+  src = (struct input_jpeg_src *) cinfo->src;
+  src->in = in;
+  src->pub.init_source = input_init_source;
+  src->pub.fill_input_buffer = input_fill_input_buffer;
+  src->pub.skip_input_data = input_skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = input_term_source;
+  src->pub.bytes_in_buffer = 0;
+  src->pub.next_input_byte = NULL;
+}
+
+LOCAL(unsigned int)
+jpeg_getc (j_decompress_ptr cinfo)
+/* Read next byte */
+{
+  struct jpeg_source_mgr * datasrc = cinfo->src;
+
+  if (datasrc->bytes_in_buffer == 0) {
+    if (! (*datasrc->fill_input_buffer) (cinfo))
+      return 0; //ERREXIT(cinfo, JERR_CANT_SUSPEND);
+  }
+  datasrc->bytes_in_buffer--;
+  return GETJOCTET(*datasrc->next_input_byte++);
+}
+
+METHODDEF(boolean)
+print_text_marker (j_decompress_ptr cinfo)
+{
+  boolean traceit = (cinfo->err->trace_level >= 1);
+  INT32 length;
+  unsigned int ch;
+  unsigned int lastch = 0;
+
+  length = jpeg_getc(cinfo) << 8;
+  length += jpeg_getc(cinfo);
+  length -= 2;			/* discount the length word itself */
+
+  if (traceit) {
+    if (cinfo->unread_marker == JPEG_COM)
+      fprintf(stderr, "Comment, length %ld:\n", (long) length);
+    else			/* assume it is an APPn otherwise */
+      fprintf(stderr, "APP%d, length %ld:\n",
+	      cinfo->unread_marker - JPEG_APP0, (long) length);
+  }
+
+  while (--length >= 0) {
+    ch = jpeg_getc(cinfo);
+    if (traceit) {
+      /* Emit the character in a readable form.
+       * Nonprintables are converted to \nnn form,
+       * while \ is converted to \\.
+       * Newlines in CR, CR/LF, or LF form will be printed as one newline.
+       */
+      if (ch == '\r') {
+	fprintf(stderr, "\n");
+      } else if (ch == '\n') {
+	if (lastch != '\r')
+	  fprintf(stderr, "\n");
+      } else if (ch == '\\') {
+	fprintf(stderr, "\\\\");
+      } else if (isprint(ch)) {
+	putc(ch, stderr);
+      } else {
+	fprintf(stderr, "\\%03o", ch);
+      }
+      lastch = ch;
+    }
+  }
+
+  if (traceit)
+    fprintf(stderr, "\n");
+
+  return TRUE;
+}
+
+// EXIF thumbnails. Cameras store a small JPEG (typically 160x120) in the
+// APP1 marker; when the image is shrunk to no more than that, decoding the
+// thumbnail gives the same picture without touching the full image.
+static unsigned int ExifGet( const unsigned char *p, int size, int big_endian )
+{
+	if (size == 2)
+		return big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+	return big_endian ? ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+		p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// The JPEG thumbnail in an EXIF APP1 payload (IFD1), NULL if there is none
+static const unsigned char *ExifThumbnail( const unsigned char *p, size_t len, size_t *size )
+{
+	const unsigned char *tiff = p + 6;
+	size_t n = len - 6, ifd, end;
+	unsigned int count, tag, offset = 0, length = 0;
+	int be;
+
+	if (len < 6 + 8 || memcmp( p, "Exif\0\0", 6 ))
+		return NULL;
+	if (!memcmp( tiff, "MM\0*", 4 ))
+		be = 1;
+	else if (!memcmp( tiff, "II*\0", 4 ))
+		be = 0;
+	else
+		return NULL;
+
+	// Step over IFD0 to IFD1, which describes the thumbnail
+	ifd = ExifGet( tiff + 4, 4, be );
+	if (ifd < 8 || ifd > n - 2)
+		return NULL;
+	count = ExifGet( tiff + ifd, 2, be );
+	end = ifd + 2 + (size_t)count * EXIF_IFD_ENTRY;
+	if (end > n - 4)
+		return NULL;
+	ifd = ExifGet( tiff + end, 4, be );
+	if (ifd < 8 || ifd > n - 2)
+		return NULL;
+	count = ExifGet( tiff + ifd, 2, be );
+	if (ifd + 2 + (size_t)count * EXIF_IFD_ENTRY > n)
+		return NULL;
+	for (p = tiff + ifd + 2; count--; p += EXIF_IFD_ENTRY)
+	{
+		tag = ExifGet( p, 2, be );
+		if (tag == EXIF_TAG_JPEG_OFFSET)
+			offset = ExifGet( p + 8, 4, be );
+		else if (tag == EXIF_TAG_JPEG_LENGTH)
+			length = ExifGet( p + 8, 4, be );
+	}
+	if (!offset || length < 4 || offset > n || length > n - offset)
+		return NULL;
+	*size = length;
+	return tiff + offset;
+}
+
+// Frame size from a JPEG's SOFn marker
+static int JpegFrameSize( const unsigned char *p, size_t len, unsigned int *width, unsigned int *height )
+{
+	size_t pos = 2;
+	int m;
+
+	if (len < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return -1;
+	while (pos + 4 <= len && p[pos] == 0xff)
+	{
+		m = p[pos + 1];
+		if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc)
+		{
+			if (pos + 9 > len)
+				return -1;
+			*height = (p[pos + 5] << 8) | p[pos + 6];
+			*width = (p[pos + 7] << 8) | p[pos + 8];
+			return *width && *height ? 0 : -1;
+		}
+		pos += 2 + ((p[pos + 2] << 8) | p[pos + 3]);
+	}
+	return -1;
+}
+
+// A copy of the EXIF thumbnail when it is at least width x height and has
+// the image's proportions (give or take 2%), else NULL
+static unsigned char *JpegThumbnail( j_decompress_ptr cinfo, unsigned int width, unsigned int height,
+	size_t *size, unsigned int *thumb_width, unsigned int *thumb_height )
+{
+	jpeg_saved_marker_ptr m;
+	const unsigned char *thumb;
+	unsigned char *copy;
+	uint64_t a, b;
+
+	for (m = cinfo->marker_list; m; m = m->next)
+	{
+		if (m->marker != JPEG_APP0 + 1 || !(thumb = ExifThumbnail( m->data, m->data_length, size )))
+			continue;
+		if (JpegFrameSize( thumb, *size, thumb_width, thumb_height ) ||
+			*thumb_width < width || *thumb_height < height)
+			return NULL;
+		a = (uint64_t)*thumb_width * cinfo->image_height;
+		b = (uint64_t)*thumb_height * cinfo->image_width;
+		if ((a > b ? a - b : b - a) * 50 > b)
+			return NULL;
+		if ((copy = (unsigned char *)malloc( *size )))
+			memcpy( copy, thumb, *size );
+		return copy;
+	}
+	return NULL;
+}
+
+// --crop with a proportional shrink (--resize=64): scale in the IDCT by
+// the smallest M/8 that leaves the window at least the size of the screen,
+// so the display vectors have the least left to drop
+static void JpegCropScale( struct imgtool_conf *conf, j_decompress_ptr cinfo )
+{
+	uint64_t w = conf->crop_w ? conf->crop_w : conf->width;
+	uint64_t h = conf->crop_h ? conf->crop_h : conf->height;
+	unsigned int num;
+
+	for (num = 1; num < 8 && (w * num / 8 < conf->width || h * num / 8 < conf->height); num++)
+		;
+	cinfo->scale_num = num;
+	cinfo->scale_denom = 8;
+}
+
+// Start decoding at the --crop window at x,y: the iMCU columns to either
+// side of it are not decoded, nor (with libjpeg-turbo) are the rows above
+// it beyond what the entropy decoder must step through. Returns the
+// samples to step over at the start of each row read.
+static JDIMENSION JpegCropStart( j_decompress_ptr cinfo, unsigned int x, unsigned int y, unsigned int width,
+	JSAMPARRAY scratch )
+{
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+	// A pixel more on either side: upsampling replicates the edge pixels
+	// of the cropped region, which must not be the window's own
+	JDIMENSION xoff = x ? x - 1 : 0;
+	JDIMENSION cropWidth = x + width - xoff + (x + width < cinfo->output_width);
+
+	jpeg_crop_scanline( cinfo, &xoff, &cropWidth );
+	if (y)
+		jpeg_skip_scanlines( cinfo, y );
+	return (x - xoff) * cinfo->output_components;
+#else
+	while (cinfo->output_scanline < y)
+		jpeg_read_scanlines( cinfo, scratch, 1 );
+	return x * cinfo->output_components;
+#endif
+}
+
+static int
+ShowJpeg(struct imgtool_conf *conf, struct img_input *in)
+{
+	struct jpeg_decompress_struct local_cinfo, *cinfo = conf->dinfo;
+	struct jpeg_jmp_error local_jerr, *jerr;
+	struct fb_dev fb;
+	volatile int fb_open = 0;
+	JDIMENSION num_scanlines;
+	/* Output pixel-row buffer.  Created by module init or start_output.
+	* Width is cinfo->output_width * cinfo->output_components;
+	* height is buffer_height.
+	*/
+	JSAMPARRAY buffer;
+	JDIMENSION buffer_height;
+	uint64_t t0, start = StatsNow();
+	int final = 1, early = 0, coarse, skip, status, ret = 0;
+
+	if (cinfo)
+		jerr = (struct jpeg_jmp_error *) cinfo->err;
+	else
+	{
+		/* Initialize a one-shot JPEG decompression object */
+		cinfo = &local_cinfo;
+		jerr = &local_jerr;
+		cinfo->err = jpeg_jmp_error(jerr);
+		jpeg_create_decompress(cinfo);
+	}
+
+	/* libjpeg errors come back here */
+	if (setjmp(jerr->jmp))
+	{
+		if (fb_open)
+			FBClose( &fb );
+		if (cinfo == &local_cinfo)
+			jpeg_destroy_decompress(cinfo);
+		else
+			jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	/* Insert custom marker processor for COM and APP12.
+	* APP12 is used by some digital camera makers for textual info,
+	* so we provide the ability to display it as text.
+	* If you like, additional APPn marker types can be selected for display,
+	* but don't try to override APP0 or APP14 this way (see libjpeg.doc).
+	*/
+	jpeg_set_marker_processor(cinfo, JPEG_COM, print_text_marker);
+	jpeg_set_marker_processor(cinfo, JPEG_APP0+12, print_text_marker);
+	// Keep EXIF for its thumbnail when the image may be shrunk
+	jpeg_save_markers(cinfo, JPEG_APP0+1, (conf->resize_options & RESIZE_ANY) && !in->thumbnail ? 0xffff : 0);
+
+	/* Specify data source for decompression */
+	jpeg_input_src(cinfo, in);
+
+	/* Read file header, set default decompression parameters */
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("decode", "jpeg_read_header", 0);
+	(void) jpeg_read_header(cinfo, TRUE);
+
+	// A --crop window that must shrink: the IDCT does what it can of that
+	if (conf->crop && (conf->resize_options & RESIZE_SHRINK_MAX))
+		JpegCropScale( conf, cinfo );
+
+	/* Calculate output image dimensions so we can allocate space */
+	jpeg_calc_output_dimensions(cinfo);
+	TRACE_END("decode", "jpeg_read_header", 0);
+	STATS_END(conf, PHASE_HEADER, t0);
+
+	/* Create decompressor output buffer. */
+	JDIMENSION row_width;
+	row_width = cinfo->output_width * cinfo->output_components;
+	buffer = (*cinfo->mem->alloc_sarray)
+	((j_common_ptr) cinfo, JPOOL_IMAGE, row_width, (JDIMENSION) 1);
+	buffer_height = 1;
+
+	// What is drawn: the whole image or the --crop window of it
+	unsigned int cropX = 0, cropY = 0, imgWidth = cinfo->output_width, imgHeight = cinfo->output_height;
+	JDIMENSION cropLeft = 0;
+	if (conf->crop && CropWindow( conf, in->name, cinfo->scale_num, cinfo->scale_denom,
+		&cropX, &cropY, &imgWidth, &imgHeight ))
+		longjmp( jerr->jmp, 1 );
+
+	// Determine resizing
+	unsigned int scaledWidth, scaledHeight;
+	scaledWidth = imgWidth;
+	scaledHeight = imgHeight;
+	t0 = STATS_BEGIN(conf);
+	if (AdjustOutputSize(&scaledWidth, &scaledHeight, conf))
+	{
+		PROGRESS( conf, "Scaling from %dX%d to %dX%d (%d%%/%d%%)\n",
+			(int)imgWidth, (int)imgHeight,
+			scaledWidth, scaledHeight,
+			conf->x_pct, conf->y_pct );
+	}
+	STATS_END(conf, PHASE_RESIZE, t0);
+
+	// Shrinking to no more than the EXIF thumbnail: draw that instead.
+	// The size shown is what the display vectors keep.
+	if ((conf->resize & (X_SHRINK | Y_SHRINK)) && !in->thumbnail && !conf->crop)
+	{
+		struct img_input thumb_in;
+		unsigned int thumbWidth, thumbHeight;
+		size_t thumbSize;
+		unsigned char *thumb = JpegThumbnail( cinfo, cinfo->output_width * conf->x_pct / 100,
+			cinfo->output_height * conf->y_pct / 100, &thumbSize, &thumbWidth, &thumbHeight );
+		if (thumb)
+		{
+			PROGRESS( conf, "Drawing the %ux%u EXIF thumbnail of %s\n", thumbWidth, thumbHeight, in->name );
+			if (cinfo == &local_cinfo)
+				jpeg_destroy_decompress(cinfo);
+			else
+				jpeg_abort_decompress(cinfo);
+			InputOpenMem( &thumb_in, thumb, thumbSize );
+			thumb_in.name = in->name;
+			thumb_in.thumbnail = 1;
+			int ret = ShowJpeg( conf, &thumb_in );
+			free( thumb );
+			return ret;
+		}
+	}
+
+	// More than one frame buffer: decode the whole image once (as a PNG
+	// is), then draw it to all of them
+	if (conf->ntargets)
+	{
+		struct decoded_image img = { NULL, imgWidth, imgHeight, 0, 0, NULL };
+		unsigned char *fbRow;
+		unsigned int row;
+
+		// Each row has a spare zero byte after it, as libjpeg's own row
+		// buffer does: the ARGB8888 converter reads a byte past the pixel
+		ArenaReset( conf->arena );
+		if (ArenaReserve( conf->arena, (size_t)img.height * (sizeof(png_bytep) + ARENA_ROUND(row_width + 1))
+			+ ARENA_ROUND(BytesPerFBPixel(conf->fmt) * (conf->width + 1)) ))
+			ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+		img.rows = (png_bytep *)ArenaAlloc( conf->arena, img.height * sizeof(png_bytep) );
+		fbRow = (unsigned char *)ArenaAlloc( conf->arena, BytesPerFBPixel(conf->fmt) * (conf->width + 1) );
+		for (row = 0; img.rows && row < img.height; row++)
+			if ((img.rows[row] = (png_bytep)ArenaAlloc( conf->arena, row_width + 1 )))
+				img.rows[row][row_width] = 0;
+			else
+				break;
+		if (!img.rows || !fbRow || row < img.height)
+			ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("decode", "jpeg_start_decompress", 0);
+		(void) jpeg_start_decompress(cinfo);
+		TRACE_END("decode", "jpeg_start_decompress", 0);
+		if (conf->crop)
+			cropLeft = JpegCropStart( cinfo, cropX, cropY, imgWidth, img.rows );
+		while (cinfo->output_scanline < cropY + imgHeight)
+		{
+			TRACE_BATCH(cinfo->output_scanline);
+			TRACE_BEGIN("decode", "jpeg_read_scanlines", cinfo->output_scanline);
+			jpeg_read_scanlines(cinfo, &img.rows[cinfo->output_scanline - cropY], 1);
+			TRACE_END("decode", "jpeg_read_scanlines", cinfo->output_scanline - 1);
+		}
+		TRACE_BATCH_DONE(cinfo->output_scanline);
+		for (row = 0; cropLeft && row < img.height; row++)
+			img.rows[row] += cropLeft;
+		TRACE_BEGIN("decode", "jpeg_finish_decompress", 0);
+		// Rows below a --crop window are never read
+		if (cinfo->output_scanline < cinfo->output_height)
+			jpeg_abort_decompress(cinfo);
+		else
+			(void) jpeg_finish_decompress(cinfo);
+		TRACE_END("decode", "jpeg_finish_decompress", 0);
+		STATS_END(conf, PHASE_DECODE, t0);
+		if (cinfo == &local_cinfo)
+			jpeg_destroy_decompress(cinfo);
+		STATS_ADD(conf, bytes_read, in->bytes);
+
+		return DrawTargets( conf, &img, fbRow );
+	}
+
+	// Open frame buffer
+	if (FBOpen( &fb, conf, 1 ) == 0)
+		fb_open = 1;
+	else
+	{
+		fprintf( stderr, "Error: could not open frame buffer (errno=%d)\n", errno );
+		ret = -1;
+	}
+
+	// Progressive files are painted once per scan as the scans arrive
+	// (buffered-image mode), so a coarse picture is up long before the
+	// last scan is in. That needs a mapping to paint over: a stream takes
+	// each row once, so it only gets a single pass at the --scans'th scan.
+	// A file already in memory has every scan at hand: unless --scans asks
+	// for more, it gets the coarse first scan and then the final picture.
+	// A --crop window is decoded in one pass that skips the rows above it.
+	if (fb_open && jpeg_has_multiple_scans(cinfo) && (fb.mem || conf->jpeg_scans > 0) && !conf->crop)
+		cinfo->buffered_image = TRUE;
+
+	/* Start decompressor */
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("decode", "jpeg_start_decompress", 0);
+	(void) jpeg_start_decompress(cinfo);
+	TRACE_END("decode", "jpeg_start_decompress", 0);
+	if (conf->crop)
+		cropLeft = JpegCropStart( cinfo, cropX, cropY, imgWidth, buffer );
+	STATS_END(conf, PHASE_DECODE, t0);
+
+	/* Write output file header */
+	//(*dest_mgr->start_output) (cinfo, dest_mgr);
+
+   if (fb_open)
+   {
+		// libjpeg keeps its own pools; only our conversion row is in the arena
+		ArenaReset( conf->arena );
+		unsigned char *fbRow = (unsigned char *)ArenaAlloc(conf->arena, BytesPerFBPixel(conf->fmt)*conf->width);
+		if (!fbRow)
+			ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+		unsigned int maxRow = imgHeight-1;
+		unsigned int minRow = 0;
+		int fillRows = 0;
+		if (!conf->resize)
+		{
+			// Clip oversized rows
+			if (maxRow < imgHeight-1)
+			{
+				minRow = imgHeight-conf->height;
+			}
+		}
+		unsigned int dispRow = minRow;
+		// Fill empty space
+		if (maxRow - minRow < conf->height-1)
+		{
+			fillRows = conf->height - 1 - maxRow - minRow;
+		}
+		PROGRESS( conf, "Displaying rows from %d to %d inclusive\n", minRow, maxRow );
+		unsigned int row = minRow;
+
+		do
+		{
+		if (cinfo->buffered_image)
+		{
+			t0 = STATS_BEGIN(conf);
+			// The first scan is painted as it arrives, for the earliest
+			// picture. Later ones wait until all of a scan is in, that is
+			// until the next one starts, and the end of the file brings the
+			// final pass, painted once; a file in memory goes from its first
+			// scan straight to the end. A stream gets one pass and reads
+			// the scans it shows up front.
+			coarse = fb.mem && !cinfo->output_scan_number;
+			skip = in->map && conf->jpeg_scans <= 0;
+			status = JPEG_REACHED_SOS;
+			while (!coarse && status != JPEG_SUSPENDED && status != JPEG_REACHED_EOI)
+			{
+				status = jpeg_consume_input(cinfo);
+				if (status == JPEG_REACHED_SOS && !skip && cinfo->input_scan_number >
+					(fb.mem ? cinfo->output_scan_number + 1 : conf->jpeg_scans))
+					break;
+			}
+			final = jpeg_input_complete(cinfo);
+			jpeg_start_output(cinfo, final || coarse ? cinfo->input_scan_number : cinfo->input_scan_number - 1);
+			STATS_END(conf, PHASE_DECODE, t0);
+		}
+		dispRow = minRow;
+
+		/* Process data */
+		while (cinfo->output_scanline < cropY + imgHeight)
+		{
+			TRACE_BATCH(cinfo->output_scanline);
+			t0 = STATS_BEGIN(conf);
+			TRACE_BEGIN("decode", "jpeg_read_scanlines", cinfo->output_scanline);
+			num_scanlines = jpeg_read_scanlines(cinfo, buffer,
+						buffer_height);
+			TRACE_END("decode", "jpeg_read_scanlines", cinfo->output_scanline - 1);
+			STATS_END(conf, PHASE_DECODE, t0);
+			row = cinfo->output_scanline - 1 - cropY;
+			if (row >= minRow && row<=maxRow && dispRow < conf->height)
+			{
+				//(*dest_mgr->put_pixel_rows) (cinfo, dest_mgr, num_scanlines);
+				// If resizing, determine whether we skip this one
+				if (conf->resize & Y_SHRINK)
+				{
+					// Determine rows to skip
+					if (conf->disp_y[row%100] == 0)
+					{
+						// Skip this one
+						continue;
+					}
+				}
+
+				t0 = STATS_BEGIN(conf);
+				TRACE_BEGIN("convert", "RGB8toFBPng", row);
+				RGB8toFBPng( conf, fbRow, buffer[0] + cropLeft, imgWidth, 0, NULL );
+				TRACE_END("convert", "RGB8toFBPng", row);
+				STATS_END(conf, PHASE_CONVERT, t0);
+				t0 = STATS_BEGIN(conf);
+				TRACE_BEGIN("fb", "WriteFB", dispRow);
+				if (FBWriteRow( &fb, dispRow, fbRow ) < 0)
+					ret = -1;
+				TRACE_END("fb", "WriteFB", dispRow);
+				STATS_END(conf, PHASE_FB_WRITE, t0);
+				STATS_ADD(conf, bytes_written, BytesPerFBPixel(conf->fmt) * conf->width);
+				STATS_ADD(conf, rows, 1);
+				dispRow++;
+				if (conf->debug_level && dispRow <= 10)
+				{
+					HexDump( row, "r8g8b8", buffer[0] + cropLeft, imgWidth*3 );
+					HexDump( row, "r5g6b5", fbRow, imgWidth*2 );
+				}
+			}
+		}
+		TRACE_BATCH_DONE(cinfo->output_scanline);
+		// Every row of the image that fits must have gone out
+		if (!(conf->resize & Y_SHRINK) && dispRow < (imgHeight < conf->height ? imgHeight : conf->height))
+		{
+			fprintf( stderr, "Error: %s: drew %u of %u rows\n", in->name, dispRow, imgHeight );
+			ret = -1;
+		}
+
+		if (cinfo->buffered_image)
+		{
+			t0 = STATS_BEGIN(conf);
+			jpeg_finish_output(cinfo);
+			STATS_END(conf, PHASE_DECODE, t0);
+			PROGRESS( conf, "Painted scan %d of %s at %.1f ms\n", cinfo->output_scan_number,
+				final ? "all" : "those read", (StatsNow() - start) / 1e6 );
+			// A preview: --scans were painted, or all a stream can take
+			if (!final && (!fb.mem || (conf->jpeg_scans > 0 && cinfo->output_scan_number >= conf->jpeg_scans)))
+				early = 1;
+		}
+		} while (!final && !early);
+
+		PROGRESS( conf, "Closing frame buffer\n" );
+		if (FBClose( &fb ) < 0)
+			ret = -1;
+		fb_open = 0;
+		// Rows below a --crop window are never read
+		if (cinfo->output_scanline < cinfo->output_height && conf->crop)
+			early = 1;
+   }
+
+	/* Finish decompression and release memory.
+	* I must do it in this order because output module has allocated memory
+	* of lifespan JPOOL_IMAGE; it needs to finish before releasing memory.
+	*/
+	//(*dest_mgr->finish_output) (cinfo, dest_mgr);
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("decode", "jpeg_finish_decompress", 0);
+	// Stopped early: the remaining scans are never read
+	if (early)
+		jpeg_abort_decompress(cinfo);
+	else
+		(void) jpeg_finish_decompress(cinfo);
+	TRACE_END("decode", "jpeg_finish_decompress", 0);
+	STATS_END(conf, PHASE_DECODE, t0);
+	if (cinfo == &local_cinfo)
+		jpeg_destroy_decompress(cinfo);
+
+	STATS_ADD(conf, bytes_read, in->bytes);
+
+	return ret;
+}
+
+#endif
+
+// Display bmp to frame buffer. No resizing - must be the right size
+#if 0
+static int ShowBmp(struct imgtool_conf *conf)
+{
+	// Open input file
+	int hInput = open( conf->filename, O_RDONLY );
+	if (hInput == -1)
+	{
+		fprintf( stderr, "Error: cannot open %s for input; errno=%d (%s)\n", conf->filename, errno, strerror(errno) );
+		return -1;
+	}
+	int ret = -1;
+	int hOutput = -1;
+	int bpp;
+	int bmp_width;
+	int bmp_height;
+	int bmp_compression;
+	int bytes_per_pixel;
+	int row;
+	unsigned char *input_buff;
+	unsigned char *output_buff;
+	// Read bmp header
+	BMPHeader_t bh;
+	if (read( hInput, &bh, sizeof(bh) ) != sizeof(bh))
+	{
+		fprintf( stderr, "Error: cannot read %d bytes from %s for bmp header\n", sizeof(bh), conf->filename );
+		goto exit_close_input;
+	}
+	if (!bh.fileHeader.IsBMP())
+	{
+		fprintf( stderr, "Error: %s lacks required BM signature - not a bmp file\n", conf->filename );
+		goto exit_close_input;
+	}
+	if (bh.infoHeader.GetPlanes() != 1)
+	{
+		fprintf( stderr, "Error: %s has %d planes, only 1 plane supported\n", conf->filename, bh.infoHeader.GetPlanes() );
+		goto exit_close_input;
+	}
+	bpp = bh.infoHeader.GetBitsPerPixel();
+	bmp_width = bh.infoHeader.GetImageWidth();
+	bmp_height = bh.infoHeader.GetImageHeight();
+	bmp_compression = bh.infoHeader.GetCompressionType();
+	fprintf( stderr, "Opened %s for input, %dX%d %dbpp\n", conf->filename, bmp_width, bmp_height, bpp );
+	if (bmp_compression != 0)
+	{
+		if (bmp_compression == 3)
+		{
+			fprintf( stderr, "Warning: file marked as using compression type %d, attempting render anyway\n", bmp_compression );
+		}
+		else
+		{
+			fprintf( stderr, "Compression type %d not supported\n", bmp_compression );
+			goto exit_close_input;
+		}
+	}
+	if (bpp != 16 && bpp != 24 && bpp != 32)
+	{
+		fprintf( stderr, "Only 16bpp, 24bpp or 32bpp supported\n" );
+		goto exit_close_input;
+	}
+	/*****
+	 * Allow display of  smaller bmp left justified
+	if (bmp_width != conf->width || bmp_height != conf->height)
+	{
+		fprintf( stderr, "bmp size is %dX%d - must match specified frame buffer size %dX%d\n",
+			bmp_width, bmp_height, conf->width, conf->height );
+		goto exit_close_input;
+	}
+	 *
+	******/
+	if (lseek( hInput, bh.fileHeader.GetImageDataOffset(), SEEK_SET ) == -1L)
+	{
+		fprintf( stderr, "Error: seek to image data offset %ld on input file %s failed, errno=%d (%s)\n",
+			bh.fileHeader.GetImageDataOffset(), conf->filename, errno, strerror(errno) );
+		goto exit_close_input;
+	}
+
+	// Now open output
+	hOutput = OpenOutput( conf->width, conf->height, conf->output, true );
+	if (hOutput < 0)
+	{
+		fprintf( stderr, "Error: failed to open %s (errno=%d)\n", conf->output, errno );
+		goto exit_close_input;
+	}
+
+	// Allocate input and output buffers
+	bytes_per_pixel = bpp / 8;
+	input_buff = (unsigned char*)malloc( bytes_per_pixel * bmp_width * bmp_height );
+	if (input_buff == NULL)
+	{
+		fprintf( stderr, "Malloc failed for %d bytes\n", bytes_per_pixel * bmp_width * bmp_height );
+		goto exit_close_input;
+	}
+	output_buff = (unsigned char*)malloc( BytesPerFBPixel(conf->fmt) * conf->width );
+	if (output_buff == NULL)
+	{
+		fprintf( stderr, "malloc failed for %d bytes\n", BytesPerFBPixel(conf->fmt) * conf->width );
+		goto exit_free_input_buff;
+	}
+
+	if (read( hInput, input_buff, bytes_per_pixel * bmp_width * bmp_height ) != bytes_per_pixel * bmp_width * bmp_height)
+	{
+		fprintf( stderr, "read failed for %d bytes\n", bytes_per_pixel * bmp_width * bmp_height );
+		goto exit_free_output_buff;
+	}
+
+	// Write bmp header if requested
+	if (conf->bmp_mode)
+	{
+		// Fix up bits per pixel, size of image, and file size
+		bh.infoHeader.SetBitsPerPixel( 8 * BytesPerFBPixel(conf->fmt) );
+		bh.infoHeader.SetImageDataLength( conf->width * conf->height * BytesPerFBPixel(conf->fmt) );
+		bh.fileHeader.SetFilesize( bh.fileHeader.GetImageDataOffset() + conf->width * conf->height * BytesPerFBPixel(conf->fmt) );
+		// Write same size header
+		if (WriteFB( hOutput, &bh, bh.fileHeader.GetImageDataOffset() ) != (int)bh.fileHeader.GetImageDataOffset())
+		{
+			fprintf( stderr, "bmp header write failed, errno=%d (%s)\n", errno, strerror(errno) );
+			goto exit_free_output_buff;
+		}
+	}
+
+	// FIXME use g_fill
+	memset( output_buff, 0, bytes_per_pixel * conf->width );
+	for (row = 0; row < bmp_height; row++)
+	{
+		// If bmp mode, we're not flipping
+		int yRow = row;
+		int bmpyRow = row;
+		if (!conf->bmp_mode)
+		{
+			yRow = conf->height - row - 1;
+			bmpyRow = bmp_height - row - 1;
+		}
+		// Kluge for rgb565 bmp files
+		if (bpp == 16)
+		{
+			memcpy( output_buff, &input_buff[bmpyRow * bmp_width * bytes_per_pixel], bmp_width * bytes_per_pixel );
+		}
+		else
+		{
+			ARGB8888toFB( conf, output_buff, &input_buff[bmpyRow*bmp_width*bytes_per_pixel], bmp_width );
+		}
+		if (WriteFB( hOutput, output_buff, BytesPerFBPixel(conf->fmt) * conf->width ) != (int)(BytesPerFBPixel(conf->fmt) * conf->width))
+		{
+			fprintf( stderr, "write failed for %d bytes at row %d\n", BytesPerFBPixel(conf->fmt) * conf->width, row );
+			goto exit_free_output_buff;
+		}
+	}
+
+	ret = 0;
+
+exit_free_output_buff:
+	free( output_buff );
+exit_free_input_buff:
+	free( input_buff );
+	close(hOutput);
+exit_close_input:
+	close( hInput );
+	return ret;
+}
+#endif
+
+// Background capture (--background, --budget). Screenshots on a busy device
+// must not cost the UI frames, so the capture drops to SCHED_IDLE (or a
+// nice level), reads the frame buffer BG_CHUNK_BYTES at a time and yields
+// between chunks, sleeping as needed to keep under the byte budget. Encoder
+// work done after the reads (png) counts towards chunks too. The longest
+// stretch run between yields is what a co-scheduled task could have been
+// held up by, and is reported as the jitter added.
+//
+// An unprivileged thread cannot raise its priority again, so the capture
+// runs on a thread of its own (BackgroundRun()) and the caller's scheduling
+// is never touched; on Linux both the policy and the nice level are per
+// thread.
+#define BG_CHUNK_BYTES	(64*1024)
+
+struct bg_pace {
+	int active;
+	uint64_t budget;		// Bytes per second, 0 for no limit
+	unsigned int encode_row;	// Work per row counted by PngPaceRow()
+	uint64_t start_ns;
+	uint64_t run_ns;		// Start of the current chunk
+	uint64_t bytes;			// Frame buffer bytes read so far
+	uint64_t chunk;			// ... since the last yield
+	uint64_t chunks;
+	uint64_t run_max_ns, run_total_ns;
+	uint64_t sleep_ns;		// Time spent holding to the budget
+	uint64_t late_max_ns;		// Worst oversleep past a budget deadline
+};
+
+static inline int Background( const struct imgtool_conf *conf )
+{
+	return conf->background || conf->budget;
+}
+
+static void BackgroundBegin( struct imgtool_conf *conf, struct bg_pace *bg )
+{
+	struct sched_param idle;
+
+	memset( bg, 0, sizeof(*bg) );
+	if (!Background( conf ))
+		return;
+	bg->active = 1;
+	bg->budget = conf->budget;
+	if (conf->background && conf->background_nice > 0)
+	{
+		if (setpriority( PRIO_PROCESS, 0, conf->background_nice ) == -1)
+			fprintf( stderr, "Warning: could not set nice %d, errno=%d (%s)\n",
+				conf->background_nice, errno, strerror(errno) );
+	}
+	else if (conf->background)
+	{
+		memset( &idle, 0, sizeof(idle) );
+		if (sched_setscheduler( 0, SCHED_IDLE, &idle ) == -1)
+			fprintf( stderr, "Warning: could not switch to SCHED_IDLE, errno=%d (%s)\n",
+				errno, strerror(errno) );
+	}
+	bg->start_ns = bg->run_ns = StatsNow();
+}
+
+// Account for frame buffer bytes just read, or other work measured in bytes
+// processed; at the end of a chunk, yield or sleep
+static void BackgroundPace( struct bg_pace *bg, unsigned int fb_bytes, unsigned int work_bytes )
+{
+	uint64_t now, due, run;
+	struct timespec ts;
+
+	if (!bg->active)
+		return;
+	bg->bytes += fb_bytes;
+	bg->chunk += fb_bytes + work_bytes;
+	if (bg->chunk < BG_CHUNK_BYTES)
+		return;
+	bg->chunk = 0;
+	now = StatsNow();
+	run = now - bg->run_ns;
+	bg->chunks++;
+	bg->run_total_ns += run;
+	if (run > bg->run_max_ns)
+		bg->run_max_ns = run;
+
+	due = bg->budget ? bg->start_ns + bg->bytes * 1000000000ULL / bg->budget : 0;
+	if (due > now)
+	{
+		ts.tv_sec = (due - now) / 1000000000ULL;
+		ts.tv_nsec = (due - now) % 1000000000ULL;
+		while (nanosleep( &ts, &ts ) == -1 && errno == EINTR)
+			;
+		bg->run_ns = StatsNow();
+		bg->sleep_ns += bg->run_ns - now;
+		if (bg->run_ns - due > bg->late_max_ns)
+			bg->late_max_ns = bg->run_ns - due;
+		return;
+	}
+	sched_yield();
+	bg->run_ns = StatsNow();
+}
+
+// Report; the scheduling set by BackgroundBegin() ends with the thread
+static void BackgroundEnd( struct imgtool_conf *conf, struct bg_pace *bg )
+{
+	uint64_t total;
+
+	if (!bg->active)
+		return;
+	if (bg->chunk)
+	{
+		// The last, partial chunk
+		total = StatsNow() - bg->run_ns;
+		bg->chunks++;
+		bg->run_total_ns += total;
+		if (total > bg->run_max_ns)
+			bg->run_max_ns = total;
+	}
+	total = StatsNow() - bg->start_ns;
+	PROGRESS( conf, "Background capture: %llu bytes in %.1f ms (%.0f KiB/s), %llu chunks; "
+		"jitter added %.3f ms max, %.3f ms mean; throttled %.1f ms, woke up to %.3f ms late\n",
+		(unsigned long long)bg->bytes, total / 1e6,
+		total ? bg->bytes / 1024.0 / (total / 1e9) : 0.0, (unsigned long long)bg->chunks,
+		bg->run_max_ns / 1e6, bg->chunks ? bg->run_total_ns / 1e6 / bg->chunks : 0.0,
+		bg->sleep_ns / 1e6, bg->late_max_ns / 1e6 );
+	bg->active = 0;
+}
+
+static __thread int bg_thread;		// Set on the thread BackgroundRun() starts
+
+struct bg_run {
+	struct imgtool_conf *conf;
+	enum imgtool_format fmt;
+	int ret;
+};
+
+static void *BackgroundThread( void *arg )
+{
+	struct bg_run *run = (struct bg_run *)arg;
+
+	bg_thread = 1;
+	if (run->fmt == IMGTOOL_FMT_JPEG)
+		run->ret = CaptureJpeg( run->conf );
+#ifndef NO_PNG
+	else if (run->fmt == IMGTOOL_FMT_PNG)
+		run->ret = CapturePng( run->conf );
+#endif
+	else
+		run->ret = CaptureRaw( run->conf, run->fmt == IMGTOOL_FMT_RAW_HEADER );
+	return NULL;
+}
+
+// Returns 1 when a background capture must first move to its own thread
+static inline int BackgroundMove( const struct imgtool_conf *conf )
+{
+	return Background( conf ) && !bg_thread;
+}
+
+// Run a background capture on a new thread and wait for it
+static int BackgroundRun( struct imgtool_conf *conf, enum imgtool_format fmt )
+{
+	struct bg_run run;
+	pthread_t thread;
+	int err;
+
+	run.conf = conf;
+	run.fmt = fmt;
+	run.ret = -1;
+	if ((err = pthread_create( &thread, NULL, BackgroundThread, &run )))
+	{
+		fprintf( stderr, "Error: cannot start background capture thread, errno=%d (%s)\n", err, strerror(err) );
+		return -1;
+	}
+	pthread_join( thread, NULL );
+	return run.ret;
+}
+
+// EXIF thumbnail (--thumb=n) for a capture: the frame buffer box-averaged
+// down to n pixels on its longer side, sampling at most EXIF_THUMB_ROWS
+// rows per thumbnail row, encoded as a JPEG and wrapped in a minimal EXIF
+// APP1 payload (IFD0 with the orientation, IFD1 pointing at the JPEG).
+// Returns NULL when the frame buffer is not mapped, since a stream can
+// only be read once.
+#define EXIF_THUMB_ROWS		4
+#define EXIF_HEADER_SIZE	(6 + 8 + 2 + EXIF_IFD_ENTRY + 4 + 2 + 3 * EXIF_IFD_ENTRY + 4)
+
+static unsigned char *ExifPut( unsigned char *p, unsigned int v, int size )
+{
+	while (size--)
+	{
+		*p++ = v & 0xff;
+		v >>= 8;
+	}
+	return p;
+}
+
+static unsigned char *ExifEntry( unsigned char *p, unsigned int tag, unsigned int type, unsigned int value )
+{
+	p = ExifPut( p, tag, 2 );
+	p = ExifPut( p, type, 2 );
+	p = ExifPut( p, 1, 4 );
+	return ExifPut( p, value, 4 );
+}
+
+static unsigned char *JpegExifThumbnail( struct imgtool_conf *conf, struct fb_dev *fb, size_t *size )
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_jmp_error jerr;
+	unsigned int tw, th, tx, ty, x, y, y0, y1, step, x1, n, c;
+	uint32_t *sum = NULL;
+	unsigned char *rgb = NULL, *exif = NULL, *p;
+	JSAMPROW row;
+	char *jpg = NULL;
+	size_t jlen = 0;
+	FILE *f = NULL;
+
+	if (!fb->mem)
+	{
+		fprintf( stderr, "Warning: no thumbnail, the frame buffer is streamed\n" );
+		return NULL;
+	}
+	if (conf->width >= conf->height)
+	{
+		tw = (unsigned int)conf->thumbnail < conf->width ? (unsigned int)conf->thumbnail : conf->width;
+		th = (conf->height * tw + conf->width / 2) / conf->width;
+	}
+	else
+	{
+		th = (unsigned int)conf->thumbnail < conf->height ? (unsigned int)conf->thumbnail : conf->height;
+		tw = (conf->width * th + conf->height / 2) / conf->height;
+	}
+	if (!tw)
+		tw = 1;
+	if (!th)
+		th = 1;
+	sum = (uint32_t *)malloc( tw * 3 * sizeof(*sum) );
+	rgb = (unsigned char *)malloc( conf->width * 3 > tw * 3 ? conf->width * 3 : tw * 3 );
+	if (!sum || !rgb || !(f = open_memstream( &jpg, &jlen )))
+		goto out;
+
+	cinfo.err = jpeg_jmp_error( &jerr );
+	jpeg_create_compress( &cinfo );
+	if (setjmp( jerr.jmp ))
+	{
+		jpeg_destroy_compress( &cinfo );
+		goto out;
+	}
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults( &cinfo );
+	cinfo.input_components = 3;
+	cinfo.image_width = tw;
+	cinfo.image_height = th;
+	jpeg_default_colorspace( &cinfo );
+	jpeg_set_quality( &cinfo, conf->jpeg_quality, FALSE );
+	cinfo.write_JFIF_header = FALSE;
+	jpeg_stdio_dest( &cinfo, f );
+	jpeg_start_compress( &cinfo, TRUE );
+	row = rgb;
+	for (ty = 0; ty < th; ty++)
+	{
+		y0 = (uint64_t)ty * conf->height / th;
+		y1 = (uint64_t)(ty + 1) * conf->height / th;
+		step = (y1 - y0 + EXIF_THUMB_ROWS - 1) / EXIF_THUMB_ROWS;
+		memset( sum, 0, tw * 3 * sizeof(*sum) );
+		for (y = y0, n = 0; y < y1; y += step, n++)
+		{
+			FBtoRGB888( conf, rgb, FBReadRow( fb, y, NULL ), conf->width );
+			for (x = 0, tx = 0; tx < tw; tx++)
+				for (x1 = (uint64_t)(tx + 1) * conf->width / tw; x < x1; x++)
+					for (c = 0; c < 3; c++)
+						sum[tx * 3 + c] += rgb[x * 3 + c];
+		}
+		for (tx = 0; tx < tw; tx++)
+		{
+			x = ((uint64_t)(tx + 1) * conf->width / tw - (uint64_t)tx * conf->width / tw) * n;
+			for (c = 0; c < 3; c++)
+				rgb[tx * 3 + c] = (sum[tx * 3 + c] + x / 2) / x;
+		}
+		(void) jpeg_write_scanlines( &cinfo, &row, 1 );
+	}
+	jpeg_finish_compress( &cinfo );
+	jpeg_destroy_compress( &cinfo );
+	if (fclose( f ))
+		jlen = 0;
+	f = NULL;
+
+	// Marker payloads are limited to 65533 bytes
+	*size = EXIF_HEADER_SIZE + jlen;
+	if (!jlen || *size > 65533)
+	{
+		fprintf( stderr, "Warning: a %ux%u thumbnail does not fit in EXIF\n", tw, th );
+		goto out;
+	}
+	if (!(exif = (unsigned char *)malloc( *size )))
+		goto out;
+	memcpy( exif, "Exif\0\0II*\0", 10 );
+	p = ExifPut( exif + 10, 8, 4 );
+	p = ExifPut( p, 1, 2 );
+	p = ExifEntry( p, EXIF_TAG_ORIENTATION, 3, 1 );
+	p = ExifPut( p, 8 + 2 + EXIF_IFD_ENTRY + 4, 4 );
+	p = ExifPut( p, 3, 2 );
+	p = ExifEntry( p, EXIF_TAG_COMPRESSION, 3, 6 );
+	p = ExifEntry( p, EXIF_TAG_JPEG_OFFSET, 4, EXIF_HEADER_SIZE - 6 );
+	p = ExifEntry( p, EXIF_TAG_JPEG_LENGTH, 4, jlen );
+	p = ExifPut( p, 0, 4 );
+	memcpy( p, jpg, jlen );
+	PROGRESS( conf, "Embedding a %ux%u thumbnail (%zu bytes)\n", tw, th, jlen );
+
+out:
+	if (f)
+		fclose( f );
+	free( jpg );
+	free( rgb );
+	free( sum );
+	return exif;
+}
+
+// Strip-parallel JPEG capture (--jobs=n). The frame is cut into horizontal
+// strips of whole MCU rows and each strip is encoded on its own thread as a
+// standalone baseline JPEG, all with the same quality and the standard
+// Huffman tables. The strips are then joined into one image: the first
+// strip's headers with the full height patched into SOF and a DRI of one
+// strip's worth of MCUs, followed by each strip's entropy-coded data with
+// RSTn markers in between. A restart resets the DC predictors just as the
+// start of a strip did, so any baseline decoder accepts the result.
+#define JPEG_STRIPS_NONE	1	// Strips not possible; encode serially
+
+// Marker codes (jpeglib.h only names RSTn, EOI, APPn and COM)
+#define M_SOF0		0xc0
+#define M_SOI		0xd8
+#define M_SOS		0xda
+#define M_DRI		0xdd
+
+struct jpeg_strip {
+	unsigned int y0, rows;
+	char *data;			// Standalone JPEG for this strip
+	size_t size;
+	size_t sof, sos;		// Marker offsets in data
+	size_t entropy, entropy_end;	// Entropy-coded segment in data
+	int ret;
+};
+
+struct jpeg_strips {
+	struct imgtool_conf *conf;
+	struct fb_dev *fb;
+	struct jpeg_strip *strip;
+	unsigned int count;
+	unsigned int next;		// Next strip to encode
+};
+
+// Find SOF0, SOS and the entropy-coded data in a strip written by libjpeg
+static int JpegStripParse( struct jpeg_strip *strip )
+{
+	const unsigned char *p = (const unsigned char *)strip->data;
+	size_t pos = 2, len;
+
+	if (strip->size < 4 || p[0] != 0xff || p[1] != M_SOI ||
+		p[strip->size - 2] != 0xff || p[strip->size - 1] != JPEG_EOI)
+		return -1;
+	while (pos + 4 <= strip->size && p[pos] == 0xff)
+	{
+		len = (p[pos + 2] << 8) | p[pos + 3];
+		if (p[pos + 1] == M_SOF0)
+			strip->sof = pos;
+		else if (p[pos + 1] == M_SOS)
+		{
+			strip->sos = pos;
+			strip->entropy = pos + 2 + len;
+			strip->entropy_end = strip->size - 2;
+			return strip->sof && strip->entropy <= strip->entropy_end ? 0 : -1;
+		}
+		pos += 2 + len;
+	}
+	return -1;
+}
+
+static int JpegStripEncode( struct jpeg_strips *s, struct jpeg_strip *strip, unsigned int index )
+{
+	struct imgtool_conf *conf = s->conf;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_jmp_error jerr;
+	JSAMPARRAY buffer;
+	FILE *f;
+	unsigned int row;
+
+	if (!(f = open_memstream( &strip->data, &strip->size )))
+		return -1;
+	cinfo.err = jpeg_jmp_error( &jerr );
+	jpeg_create_compress( &cinfo );
+	if (setjmp( jerr.jmp ))
+	{
+		jpeg_destroy_compress( &cinfo );
+		fclose( f );
+		return -1;
+	}
+
+	// Same parameters as the serial encoder, for a strip of the frame
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults( &cinfo );
+	cinfo.input_components = 3;
+	cinfo.data_precision = 8;
+	cinfo.image_width = (JDIMENSION) conf->width;
+	cinfo.image_height = (JDIMENSION) strip->rows;
+	jpeg_default_colorspace( &cinfo );
+	jpeg_set_quality( &cinfo, conf->jpeg_quality, FALSE );
+	jpeg_stdio_dest( &cinfo, f );
+	jpeg_start_compress( &cinfo, TRUE );
+	buffer = (cinfo.mem->alloc_sarray)( (j_common_ptr) &cinfo, JPOOL_IMAGE, (JDIMENSION) (conf->width * 3), 1 );
+
+	TRACE_BEGIN("encode", "jpeg_strip", index);
+	for (row = 0; row < strip->rows; row++)
+	{
+		// Always mapped here, so rows come straight from the frame buffer
+		FBtoRGB888( conf, buffer[0], FBReadRow( s->fb, strip->y0 + row, NULL ), conf->width );
+		(void) jpeg_write_scanlines( &cinfo, buffer, 1 );
+	}
+	jpeg_finish_compress( &cinfo );
+	TRACE_END("encode", "jpeg_strip", index);
+	jpeg_destroy_compress( &cinfo );
+	if (fclose( f ))
+		return -1;
+	return JpegStripParse( strip );
+}
+
+static void *JpegStripWorker( void *arg )
+{
+	struct jpeg_strips *s = (struct jpeg_strips *)arg;
+	unsigned int n;
+
+	while ((n = __sync_fetch_and_add( &s->next, 1 )) < s->count)
+		s->strip[n].ret = JpegStripEncode( s, &s->strip[n], n );
+	return NULL;
+}
+
+// Encode conf->jobs strips in parallel and write the joined image to
+// output_file. Returns JPEG_STRIPS_NONE without writing anything when the
+// frame buffer is not mapped or too short to split.
+static int CaptureJpegStrips( struct imgtool_conf *conf, FILE *output_file )
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_jmp_error jerr;
+	struct jpeg_strips s;
+	struct fb_dev fb;
+	pthread_t *threads;
+	unsigned int mcu_w = 0, mcu_h = 0, mcus_per_row, mcu_rows, strip_mcu_rows, interval;
+	unsigned int n, started;
+	unsigned char *p, *exif = NULL;
+	unsigned char marker[6];
+	size_t exif_size = 0, head;
+	int c, ret = 0;
+	uint64_t t0;
+
+	// MCU size for the default sampling factors
+	cinfo.err = jpeg_jmp_error( &jerr );
+	if (setjmp( jerr.jmp ))
+	{
+		jpeg_destroy_compress( &cinfo );
+		return JPEG_STRIPS_NONE;
+	}
+	jpeg_create_compress( &cinfo );
+	cinfo.in_color_space = JCS_RGB;
+	cinfo.input_components = 3;
+	jpeg_set_defaults( &cinfo );
+	jpeg_default_colorspace( &cinfo );
+	for (c = 0; c < cinfo.num_components; c++)
+	{
+		if (cinfo.comp_info[c].h_samp_factor * DCTSIZE > (int)mcu_w)
+			mcu_w = cinfo.comp_info[c].h_samp_factor * DCTSIZE;
+		if (cinfo.comp_info[c].v_samp_factor * DCTSIZE > (int)mcu_h)
+			mcu_h = cinfo.comp_info[c].v_samp_factor * DCTSIZE;
+	}
+	jpeg_destroy_compress( &cinfo );
+
+	// Equal strips of whole MCU rows (the last may be short), with no more
+	// MCUs per strip than DRI can express
+	mcus_per_row = (conf->width + mcu_w - 1) / mcu_w;
+	mcu_rows = (conf->height + mcu_h - 1) / mcu_h;
+	if (!mcus_per_row || mcus_per_row > 65535)
+		return JPEG_STRIPS_NONE;
+	strip_mcu_rows = (mcu_rows + conf->jobs - 1) / conf->jobs;
+	if (strip_mcu_rows > 65535 / mcus_per_row)
+		strip_mcu_rows = 65535 / mcus_per_row;
+	interval = strip_mcu_rows * mcus_per_row;
+	s.count = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+	if (s.count < 2)
+		return JPEG_STRIPS_NONE;
+
+	if (FBOpen( &fb, conf, 0 ) == -1)
+	{
+		fprintf( stderr, "Error: could not open frame buffer for input!\n" );
+		return -1;
+	}
+	if (!fb.mem)
+	{
+		FBClose( &fb );
+		return JPEG_STRIPS_NONE;
+	}
+
+	ArenaReset( conf->arena );
+	s.conf = conf;
+	s.fb = &fb;
+	s.next = 0;
+	s.strip = (struct jpeg_strip *)ArenaAlloc( conf->arena, s.count * sizeof(*s.strip) );
+	threads = (pthread_t *)ArenaAlloc( conf->arena, conf->jobs * sizeof(*threads) );
+	if (!s.strip || !threads)
+	{
+		FBClose( &fb );
+		return -1;
+	}
+	memset( s.strip, 0, s.count * sizeof(*s.strip) );
+	for (n = 0; n < s.count; n++)
+	{
+		s.strip[n].y0 = n * strip_mcu_rows * mcu_h;
+		s.strip[n].rows = n + 1 < s.count ? strip_mcu_rows * mcu_h : conf->height - s.strip[n].y0;
+	}
+	PROGRESS( conf, "Encoding %u strips of %u rows on %d threads\n", s.count, strip_mcu_rows * mcu_h,
+		conf->jobs < (int)s.count ? conf->jobs : (int)s.count );
+
+	// This thread encodes strips too
+	t0 = STATS_BEGIN(conf);
+	for (started = 0; started + 1 < (unsigned int)conf->jobs && started + 1 < s.count; started++)
+		if (pthread_create( &threads[started], NULL, JpegStripWorker, &s ))
+			break;
+	JpegStripWorker( &s );
+	for (n = 0; n < started; n++)
+		pthread_join( threads[n], NULL );
+	STATS_END(conf, PHASE_ENCODE, t0);
+	STATS_ADD(conf, rows, conf->height);
+	STATS_ADD(conf, bytes_read, (uint64_t)conf->height * fb.row_bytes);
+	if (conf->thumbnail)
+		exif = JpegExifThumbnail( conf, &fb, &exif_size );
+	FBClose( &fb );
+
+	for (n = 0; n < s.count; n++)
+		if (s.strip[n].ret)
+		{
+			fprintf( stderr, "Error: failed encoding strip %u\n", n );
+			ret = -1;
+		}
+
+	if (ret == 0)
+	{
+		// Headers from the first strip, with the full height and a DRI
+		p = (unsigned char *)s.strip[0].data;
+		p[s.strip[0].sof + 5] = conf->height >> 8;
+		p[s.strip[0].sof + 6] = conf->height & 0xff;
+		marker[0] = 0xff;
+		if (exif)
+		{
+			// EXIF after JFIF, as libjpeg's jpeg_write_marker() puts it
+			head = 2;
+			if (p[3] == JPEG_APP0)
+				head += 2 + ((p[4] << 8) | p[5]);
+			fwrite( p, 1, head, output_file );
+			marker[1] = JPEG_APP0 + 1;
+			marker[2] = (exif_size + 2) >> 8;
+			marker[3] = (exif_size + 2) & 0xff;
+			fwrite( marker, 1, 4, output_file );
+			fwrite( exif, 1, exif_size, output_file );
+			fwrite( p + head, 1, s.strip[0].sos - head, output_file );
+		}
+		else
+			fwrite( p, 1, s.strip[0].sos, output_file );
+		marker[1] = M_DRI;
+		marker[2] = 0;
+		marker[3] = 4;
+		marker[4] = interval >> 8;
+		marker[5] = interval & 0xff;
+		fwrite( marker, 1, 6, output_file );
+		fwrite( p + s.strip[0].sos, 1, s.strip[0].entropy_end - s.strip[0].sos, output_file );
+		for (n = 1; n < s.count; n++)
+		{
+			marker[1] = JPEG_RST0 + ((n - 1) & 7);
+			fwrite( marker, 1, 2, output_file );
+			fwrite( s.strip[n].data + s.strip[n].entropy, 1,
+				s.strip[n].entropy_end - s.strip[n].entropy, output_file );
+		}
+		marker[1] = JPEG_EOI;
+		fwrite( marker, 1, 2, output_file );
+		if (ferror( output_file ))
+		{
+			fprintf( stderr, "Error: failed writing %s\n", conf->filename );
+			ret = -1;
+		}
+	}
+
+	for (n = 0; n < s.count; n++)
+		free( s.strip[n].data );
+	free( exif );
+	return ret;
+}
+
+// Capture frame buffer to jpeg
+int CaptureJpeg(struct imgtool_conf *conf)
+{
+	struct jpeg_compress_struct local_cinfo, *cinfo = conf->cinfo;
+	struct jpeg_jmp_error local_jerr, *jerr;
+	FILE * output_file;
+	JDIMENSION num_scanlines;
+	int usingStdout = (conf->output_stream || strcmp( conf->filename, "-" ) == 0);
+	struct fb_dev fb;
+	volatile int fb_open = 0;
+	struct bg_pace bg;
+	int ret = 0;
+	JSAMPARRAY buffer;
+	JDIMENSION buffer_height;
+	uint64_t t0;
+
+	if (BackgroundMove( conf ))
+		return BackgroundRun( conf, IMGTOOL_FMT_JPEG );
+
+	// Create output handle
+	if (conf->output_stream)
+	{
+		output_file = conf->output_stream;
+	}
+	else if (usingStdout)
+	{
+		output_file = stdout;
+	}
+	else
+	{
+		output_file = fopen( conf->filename, "wb" );
+	}
+	if (!output_file)
+	{
+		fprintf( stderr, "Error: cannot open %s for output\n", conf->filename );
+		return -1;
+	}
+
+	// Background captures stay on one thread
+	if (conf->jobs > 1 && !Background( conf ) &&
+		(ret = CaptureJpegStrips( conf, output_file )) != JPEG_STRIPS_NONE)
+	{
+		if (!usingStdout)
+		{
+			STATS_ADD(conf, bytes_written, ftell( output_file ));
+			fclose( output_file );
+		}
+		return ret;
+	}
+	ret = 0;
+
+	if (cinfo)
+		jerr = (struct jpeg_jmp_error *) cinfo->err;
+	else
+	{
+		/* Initialize a one-shot JPEG compression object */
+		cinfo = &local_cinfo;
+		jerr = &local_jerr;
+		cinfo->err = jpeg_jmp_error(jerr);
+		jpeg_create_compress(cinfo);
+	}
+
+	BackgroundBegin( conf, &bg );
+
+	/* libjpeg errors come back here */
+	if (setjmp(jerr->jmp))
+	{
+		BackgroundEnd( conf, &bg );
+		if (fb_open)
+			FBClose( &fb );
+		if (cinfo == &local_cinfo)
+			jpeg_destroy_compress(cinfo);
+		else
+			jpeg_abort_compress(cinfo);
+		if (!usingStdout)
+			fclose( output_file );
+		return -1;
+	}
+
+	/* Initialize JPEG parameters.
+	* Much of this may be overridden later.
+	* In particular, we don't yet know the input file's color space,
+	* but we need to provide some value for jpeg_set_defaults() to work.
+	*/
+
+	cinfo->in_color_space = JCS_RGB; /* arbitrary guess */
+	jpeg_set_defaults(cinfo);
+
+	/* Allocate one-row buffer for returned data */
+	buffer = (cinfo->mem->alloc_sarray)
+	((j_common_ptr) cinfo, JPOOL_IMAGE,
+	 (JDIMENSION) (conf->width * 3), (JDIMENSION) 1);
+	buffer_height = 1;
+
+	cinfo->in_color_space = JCS_RGB;
+	cinfo->input_components = 3;
+	cinfo->data_precision = 8; // bits per RGB component
+	cinfo->image_width = (JDIMENSION) conf->width;
+	cinfo->image_height = (JDIMENSION) conf->height;
+
+	/* Input colorspace has been set (always RGB) - fix colorspace-dependent defaults */
+	jpeg_default_colorspace(cinfo);
+
+    /* Set quantization tables for selected quality. */
+    /* Some or all may be overridden if -qtables is present. */
+    jpeg_set_quality(cinfo, conf->jpeg_quality, FALSE	/* by default, allow 16-bit quantizers */);
+
+	/* Specify data destination for compression */
+	jpeg_stdio_dest(cinfo, output_file);
+
+	/* Start compressor */
+	jpeg_start_compress(cinfo, TRUE);
+
+	// Open frame buffer for input
+	if (FBOpen( &fb, conf, 0 ) == -1) {
+		fprintf( stderr, "Error: could not open frame buffer for input!\n" );
+		ret = -1;
+		goto out;
+	}
+	fb_open = 1;
+	const unsigned char *fbData;
+
+	if (conf->thumbnail)
+	{
+		size_t exifSize;
+		unsigned char *exif = JpegExifThumbnail( conf, &fb, &exifSize );
+		if (exif)
+		{
+			jpeg_write_marker(cinfo, JPEG_APP0 + 1, exif, exifSize);
+			free( exif );
+		}
+	}
+
+	ArenaReset( conf->arena );
+	unsigned char *fbRow = (unsigned char *)ArenaAlloc(conf->arena, fb.row_bytes);
+	if (!fbRow)
+		ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+	int errCount = 0;
+	int rowCount = 0;
+
+	/* Process data */
+	while (cinfo->next_scanline < cinfo->image_height && errCount == 0) {
+		num_scanlines = buffer_height;
+		// Get a row from frame buffer in native format
+		TRACE_BATCH(cinfo->next_scanline);
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("fb", "read", cinfo->next_scanline);
+		if (!(fbData = FBReadRow( &fb, cinfo->next_scanline, fbRow )))
+		{
+			TRACE_END("fb", "read", cinfo->next_scanline);
+			fprintf( stderr, "Error: failed reading row %d from frame buffer\n", cinfo->next_scanline );
+			errCount++;
+			continue;
+		}
+		TRACE_END("fb", "read", cinfo->next_scanline);
+		STATS_END(conf, PHASE_FB_READ, t0);
+		STATS_ADD(conf, bytes_read, BytesPerFBPixel(conf->fmt) * conf->width);
+		BackgroundPace( &bg, fb.row_bytes, 0 );
+		// Convert to RGB888
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("convert", "FBtoRGB888", cinfo->next_scanline);
+		FBtoRGB888( conf, buffer[0], fbData, cinfo->image_width );
+		TRACE_END("convert", "FBtoRGB888", cinfo->next_scanline);
+		STATS_END(conf, PHASE_CONVERT, t0);
+		if (conf->debug_level && rowCount < 10)
+		{
+			HexDump( rowCount, "r8g8b8", buffer[0], cinfo->image_width*3 );
+			HexDump( rowCount, "fb", (unsigned char *)fbData, cinfo->image_width*BytesPerFBPixel(conf->fmt) );
+		}
+		rowCount++;
+		STATS_ADD(conf, rows, 1);
+		// Compress
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("encode", "jpeg_write_scanlines", cinfo->next_scanline);
+		(void) jpeg_write_scanlines(cinfo, buffer, num_scanlines);
+		TRACE_END("encode", "jpeg_write_scanlines", cinfo->next_scanline - 1);
+		STATS_END(conf, PHASE_ENCODE, t0);
+	}
+	TRACE_BATCH_DONE(cinfo->next_scanline);
+
+	PROGRESS( conf, "Closing frame buffer\n" );
+	FBClose( &fb );
+	fb_open = 0;
+	if (errCount)
+		ret = -1;
+
+	// FIXME add JFIF comments on source, date/time, hostname, guid, etc
+
+out:
+
+	/* Finish compression and release memory */
+	//(*src_mgr->finish_input) (cinfo, src_mgr);
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("encode", "jpeg_finish_compress", 0);
+	jpeg_finish_compress(cinfo);
+	TRACE_END("encode", "jpeg_finish_compress", 0);
+	STATS_END(conf, PHASE_ENCODE, t0);
+	BackgroundEnd( conf, &bg );
+	if (cinfo == &local_cinfo)
+		jpeg_destroy_compress(cinfo);
+
+	if (!usingStdout)
+	{
+		STATS_ADD(conf, bytes_written, ftell( output_file ));
+		fclose( output_file );
+	}
+	return ret;
+}
+
+#ifndef NO_PNG
+
+// Close a capture output unless it belongs to the caller
+static void CloseCapture(struct imgtool_conf *conf, FILE *fp)
+{
+	if (fp == conf->output_stream)
+		fflush(fp);
+	else if (fp != stdout)
+		fclose(fp);
+}
+
+// Open the destination of a capture: the caller's stream, stdout for "-",
+// or conf->filename
+static FILE *OpenCapture(struct imgtool_conf *conf)
+{
+	if (conf->output_stream)
+		return conf->output_stream;
+	if (!strcmp( conf->filename, "-" ))
+		return stdout;
+	return fopen( conf->filename, "wb" );
+}
+
+// Parallel png capture (--jobs=n), done the way pigz does it. The frame is
+// cut into horizontal chunks of rows. Each chunk is converted and filtered on
+// a worker thread, then deflated as raw deflate data primed with the last 32K
+// of the chunk before it. Every chunk but the last ends with a sync flush, so
+// the outputs are byte aligned and simply concatenated behind one zlib
+// header; the adler32 trailer is combined from the per-chunk checksums. The
+// stream goes out as IDATs of an ordinary PNG written here, since libpng
+// cannot be handed pre-compressed image data.
+#define PNG_CHUNKS_NONE		1		// Chunks not possible; use libpng
+#define PNG_CHUNK_MIN		(256*1024)	// Least filtered bytes per chunk
+#define PNG_WINDOW		32768
+
+struct png_chunks;
+
+struct png_chunk {
+	unsigned int y0, rows;
+	unsigned char *filtered;	// This chunk's part of the filtered image
+	size_t len;
+	unsigned char *prev, *cur;	// Unfiltered RGB rows
+	unsigned char *out;		// Deflated data
+	size_t out_size, out_len;
+	uLong adler;
+	int ret;
+};
+
+struct png_chunks {
+	struct imgtool_conf *conf;
+	struct fb_dev *fb;
+	struct png_chunk *chunk;
+	unsigned int count;
+	unsigned int next;		// Next chunk for the current phase
+	int deflating;			// Phase: filter, then deflate
+};
+
+static inline unsigned int PngPaeth( int a, int b, int c )
+{
+	int pa = abs( b - c ), pb = abs( a - c ), pc = abs( a + b - 2 * c );
+
+	// Written to compile to conditional moves
+	int ab = pb < pa ? b : a;
+	int pab = pb < pa ? pb : pa;
+	return pc < pab ? c : ab;
+}
+
+// Cost of a filtered byte for the filter heuristic: its magnitude as signed
+#define PNG_COST(v)	((unsigned int)abs( (signed char)(v) ))
+
+// Filter one RGB row into out (filter byte first), choosing the filter with
+// the smallest sum of absolute differences, as libpng's heuristic does.
+// Left and upper left are zero for the first pixel, which is done apart so
+// the inner loops need no bounds tests.
+static void PngFilterRow( unsigned char *out, const unsigned char *row, const unsigned char *prev, unsigned int len )
+{
+	unsigned int sum[5] = { 0, 0, 0, 0, 0 };
+	unsigned int i, a, b, c, x;
+	int f, best = 0;
+
+	for (i = 0; i < 3 && i < len; i++)
+	{
+		x = row[i];
+		b = prev[i];
+		sum[0] += PNG_COST(x);
+		sum[1] += PNG_COST(x);
+		sum[2] += PNG_COST(x - b);
+		sum[3] += PNG_COST(x - (b >> 1));
+		sum[4] += PNG_COST(x - b);
+	}
+	for (; i < len; i++)
+	{
+		x = row[i];
+		a = row[i - 3];
+		b = prev[i];
+		c = prev[i - 3];
+		sum[0] += PNG_COST(x);
+		sum[1] += PNG_COST(x - a);
+		sum[2] += PNG_COST(x - b);
+		sum[3] += PNG_COST(x - ((a + b) >> 1));
+		sum[4] += PNG_COST(x - PngPaeth( a, b, c ));
+	}
+	for (f = 1; f < 5; f++)
+		if (sum[f] < sum[best])
+			best = f;
+
+	out[0] = best;
+	out++;
+	switch (best)
+	{
+		case 0:
+			memcpy( out, row, len );
+			break;
+		case 1:
+			for (i = 0; i < 3 && i < len; i++)
+				out[i] = row[i];
+			for (; i < len; i++)
+				out[i] = row[i] - row[i - 3];
+			break;
+		case 2:
+			for (i = 0; i < len; i++)
+				out[i] = row[i] - prev[i];
+			break;
+		case 3:
+			for (i = 0; i < 3 && i < len; i++)
+				out[i] = row[i] - (prev[i] >> 1);
+			for (; i < len; i++)
+				out[i] = row[i] - ((row[i - 3] + prev[i]) >> 1);
+			break;
+		case 4:
+			for (i = 0; i < 3 && i < len; i++)
+				out[i] = row[i] - prev[i];
+			for (; i < len; i++)
+				out[i] = row[i] - PngPaeth( row[i - 3], prev[i], prev[i - 3] );
+			break;
+	}
+}
+
+static void PngChunkFilter( struct png_chunks *s, struct png_chunk *ch )
+{
+	struct imgtool_conf *conf = s->conf;
+	unsigned int row_len = 3 * conf->width;
+	unsigned char *tmp;
+	unsigned int y;
+
+	// Filters look at the unfiltered row above, zeros above the first
+	TRACE_BEGIN("encode", "png_filter", ch->y0);
+	if (ch->y0)
+		FBtoRGB888( conf, ch->prev, FBReadRow( s->fb, ch->y0 - 1, NULL ), conf->width );
+	else
+		memset( ch->prev, 0, row_len );
+	for (y = 0; y < ch->rows; y++)
+	{
+		FBtoRGB888( conf, ch->cur, FBReadRow( s->fb, ch->y0 + y, NULL ), conf->width );
+		PngFilterRow( ch->filtered + (size_t)y * (row_len + 1), ch->cur, ch->prev, row_len );
+		tmp = ch->prev;
+		ch->prev = ch->cur;
+		ch->cur = tmp;
+	}
+	ch->adler = adler32( adler32( 0L, Z_NULL, 0 ), ch->filtered, ch->len );
+	TRACE_END("encode", "png_filter", ch->y0);
+}
+
+static void PngChunkDeflate( struct png_chunks *s, struct png_chunk *ch )
+{
+	int last = (ch == &s->chunk[s->count - 1]);
+	size_t dict;
+	z_stream z;
+	int err;
+
+	TRACE_BEGIN("encode", "png_deflate", ch->y0);
+	ch->ret = -1;
+	memset( &z, 0, sizeof(z) );
+	if (deflateInit2( &z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED ) != Z_OK)
+		return;
+	if (ch != s->chunk)
+	{
+		dict = ch->filtered - s->chunk[0].filtered;
+		if (dict > PNG_WINDOW)
+			dict = PNG_WINDOW;
+		deflateSetDictionary( &z, ch->filtered - dict, dict );
+	}
+	z.next_in = ch->filtered;
+	z.avail_in = ch->len;
+	z.next_out = ch->out;
+	z.avail_out = ch->out_size;
+	err = deflate( &z, last ? Z_FINISH : Z_SYNC_FLUSH );
+	// Output is sized from deflateBound(), so one call always completes
+	if ((last ? err == Z_STREAM_END : err == Z_OK && z.avail_out) && !z.avail_in)
+	{
+		ch->out_len = ch->out_size - z.avail_out;
+		ch->ret = 0;
+	}
+	deflateEnd( &z );
+	TRACE_END("encode", "png_deflate", ch->y0);
+}
+
+static void *PngChunkWorker( void *arg )
+{
+	struct png_chunks *s = (struct png_chunks *)arg;
+	unsigned int n;
+
+	while ((n = __sync_fetch_and_add( &s->next, 1 )) < s->count)
+	{
+		if (s->deflating)
+			PngChunkDeflate( s, &s->chunk[n] );
+		else
+			PngChunkFilter( s, &s->chunk[n] );
+	}
+	return NULL;
+}
+
+// Run one phase over every chunk on up to conf->jobs threads, this one included
+static void PngChunkPhase( struct png_chunks *s, pthread_t *threads, int deflating )
+{
+	unsigned int n, started;
+
+	s->deflating = deflating;
+	s->next = 0;
+	for (started = 0; started + 1 < (unsigned int)s->conf->jobs && started + 1 < s->count; started++)
+		if (pthread_create( &threads[started], NULL, PngChunkWorker, s ))
+			break;
+	PngChunkWorker( s );
+	for (n = 0; n < started; n++)
+		pthread_join( threads[n], NULL );
+}
+
+static void PngPut32( unsigned char *p, uint32_t v )
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Write a PNG chunk from up to three pieces of data
+static void PngWriteChunk( FILE *fp, const char *type, const unsigned char *d1, size_t l1,
+	const unsigned char *d2, size_t l2, const unsigned char *d3, size_t l3 )
+{
+	unsigned char head[8];
+	unsigned char tail[4];
+	uLong crc;
+
+	PngPut32( head, l1 + l2 + l3 );
+	memcpy( head + 4, type, 4 );
+	crc = crc32( crc32( 0L, Z_NULL, 0 ), head + 4, 4 );
+	fwrite( head, 1, 8, fp );
+	// Empty pieces are NULL: crc32() would restart the checksum and fwrite()
+	// must not be handed a null pointer
+	if (l1)
+	{
+		crc = crc32( crc, d1, l1 );
+		fwrite( d1, 1, l1, fp );
+	}
+	if (l2)
+	{
+		crc = crc32( crc, d2, l2 );
+		fwrite( d2, 1, l2, fp );
+	}
+	if (l3)
+	{
+		crc = crc32( crc, d3, l3 );
+		fwrite( d3, 1, l3, fp );
+	}
+	PngPut32( tail, crc );
+	fwrite( tail, 1, 4, fp );
+}
+
+// Capture fb (mapped) as png on conf->jobs threads. Returns PNG_CHUNKS_NONE
+// without writing anything when the frame is too small to be worth splitting.
+static int CapturePngChunks( struct imgtool_conf *conf, struct fb_dev *fb )
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	// zlib header: deflate with a 32K window at the default level
+	static const unsigned char zlib_header[2] = { 0x78, 0x9c };
+	unsigned int row_len = 3 * conf->width;
+	size_t total = (size_t)conf->height * (row_len + 1);
+	struct png_chunks s;
+	pthread_t *threads;
+	unsigned char *filtered;
+	unsigned char ihdr[13], trailer[4];
+	unsigned int n;
+	size_t bound;
+	uLong adler;
+	FILE *fp;
+	int ret = 0;
+	uint64_t t0;
+
+	s.count = conf->jobs;
+	if (total / s.count < PNG_CHUNK_MIN)
+		s.count = total / PNG_CHUNK_MIN;
+	if (s.count > conf->height)
+		s.count = conf->height;
+	if (s.count < 2)
+		return PNG_CHUNKS_NONE;
+
+	// Filtered image, then per chunk its deflate output and two RGB rows
+	bound = deflateBound( NULL, total / s.count + row_len + 1 ) + 64;
+	ArenaReset( conf->arena );
+	if (ArenaReserve( conf->arena, ARENA_ROUND(total) + ARENA_ROUND(s.count * sizeof(*s.chunk))
+		+ ARENA_ROUND(conf->jobs * sizeof(*threads))
+		+ s.count * (ARENA_ROUND(bound) + 2 * ARENA_ROUND(row_len)) ))
+	{
+		fprintf( stderr, "Error: cannot allocate memory for %ux%u capture\n", conf->width, conf->height );
+		return -1;
+	}
+	filtered = (unsigned char *)ArenaAlloc( conf->arena, total );
+	s.chunk = (struct png_chunk *)ArenaAlloc( conf->arena, s.count * sizeof(*s.chunk) );
+	threads = (pthread_t *)ArenaAlloc( conf->arena, conf->jobs * sizeof(*threads) );
+	s.conf = conf;
+	s.fb = fb;
+	for (n = 0; n < s.count; n++)
+	{
+		struct png_chunk *ch = &s.chunk[n];
+		memset( ch, 0, sizeof(*ch) );
+		ch->y0 = (uint64_t)n * conf->height / s.count;
+		ch->rows = (uint64_t)(n + 1) * conf->height / s.count - ch->y0;
+		ch->filtered = filtered + (size_t)ch->y0 * (row_len + 1);
+		ch->len = (size_t)ch->rows * (row_len + 1);
+		ch->out_size = deflateBound( NULL, ch->len ) + 64;
+		ch->out = (unsigned char *)ArenaAlloc( conf->arena, ch->out_size );
+		ch->prev = (unsigned char *)ArenaAlloc( conf->arena, row_len );
+		ch->cur = (unsigned char *)ArenaAlloc( conf->arena, row_len );
+		if (!ch->out || !ch->prev || !ch->cur)
+		{
+			fprintf( stderr, "Error: cannot allocate memory for %ux%u capture\n", conf->width, conf->height );
+			return -1;
+		}
+	}
+
+	if (!(fp = OpenCapture( conf )))
+	{
+		fprintf( stderr, "Error: cannot open %s for output\n", conf->filename );
+		return -1;
+	}
+	PROGRESS( conf, "Encoding %u chunks on %d threads\n", s.count,
+		conf->jobs < (int)s.count ? conf->jobs : (int)s.count );
+
+	// Every chunk must be filtered before any is deflated, since each
+	// chunk's dictionary is the filtered tail of the one before
+	t0 = STATS_BEGIN(conf);
+	PngChunkPhase( &s, threads, 0 );
+	STATS_END(conf, PHASE_CONVERT, t0);
+	STATS_ADD(conf, bytes_read, (uint64_t)conf->height * fb->row_bytes);
+	STATS_ADD(conf, rows, conf->height);
+	t0 = STATS_BEGIN(conf);
+	PngChunkPhase( &s, threads, 1 );
+
+	adler = s.chunk[0].adler;
+	for (n = 0; n < s.count; n++)
+	{
+		if (s.chunk[n].ret)
+		{
+			fprintf( stderr, "Error: failed compressing rows %u-%u\n", s.chunk[n].y0, s.chunk[n].y0 + s.chunk[n].rows - 1 );
+			ret = -1;
+		}
+		if (n)
+			adler = adler32_combine( adler, s.chunk[n].adler, s.chunk[n].len );
+	}
+
+	if (ret == 0)
+	{
+		fwrite( signature, 1, sizeof(signature), fp );
+		PngPut32( ihdr, conf->width );
+		PngPut32( ihdr + 4, conf->height );
+		ihdr[8] = 8;			// Bit depth
+		ihdr[9] = PNG_COLOR_TYPE_RGB;
+		ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+		ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+		ihdr[12] = PNG_INTERLACE_NONE;
+		PngWriteChunk( fp, "IHDR", ihdr, sizeof(ihdr), NULL, 0, NULL, 0 );
+
+		// One IDAT per chunk, led by the zlib header and closed by adler32
+		PngPut32( trailer, adler );
+		for (n = 0; n < s.count; n++)
+			PngWriteChunk( fp, "IDAT", zlib_header, n ? 0 : sizeof(zlib_header),
+				s.chunk[n].out, s.chunk[n].out_len,
+				trailer, n + 1 < s.count ? 0 : sizeof(trailer) );
+		PngWriteChunk( fp, "IEND", NULL, 0, NULL, 0, NULL, 0 );
+		fflush( fp );
+		if (ferror( fp ))
+		{
+			fprintf( stderr, "Error: failed writing %s\n", conf->filename );
+			ret = -1;
+		}
+	}
+	STATS_END(conf, PHASE_ENCODE, t0);
+	STATS_ADD(conf, bytes_written, ftell( fp ));
+	CloseCapture( conf, fp );
+	return ret;
+}
+
+// Capture frame buffer to png (lossless RGB)
+// Row callback from png_write_png() so background captures yield while
+// deflating too; the bg_pace rides along as the (otherwise unused) error_ptr
+static void PngPaceRow(png_structp png_ptr, png_uint_32 row, int pass)
+{
+	struct bg_pace *bg = (struct bg_pace *)png_get_error_ptr(png_ptr);
+
+	BackgroundPace( bg, 0, bg->encode_row );
+}
+
+int CapturePng(struct imgtool_conf *conf)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	FILE *fp;
+	struct fb_dev fb;
+	unsigned char *fbRow;
+	const unsigned char *fbData;
+	int x, y;
+	/* static */
+	png_byte **row_pointers;
+	png_uint_32 bytes_per_row;
+	struct bg_pace bg;
+	uint64_t t0;
+	int ret;
+
+	if (BackgroundMove( conf ))
+		return BackgroundRun( conf, IMGTOOL_FMT_PNG );
+	if (FBOpen( &fb, conf, 0 ) == -1)
+		return -1;
+
+	// Threads need rows from a mapping; background captures stay on one
+	if (conf->jobs > 1 && fb.mem && !Background( conf ) && (ret = CapturePngChunks( conf, &fb )) != PNG_CHUNKS_NONE)
+	{
+		FBClose(&fb);
+		return ret;
+	}
+
+	// One arena block for libpng and zlib, the RGB rows and the frame
+	// buffer row (only used when the frame buffer could not be mapped)
+	ArenaReset( conf->arena );
+	if (ArenaReserve( conf->arena, PNG_ARENA_DEFLATE + PNG_ARENA_ROWS(3 * conf->width)
+		+ (size_t)conf->height * (sizeof(png_byte *) + ARENA_ROUND(3 * conf->width))
+		+ ARENA_ROUND(fb.row_bytes) ))
+	{
+		fprintf( stderr, "Error: cannot allocate memory for %ux%u capture\n", conf->width, conf->height );
+		FBClose(&fb);
+		return -1;
+	}
+	fbRow = (unsigned char *)ArenaAlloc( conf->arena, fb.row_bytes );
+
+	fp = OpenCapture(conf);
+	if (fp == NULL || fbRow == NULL) {
+		fprintf( stderr, "Error: cannot open %s for output\n", conf->filename );
+		if (fp)
+			CloseCapture(conf, fp);
+		FBClose(&fb);
+		return -1;
+	}
+
+	png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, &bg, NULL, NULL,
+		conf->arena, PngArenaMalloc, PngArenaFree);
+	if (png_ptr == NULL) {
+		CloseCapture(conf, fp);
+		FBClose(&fb);
+		return -1;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		png_destroy_write_struct(&png_ptr, NULL);
+		CloseCapture(conf, fp);
+		FBClose(&fb);
+		return -1;
+	}
+
+	BackgroundBegin( conf, &bg );
+	if (bg.active)
+	{
+		bg.encode_row = 3 * conf->width;
+		png_set_write_status_fn(png_ptr, PngPaceRow);
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		BackgroundEnd( conf, &bg );
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		CloseCapture(conf, fp);
+		FBClose(&fb);
+		return -1;
+	}
+
+	png_set_IHDR(png_ptr,
+			info_ptr,
+			conf->width,
+			conf->height,
+			8,
+			PNG_COLOR_TYPE_RGB,
+			PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+
+
+	/* Initialize rows of PNG. */
+	bytes_per_row = conf->width * BytesPerFBPixel(conf->fmt);
+	row_pointers = png_malloc(png_ptr, conf->height * sizeof(png_byte *));
+	t0 = STATS_BEGIN(conf);
+	for (y = 0; y < conf->height; ++y) {
+		uint8_t *row = png_malloc(png_ptr, sizeof(uint8_t) * 3 * conf->width);
+		row_pointers[y] = (png_byte *)row;
+		//memcpy(row, screen, bytes_per_row);
+		TRACE_BATCH(y);
+		if (!(fbData = FBReadRow(&fb, y, fbRow))) {
+			fprintf( stderr, "Error: failed reading row %d from frame buffer\n", y );
+			memset(row, 0, 3 * conf->width);
+			continue;
+		}
+		TRACE_BEGIN("convert", "FBtoRGB888", y);
+		FBtoRGB888(conf, row, fbData, conf->width);
+		TRACE_END("convert", "FBtoRGB888", y);
+		BackgroundPace( &bg, fb.row_bytes, 0 );
+	}
+	TRACE_BATCH_DONE(y);
+	STATS_END(conf, PHASE_CONVERT, t0);
+	STATS_ADD(conf, bytes_read, (uint64_t)conf->height * bytes_per_row);
+	STATS_ADD(conf, rows, conf->height);
+
+	/* Actually write the image data. */
+	t0 = STATS_BEGIN(conf);
+	png_init_io(png_ptr, fp);
+	png_set_rows(png_ptr, info_ptr, row_pointers);
+	TRACE_BEGIN("encode", "png_write_png", 0);
+	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+	TRACE_END("encode", "png_write_png", 0);
+	BackgroundEnd( conf, &bg );
+	STATS_END(conf, PHASE_ENCODE, t0);
+	STATS_ADD(conf, bytes_written, ftell( fp ));
+
+	/* Cleanup. Rows stay in the arena until the next operation. */
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	CloseCapture(conf, fp);
+	FBClose(&fb);
+	return 0;
+}
+
+#endif
+
+// Raw capture (--fmt=raw, or --fmt=rawhdr with a struct imgtool_raw_header
+// in front): the pixels as they sit in the frame buffer, no codec at all.
+// The mapped pages go out without a user space copy. vmsplice() hands them
+// to a pipe by reference, and sendfile() feeds a socket or file from the
+// frame buffer's own pages. Rows keep the frame buffer stride unless
+// --packed is given, in which case each row goes out as its own segment.
+// Whatever the kernel refuses (device mappings cannot always be spliced)
+// falls back to write() from the mapping. A pipe holds references to the
+// live pages, so a reader that falls behind may see later drawing.
+enum raw_method {
+	RAW_VMSPLICE,
+	RAW_SENDFILE,
+	RAW_WRITE,
+	RAW_STDIO,		// Caller's FILE (library capture to memory)
+};
+static const char *raw_method_names[] = { "vmsplice", "sendfile", "write", "stdio" };
+
+#define RAW_PIPE_SIZE	(1024*1024)	// Pipe buffer asked for when splicing
+
+struct raw_out {
+	enum raw_method method;
+	int fd;
+	FILE *fp;
+};
+
+// Send up to len bytes at offset off in the frame buffer. Returns bytes sent,
+// or -1 with errno set.
+static ssize_t RawSend( struct raw_out *out, struct fb_dev *fb, off_t off, size_t len )
+{
+	struct iovec iov;
+
+	switch (out->method)
+	{
+		case RAW_VMSPLICE:
+			iov.iov_base = fb->mem + off;
+			iov.iov_len = len;
+			return vmsplice( out->fd, &iov, 1, 0 );
+		case RAW_SENDFILE:
+			return sendfile( out->fd, fb->fd, &off, len );
+		case RAW_STDIO:
+			return fwrite( fb->mem + off, 1, len, out->fp ) == len ? (ssize_t)len : -1;
+		case RAW_WRITE:
+		default:
+			return write( out->fd, fb->mem + off, len );
+	}
+}
+
+static int RawWriteAll( struct raw_out *out, const void *data, size_t len )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	ssize_t n;
+
+	if (out->fp)
+		return fwrite( data, 1, len, out->fp ) == len ? 0 : -1;
+	while (len)
+	{
+		n = write( out->fd, p, len );
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Capture the frame buffer as raw pixels, with a header if header is set
+int CaptureRaw(struct imgtool_conf *conf, int header)
+{
+	struct imgtool_raw_header hdr;
+	struct raw_out out;
+	struct fb_dev fb;
+	struct bg_pace bg;
+	struct stat st;
+	unsigned char *fbRow;
+	const unsigned char *fbData;
+	unsigned int row, segments;
+	size_t seg_len, len;
+	off_t off;
+	uint64_t sent = 0;
+	uint64_t t0;
+	ssize_t n;
+	int packed, ret = -1;
+
+	if (BackgroundMove( conf ))
+		return BackgroundRun( conf, header ? IMGTOOL_FMT_RAW_HEADER : IMGTOOL_FMT_RAW );
+	if (FBOpen( &fb, conf, 0 ) == -1)
+		return -1;
+	// Streamed rows come without padding
+	packed = conf->packed || !fb.mem;
+
+	memset( &out, 0, sizeof(out) );
+	if (conf->output_stream)
+	{
+		out.fp = conf->output_stream;
+		out.method = RAW_STDIO;
+	}
+	else
+	{
+		if (!strcmp( conf->filename, "-" ))
+		{
+			fflush( stdout );
+			out.fd = STDOUT_FILENO;
+		}
+		else
+			out.fd = open( conf->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if (out.fd < 0)
+		{
+			fprintf( stderr, "Error: cannot open %s for output\n", conf->filename );
+			FBClose( &fb );
+			return -1;
+		}
+		if (fb.snapshot)
+			out.method = RAW_WRITE;	// Not sendfile() from the live fd, nor vmsplice() of pages we free
+		else if (fstat( out.fd, &st ) == 0 && S_ISFIFO( st.st_mode ))
+		{
+			out.method = RAW_VMSPLICE;
+			fcntl( out.fd, F_SETPIPE_SZ, RAW_PIPE_SIZE );
+		}
+		else
+			out.method = RAW_SENDFILE;
+	}
+	BackgroundBegin( conf, &bg );
+
+	if (header)
+	{
+		memset( &hdr, 0, sizeof(hdr) );
+		memcpy( hdr.magic, IMGTOOL_RAW_MAGIC, sizeof(hdr.magic) );
+		hdr.header_size = htole32( sizeof(hdr) );
+		hdr.width = htole32( fb.width );
+		hdr.height = htole32( fb.height );
+		hdr.stride = htole32( packed ? fb.row_bytes : fb.stride );
+		hdr.format = htole32( fb.fmt );
+		if (RawWriteAll( &out, &hdr, sizeof(hdr) ))
+			goto write_error;
+		sent += sizeof(hdr);
+	}
+
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("fb", "raw_send", 0);
+	if (!fb.mem)
+	{
+		// Nothing to splice from: copy rows through a buffer
+		if (!out.fp)
+			out.method = RAW_WRITE;
+		ArenaReset( conf->arena );
+		if (!(fbRow = (unsigned char *)ArenaAlloc( conf->arena, fb.row_bytes )))
+			goto out;
+		for (row = 0; row < fb.height; row++)
+		{
+			if (!(fbData = FBReadRow( &fb, row, fbRow )))
+			{
+				fprintf( stderr, "Error: failed reading row %d from frame buffer\n", row );
+				goto out;
+			}
+			if (RawWriteAll( &out, fbData, fb.row_bytes ))
+				goto write_error;
+			sent += fb.row_bytes;
+			BackgroundPace( &bg, fb.row_bytes, 0 );
+		}
+	}
+	else
+	{
+		// The whole mapping in one segment, or one segment per row
+		segments = packed && fb.stride != fb.row_bytes ? fb.height : 1;
+		seg_len = segments > 1 ? fb.row_bytes : (packed ? (size_t)fb.row_bytes * fb.height : fb.size);
+		for (row = 0; row < segments; row++)
+		{
+			off = (off_t)row * fb.stride;
+			len = seg_len;
+			while (len)
+			{
+				// Background captures send a chunk at a time
+				n = RawSend( &out, &fb, off, bg.active && len > BG_CHUNK_BYTES ? BG_CHUNK_BYTES : len );
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+				{
+					if (out.method == RAW_WRITE || out.method == RAW_STDIO)
+						goto write_error;
+					if (conf->debug_level)
+						fprintf( stderr, "%s refused (errno=%d), using write()\n",
+							raw_method_names[out.method], errno );
+					out.method = RAW_WRITE;
+					continue;
+				}
+				off += n;
+				len -= n;
+				sent += n;
+				BackgroundPace( &bg, n, 0 );
+			}
+		}
+	}
+	TRACE_END("fb", "raw_send", 0);
+	STATS_END(conf, PHASE_FB_READ, t0);
+	STATS_ADD(conf, bytes_read, (uint64_t)fb.height * fb.row_bytes);
+	STATS_ADD(conf, bytes_written, sent);
+	STATS_ADD(conf, rows, fb.height);
+	PROGRESS( conf, "Sent %llu bytes (%s) with %s\n", (unsigned long long)sent,
+		packed ? "packed" : "with stride", raw_method_names[out.method] );
+	ret = 0;
+	goto out;
+
+write_error:
+	fprintf( stderr, "Error: failed writing %s, errno=%d (%s)\n", conf->filename, errno, strerror(errno) );
+out:
+	BackgroundEnd( conf, &bg );
+	if (out.fp)
+		fflush( out.fp );
+	else if (out.fd != STDOUT_FILENO)
+		close( out.fd );
+	FBClose( &fb );
+	return ret;
+}
+
+// Draw an opened input, choosing the decoder from the leading bytes rather
+// than the extension
+static int ShowInput(struct imgtool_conf *conf, struct img_input *in)
+{
+	int ret = -1;
+
+	if (conf->debug_level > 0)
+		fprintf( stderr, "%s: detected %s\n", in->name, input_format_names[in->format] );
+
+	switch (in->format)
+	{
+#ifndef NO_PNG
+		case INPUT_PNG:
+			ret = ShowPng(conf, in);
+			break;
+		case INPUT_JPEG:
+			ret = ShowJpeg(conf, in);
+			break;
+#else
+		case INPUT_PNG:
+		case INPUT_JPEG:
+			fprintf( stderr, "%s: %s not supported (NO_PNG build also does not support jpeg decode)\n",
+				in->name, input_format_names[in->format] );
+			break;
+#endif
+		case INPUT_BMP:
+			fprintf( stderr, "%s: bmp files not supported\n", in->name );
+			break;
+		case INPUT_GIF:
+		case INPUT_SEQ:
+			fprintf( stderr, "%s: %s files are shown with --mode=play\n", in->name, input_format_names[in->format] );
+			break;
+		case INPUT_PYR:
+			fprintf( stderr, "%s: pyramids are shown with --mode=view\n", in->name );
+			break;
+		default:
+			fprintf( stderr, "%s: unrecognized image format\n", in->name );
+			break;
+	}
+	return ret;
+}
+
+// Skipping redundant draws (--skipsame). The state file holds the key of
+// the last draw - the input file's identity and every setting that changes
+// the pixels - and, with --skipsame=verify, a hash of the frame buffer it
+// left. A draw with the same key is skipped; in verify mode only if the
+// frame buffer still hashes the same, which catches writers that do not
+// go through imgtool.
+#define DRAW_STATE_KEY_SIZE	512
+
+// Key for drawing conf->filename, -1 when the input has no identity (a pipe)
+static int DrawStateKey( struct imgtool_conf *conf, char *key, size_t len )
+{
+	struct stat st;
+
+	if (!strcmp( conf->filename, "-" ) || stat( conf->filename, &st ) || !S_ISREG( st.st_mode ))
+		return -1;
+	snprintf( key, len, "input %llx:%llx size %lld mtime %lld.%09ld ctime %lld.%09ld\n"
+		"geometry %ux%u stride %u %s resize 0x%x mirror %d gamma %.6g scans %d crop %d:%u,%u,%u,%u\n",
+		(unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (long long)st.st_size,
+		(long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+		conf->width, conf->height, conf->stride, bit_format_names[conf->fmt], conf->resize_options,
+		conf->mirror_h, conf->gamma, conf->jpeg_scans,
+		conf->crop, conf->crop_x, conf->crop_y, conf->crop_w, conf->crop_h );
+	return 0;
+}
+
+// 64 bit multiply-xor hash of the visible pixels, stride padding excluded
+static int DrawStateHash( struct imgtool_conf *conf, uint64_t *hash )
+{
+	struct fb_dev fb;
+	unsigned char *buf = NULL;
+	const unsigned char *row;
+	unsigned int y;
+	size_t x;
+	uint64_t h = 0xcbf29ce484222325ULL, w;
+	int ret = 0;
+
+	if (FBOpen( &fb, conf, 0 ) < 0)
+		return -1;
+	if (!fb.mem && !(buf = (unsigned char *)malloc( fb.row_bytes )))
+		ret = -1;
+	for (y = 0; ret == 0 && y < fb.height; y++)
+	{
+		if (!(row = FBReadRow( &fb, y, buf )))
+		{
+			ret = -1;
+			break;
+		}
+		for (x = 0; x + 8 <= fb.row_bytes; x += 8)
+		{
+			memcpy( &w, row + x, 8 );
+			h = (h ^ w) * 0x100000001b3ULL;
+			h ^= h >> 29;
+		}
+		for (; x < fb.row_bytes; x++)
+			h = (h ^ row[x]) * 0x100000001b3ULL;
+	}
+	STATS_ADD(conf, bytes_read, (uint64_t)y * fb.row_bytes);
+	free( buf );
+	FBClose( &fb );
+	*hash = h;
+	return ret;
+}
+
+// Whether the frame buffer described by fb_st already shows key
+static int DrawStateMatch( struct imgtool_conf *conf, const struct stat *fb_st, const char *key )
+{
+	char path[256], state[DRAW_STATE_KEY_SIZE + 64];
+	unsigned long long saved;
+	uint64_t hash;
+	size_t len = strlen( key );
+	ssize_t n;
+	int fd;
+
+	DrawStatePath( path, sizeof(path), fb_st );
+	if ((fd = open( path, O_RDONLY | O_CLOEXEC )) < 0)
+		return 0;
+	n = read( fd, state, sizeof(state) - 1 );
+	close( fd );
+	if (n < (ssize_t)len || memcmp( state, key, len ))
+		return 0;
+	if (conf->skip_same < 2)
+		return 1;
+	state[n] = '\0';
+	return sscanf( state + len, "hash %llx", &saved ) == 1 && DrawStateHash( conf, &hash ) == 0 && hash == saved;
+}
+
+static void DrawStateSave( struct imgtool_conf *conf, const char *key )
+{
+	char path[256], tmp[300];
+	struct stat st;
+	uint64_t hash;
+	FILE *f;
+	int ok;
+
+	if (stat( conf->output, &st ))
+		return;
+	DrawStatePath( path, sizeof(path), &st );
+	snprintf( tmp, sizeof(tmp), "%s.%d", path, (int)getpid() );
+	mkdir( IMGTOOL_STATE_DIR, 0755 );
+	if (!(f = fopen( tmp, "w" )))
+	{
+		fprintf( stderr, "Warning: cannot record what %s shows in %s, errno=%d (%s)\n", conf->output,
+			IMGTOOL_STATE_DIR, errno, strerror(errno) );
+		return;
+	}
+	fputs( key, f );
+	if (conf->skip_same > 1 && DrawStateHash( conf, &hash ) == 0)
+		fprintf( f, "hash %016llx\n", (unsigned long long)hash );
+	ok = !ferror( f );
+	if (fclose( f ) || !ok || rename( tmp, path ))
+		unlink( tmp );
+}
+
+// Draw conf->filename (or stdin for "-")
+int ShowImage(struct imgtool_conf *conf)
+{
+	struct img_input in;
+	struct stat fb_st;
+	char key[DRAW_STATE_KEY_SIZE];
+	int ret, track = 0;
+
+	// Only frame buffers and their stand-in files keep what was drawn;
+	// the state of one says nothing about any --also targets
+	if (conf->skip_same && !conf->ntargets && DrawStateKey( conf, key, sizeof(key) ) == 0 &&
+		stat( conf->output, &fb_st ) == 0 && (S_ISCHR( fb_st.st_mode ) || S_ISREG( fb_st.st_mode )))
+	{
+		track = 1;
+		if (DrawStateMatch( conf, &fb_st, key ))
+		{
+			PROGRESS( conf, "%s already shows %s, not drawn\n", conf->output, conf->filename );
+			return 0;
+		}
+	}
+	if (InputOpen( &in, conf->filename ))
+		return -1;
+	ret = ShowInput( conf, &in );
+	InputClose( &in );
+	if (track && ret == 0)
+		DrawStateSave( conf, key );
+	return ret;
+}
+
+// Animation playback (--mode=play): GIF, APNG, MJPEG (concatenated JPEG
+// frames) and baked frame sequences. For the first three a decoder thread
+// composites each frame onto an ARGB canvas, converts the rows it changed
+// to frame buffer format and queues a copy of the visible area, up to
+// ANIM_QUEUE frames ahead. The calling thread waits
+// for each frame's deadline on an absolute CLOCK_MONOTONIC timerfd, then
+// for vertical sync when the driver supports it, and writes only the
+// rectangle that changed. A frame that is already a whole interval late
+// while the next one is queued is dropped, and its rectangle is merged into
+// the next frame shown.
+#include <sys/timerfd.h>
+
+#define ANIM_DEFAULT_FPS	30
+#define ANIM_LATE_NS		2000000ULL	// Shown more than 2ms after its deadline
+
+static void AnimSleepUntil( int tfd, uint64_t due )
+{
+	struct itimerspec its;
+	uint64_t expirations;
+
+	memset( &its, 0, sizeof(its) );
+	its.it_value.tv_sec = due / 1000000000ULL;
+	its.it_value.tv_nsec = due % 1000000000ULL;
+	if (timerfd_settime( tfd, TFD_TIMER_ABSTIME, &its, NULL ) == 0)
+		while (read( tfd, &expirations, sizeof(expirations) ) < 0 && errno == EINTR)
+			;
+}
+
+// Write len bytes at off of the frame buffer
+static int AnimWrite( struct fb_dev *fb, const char *name, const unsigned char *src, size_t len, off_t off )
+{
+	if (fb->mem)
+		memcpy( fb->mem + off, src, len );
+	else if (pwrite( fb->fd, src, len, off ) != (ssize_t)len)
+	{
+		fprintf( stderr, "Error: cannot write %s, errno=%d (%s)%s\n", name, errno, strerror(errno),
+			errno == ESPIPE ? " - playback needs a seekable frame buffer" : "" );
+		return -1;
+	}
+	return 0;
+}
+
+// Frame sequences (--mode=bake) hold frames already in frame buffer format,
+// so playing one is nothing but copies: straight from the mapping of the
+// file into the frame buffer, at a fixed rate. The pages of the next
+// SEQ_AHEAD frames are requested while the current one is shown, so a copy
+// never stops to wait for the disk.
+#define SEQ_AHEAD	8
+
+struct seq {
+	const unsigned char *data;
+	size_t size;
+	const char *name;
+	unsigned int width, height, fmt, bpp;
+	unsigned int frames, frame_ns, loops;
+	const struct imgtool_seq_frame *index;	// In the mapping, little endian
+	size_t page;
+};
+
+static int SeqOpen( struct seq *s, struct img_input *in )
+{
+	const struct imgtool_seq_header *h = (const struct imgtool_seq_header *)in->map;
+	uint64_t index;
+
+	memset( s, 0, sizeof(*s) );
+	s->name = in->name;
+	if (!in->map)
+	{
+		fprintf( stderr, "Error: %s: sequences are played from a file, not a pipe\n", in->name );
+		return -1;
+	}
+	s->data = in->map;
+	s->size = in->map_size;
+	s->page = sysconf( _SC_PAGESIZE );
+	if (s->size < sizeof(*h) || le32toh( h->raw.header_size ) < sizeof(*h))
+		goto bad;
+	s->width = le32toh( h->raw.width );
+	s->height = le32toh( h->raw.height );
+	s->fmt = le32toh( h->raw.format );
+	s->frames = le32toh( h->frames );
+	s->frame_ns = le32toh( h->frame_ns );
+	s->loops = le32toh( h->loops );
+	index = le64toh( h->index );
+	if (s->fmt > BF_ARGB8888 || !s->frames || (index & 7) || index > s->size ||
+		(s->size - index) / sizeof(*s->index) < s->frames)
+		goto bad;
+	s->bpp = BytesPerFBPixel((enum bit_format)s->fmt);
+	s->index = (const struct imgtool_seq_frame *)(s->data + index);
+	if (!(le32toh( s->index[0].flags ) & IMGTOOL_SEQ_KEY))
+		goto bad;
+	return 0;
+bad:
+	fprintf( stderr, "Error: %s: not a valid frame sequence\n", in->name );
+	return -1;
+}
+
+// Ask for frame n's pages to be read in
+static void SeqAhead( struct seq *s, unsigned int n )
+{
+	uint64_t start = le64toh( s->index[n].offset );
+	uint64_t end = n + 1 < s->frames ? le64toh( s->index[n + 1].offset ) : (uint64_t)((const unsigned char *)s->index - s->data);
+
+	if (start >= end || end > s->size)
+		return;
+	start &= ~(uint64_t)(s->page - 1);
+	madvise( (void *)(s->data + start), end - start, MADV_WILLNEED );
+}
+
+// Copy frame n's rectangles to the screen, clipped to it
+static int SeqFrame( struct seq *s, struct fb_dev *fb, unsigned int n, struct imgtool_conf *conf )
+{
+	uint64_t off = le64toh( s->index[n].offset );
+	uint32_t count = le32toh( s->index[n].rects ), i;
+	struct imgtool_seq_rect r;
+	size_t len, clip;
+	unsigned int y;
+
+	for (i = 0; i < count; i++)
+	{
+		if (off > s->size || s->size - off < sizeof(r))
+			goto bad;
+		memcpy( &r, s->data + off, sizeof(r) );
+		off += sizeof(r);
+		r.x = le32toh( r.x );
+		r.y = le32toh( r.y );
+		r.w = le32toh( r.w );
+		r.h = le32toh( r.h );
+		if (r.w > s->width || r.h > s->height || r.x > s->width - r.w || r.y > s->height - r.h)
+			goto bad;
+		len = (size_t)r.w * s->bpp;
+		if ((s->size - off) / (len ? len : 1) < r.h)
+			goto bad;
+
+		clip = r.x >= fb->width ? 0 : (r.w < fb->width - r.x ? r.w : fb->width - r.x) * (size_t)s->bpp;
+		for (y = 0; clip && y < r.h && r.y + y < fb->height; y++)
+			if (AnimWrite( fb, conf->output, s->data + off + y * len, clip,
+				(off_t)(r.y + y) * fb->stride + (off_t)r.x * s->bpp ))
+				return -1;
+		STATS_ADD(conf, rows, y);
+		STATS_ADD(conf, bytes_written, (uint64_t)y * clip);
+		off += (uint64_t)r.h * len;
+	}
+	return 0;
+bad:
+	fprintf( stderr, "Error: %s: frame %u is corrupt\n", s->name, n );
+	return -1;
+}
+
+static int SeqPlay( struct imgtool_conf *conf, struct img_input *in )
+{
+	struct seq s;
+	struct fb_dev fb;
+	uint64_t start, due, delay, now, late, worst = 0, t0;
+	unsigned int n, first, shown = 0, nlate = 0;
+	int plays, play, vsync, tfd, ret = -1;
+	uint32_t crtc = 0;
+
+	if (SeqOpen( &s, in ))
+		return -1;
+	if (FBOpen( &fb, conf, 1 ) < 0)
+		return -1;
+	if (fb.fmt != (enum bit_format)s.fmt)
+	{
+		fprintf( stderr, "Error: %s holds %s frames, the frame buffer is %s\n", in->name,
+			bit_format_names[s.fmt], bit_format_names[fb.fmt] );
+		FBClose( &fb );
+		return -1;
+	}
+	tfd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC );
+	if (tfd < 0)
+	{
+		fprintf( stderr, "Error: timerfd_create failed, errno=%d (%s)\n", errno, strerror(errno) );
+		FBClose( &fb );
+		return -1;
+	}
+	vsync = ioctl( fb.fd, FBIO_WAITFORVSYNC, &crtc ) == 0;
+
+	plays = conf->loops > 0 ? conf->loops : conf->loops < 0 ? 0 : (int)s.loops;
+	delay = conf->fps > 0 ? 1000000000ULL / conf->fps : s.frame_ns ? s.frame_ns : 1000000000ULL / ANIM_DEFAULT_FPS;
+	first = conf->start_frame < s.frames ? conf->start_frame : s.frames - 1;
+	PROGRESS( conf, "Playing %s: %u %ux%u frames from %u at %.1f fps%s\n", in->name, s.frames,
+		s.width, s.height, first, 1e9 / delay, vsync ? ", synced to vblank" : "" );
+
+	// Looping comes back to the start: keep every page once it is read
+	madvise( (void *)s.data, s.size, plays == 1 ? MADV_SEQUENTIAL : MADV_NORMAL );
+	for (n = 0; n < SEQ_AHEAD && n < s.frames; n++)
+		SeqAhead( &s, (first + n) % s.frames );
+
+	// Random access: rebuild the screen from the key frame at or before
+	// the first frame shown
+	for (n = first; n > 0 && !(le32toh( s.index[n].flags ) & IMGTOOL_SEQ_KEY); n--)
+		;
+	t0 = STATS_BEGIN(conf);
+	for (ret = 0; n < first && ret == 0; n++)
+		ret = SeqFrame( &s, &fb, n, conf );
+	STATS_END(conf, PHASE_FB_WRITE, t0);
+
+	start = due = StatsNow();
+	for (play = 0; ret == 0 && (!plays || play < plays); play++, first = 0)
+	{
+		for (n = first; n < s.frames && ret == 0; n++)
+		{
+			SeqAhead( &s, (n + SEQ_AHEAD) % s.frames );
+			now = StatsNow();
+			if (now < due)
+				AnimSleepUntil( tfd, due );
+			// Catching up after a stall: do not also wait for vsync
+			if (vsync && now < due + delay)
+				ioctl( fb.fd, FBIO_WAITFORVSYNC, &crtc );
+			t0 = STATS_BEGIN(conf);
+			TRACE_BEGIN("fb", "present", n);
+			ret = SeqFrame( &s, &fb, n, conf );
+			TRACE_END("fb", "present", n);
+			STATS_END(conf, PHASE_FB_WRITE, t0);
+			late = StatsNow();
+			late = late > due ? late - due : 0;
+			if (late > ANIM_LATE_NS)
+				nlate++;
+			if (late > worst)
+				worst = late;
+			shown += !ret;
+			due += delay;
+		}
+	}
+	// The last frame is on screen for its delay too
+	now = StatsNow() - start + (shown ? delay : 0);
+	PROGRESS( conf, "Played %u frame%s in %.2f s (%.1f fps), %u late (worst %.1f ms)\n",
+		shown, shown == 1 ? "" : "s", now / 1e9, now ? shown * 1e9 / now : 0.0, nlate, worst / 1e6 );
+	close( tfd );
+	if (FBClose( &fb ) < 0)
+		ret = -1;
+	return ret;
+}
+#ifndef NO_PNG
+#define ANIM_QUEUE		4
+
+enum anim_dispose {
+	ANIM_DISPOSE_NONE,
+	ANIM_DISPOSE_BACKGROUND,	// Clear the frame's area to transparent
+	ANIM_DISPOSE_PREVIOUS,		// Restore the area as it was before the frame
+};
+
+struct anim_rect {
+	unsigned int x, y, w, h;
+};
+
+struct anim_slot {
+	unsigned char *pix;		// Visible area, native format, packed rows
+	struct anim_rect dirty;		// Changed since the previous frame
+	struct anim_rect stale;		// Changed since pix was last written
+	uint64_t delay_ns;
+	unsigned int index;
+};
+
+struct anim {
+	struct imgtool_conf *conf;
+	struct imgtool_conf local;	// Converter settings: no mirror or resize
+	enum input_format format;
+	const unsigned char *data;
+	size_t size;
+	size_t first, pos;		// First and next frame
+	unsigned int width, height;	// Canvas
+	unsigned int vw, vh;		// Canvas clipped to the screen
+	unsigned int bpp;
+	int loops;			// Plays the file asks for, 0 forever
+	unsigned int frame;		// Within the current play
+	int full;			// Next frame redraws the whole canvas
+
+	uint32_t *canvas;		// Composited frame, 0xAARRGGBB
+	uint32_t *saved;		// Area kept for ANIM_DISPOSE_PREVIOUS
+	uint32_t *pixels;		// Decoded frame before compositing
+	size_t pixels_size;
+	unsigned char *native;		// vw x vh in frame buffer format
+	unsigned char *row;		// Converter output, a full screen row
+	struct anim_rect undo;		// Area to dispose before the next frame
+	enum anim_dispose dispose;
+
+	// GIF
+	uint32_t palette[256];
+	unsigned int colors;
+
+	// APNG: default image not animated when no acTL chunk
+	int animated;
+	unsigned char *png;		// One frame rebuilt as a stand-alone PNG
+	size_t png_len, png_size;
+
+	// MJPEG
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_jmp_error jerr;
+	struct img_input in;
+	int dinfo_ok;
+	JSAMPROW jrow;
+	size_t jrow_size;
+
+	// Frame queue, ring of ANIM_QUEUE slots from head
+	pthread_mutex_t lock;
+	pthread_cond_t ready, space;
+	struct anim_slot slots[ANIM_QUEUE];
+	unsigned int head, count;
+	int done, stop, error;
+	unsigned int decoded;
+};
+
+static inline unsigned int AnimLE16( const unsigned char *p )
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t AnimBE32( const unsigned char *p )
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void AnimUnion( struct anim_rect *a, const struct anim_rect *b )
+{
+	unsigned int x1, y1;
+
+	if (!b->w || !b->h)
+		return;
+	if (!a->w || !a->h)
+	{
+		*a = *b;
+		return;
+	}
+	x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+	y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+	a->x = a->x < b->x ? a->x : b->x;
+	a->y = a->y < b->y ? a->y : b->y;
+	a->w = x1 - a->x;
+	a->h = y1 - a->y;
+}
+
+// Clip r to a w x h area; empty when it lies outside
+static void AnimClip( struct anim_rect *r, unsigned int w, unsigned int h )
+{
+	if (r->x >= w || r->y >= h)
+	{
+		r->w = r->h = 0;
+		return;
+	}
+	if (r->w > w - r->x)
+		r->w = w - r->x;
+	if (r->h > h - r->y)
+		r->h = h - r->y;
+}
+
+static uint32_t *AnimPixels( struct anim *a, size_t count )
+{
+	uint32_t *p;
+
+	if (count > a->pixels_size)
+	{
+		p = (uint32_t *)realloc( a->pixels, count * sizeof(uint32_t) );
+		if (!p)
+			return NULL;
+		a->pixels = p;
+		a->pixels_size = count;
+	}
+	return a->pixels;
+}
+
+// Keep r of the canvas (ANIM_DISPOSE_PREVIOUS)
+static void AnimSave( struct anim *a, const struct anim_rect *r )
+{
+	unsigned int y;
+
+	for (y = r->y; y < r->y + r->h; y++)
+		memcpy( a->saved + (size_t)y * a->width + r->x, a->canvas + (size_t)y * a->width + r->x,
+			r->w * sizeof(uint32_t) );
+}
+
+// Undo the previous frame as its disposal says, adding the area to dirty
+static void AnimDispose( struct anim *a, struct anim_rect *dirty )
+{
+	unsigned int y;
+
+	for (y = a->undo.y; a->dispose != ANIM_DISPOSE_NONE && y < a->undo.y + a->undo.h; y++)
+	{
+		uint32_t *p = a->canvas + (size_t)y * a->width + a->undo.x;
+
+		if (a->dispose == ANIM_DISPOSE_BACKGROUND)
+			memset( p, 0, a->undo.w * sizeof(uint32_t) );
+		else
+			memcpy( p, a->saved + (size_t)y * a->width + a->undo.x, a->undo.w * sizeof(uint32_t) );
+	}
+	if (a->dispose != ANIM_DISPOSE_NONE)
+		AnimUnion( dirty, &a->undo );
+	a->dispose = ANIM_DISPOSE_NONE;
+	a->undo.w = a->undo.h = 0;
+}
+
+/*******************************************************
+ GIF
+********************************************************/
+
+// Skip data sub-blocks up to and including the terminator
+static int GifSkip( struct anim *a )
+{
+	while (a->pos < a->size)
+	{
+		unsigned int n = a->data[a->pos++];
+
+		if (n == 0)
+			return 0;
+		a->pos += n;
+	}
+	return -1;
+}
+
+// LZW decode the sub-blocks at p into at most npix colour indexes.
+// Returns the number of pixels decoded; a short count leaves the rest of
+// the frame untouched, as browsers do with truncated files.
+static size_t GifLzw( const unsigned char *p, const unsigned char *end, int min_size, unsigned char *out, size_t npix )
+{
+	uint16_t prefix[4096];
+	unsigned char suffix[4096], stack[4097];
+	unsigned int clear = 1 << min_size, next = clear + 2, size = min_size + 1;
+	unsigned int code, in_code, first = 0, sp;
+	int old = -1;
+	unsigned int block = 0, nbits = 0;
+	uint32_t bits = 0;
+	size_t n = 0;
+
+	for (code = 0; code < clear; code++)
+	{
+		prefix[code] = 0;
+		suffix[code] = code;
+	}
+	while (n < npix)
+	{
+		// Next code, least significant bit first across sub-blocks
+		while (nbits < size)
+		{
+			if (block == 0)
+			{
+				if (p >= end || (block = *p++) == 0)
+					return n;
+			}
+			if (p >= end)
+				return n;
+			bits |= (uint32_t)*p++ << nbits;
+			nbits += 8;
+			block--;
+		}
+		code = bits & ((1 << size) - 1);
+		bits >>= size;
+		nbits -= size;
+
+		if (code == clear)
+		{
+			next = clear + 2;
+			size = min_size + 1;
+			old = -1;
+			continue;
+		}
+		if (code == clear + 1)
+			break;
+		if (old < 0)
+		{
+			if (code >= clear)
+				break;
+			out[n++] = first = code;
+			old = code;
+			continue;
+		}
+
+		in_code = code;
+		sp = 0;
+		if (code >= next)
+		{
+			if (code > next)
+				break;
+			stack[sp++] = first;
+			code = old;
+		}
+		while (code >= clear)
+		{
+			stack[sp++] = suffix[code];
+			code = prefix[code];
+		}
+		stack[sp++] = first = code;
+		while (sp && n < npix)
+			out[n++] = stack[--sp];
+
+		if (next < 4096)
+		{
+			prefix[next] = old;
+			suffix[next] = first;
+			if (++next == (1U << size) && size < 12)
+				size++;
+		}
+		old = in_code;
+	}
+	return n;
+}
+
+// Row of an interlaced image that decoded row i lands on
+static unsigned int GifInterlaceRow( unsigned int i, unsigned int h )
+{
+	unsigned int pass1 = (h + 7) / 8, pass2 = (h + 3) / 8, pass3 = (h + 1) / 4;
+
+	if (i < pass1)
+		return i * 8;
+	i -= pass1;
+	if (i < pass2)
+		return i * 8 + 4;
+	i -= pass2;
+	if (i < pass3)
+		return i * 4 + 2;
+	return (i - pass3) * 2 + 1;
+}
+
+static void GifPalette( uint32_t *pal, const unsigned char *p, unsigned int n )
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++, p += 3)
+		pal[i] = 0xff000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static int GifOpen( struct anim *a )
+{
+	const unsigned char *p;
+	unsigned int flags, n;
+
+	if (a->size < 13)
+		return -1;
+	a->width = AnimLE16( a->data + 6 );
+	a->height = AnimLE16( a->data + 8 );
+	flags = a->data[10];
+	a->pos = 13;
+	a->colors = 0;
+	if (flags & 0x80)
+	{
+		a->colors = 2 << (flags & 7);
+		if (a->pos + 3 * a->colors > a->size)
+			return -1;
+		GifPalette( a->palette, a->data + a->pos, a->colors );
+		a->pos += 3 * a->colors;
+	}
+	a->first = a->pos;
+	a->loops = 1;
+
+	// The loop count is needed before the first frame is decoded, so read
+	// it from the extensions ahead of the first image now
+	while (a->pos + 2 < a->size && a->data[a->pos] == 0x21)
+	{
+		p = a->data + a->pos + 2;
+		if (a->data[a->pos + 1] == 0xff && a->pos + 18 <= a->size && p[0] == 11 &&
+			!memcmp( p + 1, "NETSCAPE2.0", 11 ) && p[12] >= 3 && p[13] == 1)
+		{
+			// Repeats after the first play, 0 forever
+			n = AnimLE16( p + 14 );
+			a->loops = n ? n + 1 : 0;
+			break;
+		}
+		a->pos += 2;
+		if (GifSkip( a ))
+			break;
+	}
+	a->pos = a->first;
+	return 0;
+}
+
+static int GifNext( struct anim *a, struct anim_rect *dirty, uint64_t *delay_ns )
+{
+	unsigned int delay_cs = 0, disposal = 0, flags, colors, fw, fh, x, y, row;
+	int transparent = -1;
+	uint32_t local[256];
+	const uint32_t *pal;
+	const unsigned char *p;
+	unsigned char *index;
+	struct anim_rect r;
+	size_t n, count;
+
+	while (a->pos < a->size)
+	{
+		switch (a->data[a->pos++])
+		{
+			case 0x3b:	// Trailer
+				return 0;
+
+			case 0x21:	// Extension
+				if (a->pos >= a->size)
+					return -1;
+				p = a->data + a->pos + 1;
+				if (a->data[a->pos] == 0xf9 && a->pos + 6 <= a->size && p[0] >= 4)
+				{
+					// Graphic control: disposal, delay, transparent index
+					disposal = (p[1] >> 2) & 7;
+					delay_cs = AnimLE16( p + 2 );
+					if (p[1] & 1)
+						transparent = p[4];
+				}
+				a->pos++;
+				if (GifSkip( a ))
+					return -1;
+				break;
+
+			case 0x2c:	// Image
+				if (a->pos + 10 > a->size)
+					return -1;
+				p = a->data + a->pos;
+				r.x = AnimLE16( p );
+				r.y = AnimLE16( p + 2 );
+				r.w = AnimLE16( p + 4 );
+				r.h = AnimLE16( p + 6 );
+				fw = r.w;
+				fh = r.h;
+				flags = p[8];
+				a->pos += 9;
+				pal = a->palette;
+				colors = a->colors;
+				if (flags & 0x80)
+				{
+					colors = 2 << (flags & 7);
+					if (a->pos + 3 * colors > a->size)
+						return -1;
+					GifPalette( local, a->data + a->pos, colors );
+					a->pos += 3 * colors;
+					pal = local;
+				}
+				if (a->pos >= a->size || a->data[a->pos] < 2 || a->data[a->pos] > 11)
+					return -1;
+
+				count = (size_t)r.w * r.h;
+				index = (unsigned char *)AnimPixels( a, (count + 3) / 4 );
+				if (count && !index)
+					return -1;
+				count = GifLzw( a->data + a->pos + 1, a->data + a->size, a->data[a->pos], index, count );
+				a->pos++;
+				if (GifSkip( a ))
+					return -1;
+
+				AnimClip( &r, a->width, a->height );
+				if (disposal == 3)
+					AnimSave( a, &r );
+				for (n = 0; n < count; n++)
+				{
+					row = n / fw;
+					x = n % fw;
+					if (flags & 0x40)
+						row = GifInterlaceRow( row, fh );
+					if (x >= r.w || row >= r.h || index[n] == transparent)
+						continue;
+					y = r.y + row;
+					a->canvas[(size_t)y * a->width + r.x + x] = index[n] < colors ? pal[index[n]] : 0xff000000;
+				}
+
+				a->undo = r;
+				a->dispose = disposal == 2 ? ANIM_DISPOSE_BACKGROUND :
+					disposal == 3 ? ANIM_DISPOSE_PREVIOUS : ANIM_DISPOSE_NONE;
+				AnimUnion( dirty, &r );
+				// Browsers play the 0 and 1 delays old encoders write at 10 fps
+				*delay_ns = (delay_cs <= 1 ? 10 : delay_cs) * 10000000ULL;
+				return 1;
+
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*******************************************************
+ APNG
+********************************************************/
+
+// Stock libpng ignores the animation chunks, so each frame is rebuilt as a
+// PNG of its own: the IHDR with the frame's size, the chunks that come
+// before the image data (PLTE, tRNS, gAMA...), the frame's IDAT or fdAT
+// data as IDAT, and IEND.
+static unsigned char *ApngGrow( struct anim *a, size_t len )
+{
+	unsigned char *p;
+
+	if (a->png_len + len > a->png_size)
+	{
+		size_t size = (a->png_len + len) * 2;
+
+		if (!(p = (unsigned char *)realloc( a->png, size )))
+			return NULL;
+		a->png = p;
+		a->png_size = size;
+	}
+	p = a->png + a->png_len;
+	a->png_len += len;
+	return p;
+}
+
+static int ApngPut( struct anim *a, const char *type, const unsigned char *data, size_t len )
+{
+	unsigned char *p = ApngGrow( a, len + 12 );
+	uLong crc;
+
+	if (!p)
+		return -1;
+	p[0] = len >> 24;
+	p[1] = len >> 16;
+	p[2] = len >> 8;
+	p[3] = len;
+	memcpy( p + 4, type, 4 );
+	if (len)
+		memcpy( p + 8, data, len );
+	crc = crc32( 0, p + 4, 4 );
+	if (len)
+		crc = crc32( crc, data, len );
+	p[8 + len] = crc >> 24;
+	p[9 + len] = crc >> 16;
+	p[10 + len] = crc >> 8;
+	p[11 + len] = crc;
+	return 0;
+}
+
+// Chunk at pos: type and data, or -1 past the end
+static int ApngChunk( struct anim *a, size_t pos, const unsigned char **type, const unsigned char **data, size_t *len )
+{
+	if (pos + 12 > a->size)
+		return -1;
+	*len = AnimBE32( a->data + pos );
+	if (*len > a->size - pos - 12)
+		return -1;
+	*type = a->data + pos + 4;
+	*data = a->data + pos + 8;
+	return 0;
+}
+
+// Decode the PNG in buf to w x h 0xAARRGGBB pixels
+static int ApngDecode( struct anim *a, const unsigned char *buf, size_t len, uint32_t *out, unsigned int w, unsigned int h )
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_bytep *rows = NULL;
+	struct img_input in;
+	unsigned char *p;
+	size_t n;
+	unsigned int y;
+
+	png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	if (!png_ptr)
+		return -1;
+	info_ptr = png_create_info_struct( png_ptr );
+	rows = (png_bytep *)malloc( h * sizeof(png_bytep) );
+	if (!info_ptr || !rows || setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+		free( rows );
+		return -1;
+	}
+	InputOpenMem( &in, buf, len );
+	png_set_read_fn( png_ptr, &in, PngInputRead );
+	png_read_info( png_ptr, info_ptr );
+	if (png_get_image_width( png_ptr, info_ptr ) != w || png_get_image_height( png_ptr, info_ptr ) != h)
+		png_error( png_ptr, "frame size mismatch" );
+
+	// Everything to 8 bit RGBA
+	png_set_expand( png_ptr );
+	png_set_strip_16( png_ptr );
+	png_set_gray_to_rgb( png_ptr );
+	png_set_add_alpha( png_ptr, 0xff, PNG_FILLER_AFTER );
+	png_set_interlace_handling( png_ptr );
+	png_read_update_info( png_ptr, info_ptr );
+	for (y = 0; y < h; y++)
+		rows[y] = (png_bytep)(out + (size_t)y * w);
+	png_read_image( png_ptr, rows );
+	png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+	free( rows );
+
+	for (n = 0, p = (unsigned char *)out; n < (size_t)w * h; n++, p += 4)
+		out[n] = ((uint32_t)p[3] << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+	return 0;
+}
+
+static int ApngOpen( struct anim *a )
+{
+	const unsigned char *type, *data;
+	size_t pos, len;
+
+	if (ApngChunk( a, 8, &type, &data, &len ) || memcmp( type, "IHDR", 4 ) || len != 13)
+		return -1;
+	a->width = AnimBE32( data );
+	a->height = AnimBE32( data + 4 );
+	a->loops = 1;
+	for (pos = 8; !ApngChunk( a, pos, &type, &data, &len ); pos += len + 12)
+	{
+		if (!memcmp( type, "acTL", 4 ) && len >= 8)
+		{
+			a->animated = 1;
+			a->loops = AnimBE32( data + 4 );
+		}
+		if (!memcmp( type, "fcTL", 4 ) || !memcmp( type, "IDAT", 4 ))
+			break;
+	}
+	a->first = a->pos = pos;
+	return 0;
+}
+
+static int ApngNext( struct anim *a, struct anim_rect *dirty, uint64_t *delay_ns )
+{
+	const unsigned char *type, *data, *fctl = NULL;
+	unsigned int delay_num, delay_den, x, y, blend;
+	const uint32_t *src;
+	uint32_t *dst, s, d, sa, da, oa;
+	unsigned char *p;
+	struct anim_rect r;
+	size_t pos, len;
+	int ret;
+
+	if (!a->animated)
+	{
+		// Plain PNG: one frame
+		if (a->frame)
+			return 0;
+		if (!AnimPixels( a, (size_t)a->width * a->height ) ||
+			ApngDecode( a, a->data, a->size, a->pixels, a->width, a->height ))
+			return -1;
+		memcpy( a->canvas, a->pixels, (size_t)a->width * a->height * sizeof(uint32_t) );
+		r.x = r.y = 0;
+		r.w = a->width;
+		r.h = a->height;
+		AnimUnion( dirty, &r );
+		*delay_ns = 1000000000ULL / ANIM_DEFAULT_FPS;
+		return 1;
+	}
+
+	// Next frame control; an IDAT before the first one is the default
+	// image, which is not part of the animation
+	for (; !ApngChunk( a, a->pos, &type, &data, &len ); a->pos += len + 12)
+	{
+		if (!memcmp( type, "IEND", 4 ))
+			return 0;
+		if (!memcmp( type, "fcTL", 4 ) && len >= 26)
+		{
+			fctl = data;
+			a->pos += len + 12;
+			break;
+		}
+	}
+	if (!fctl)
+		return 0;
+	r.w = AnimBE32( fctl + 4 );
+	r.h = AnimBE32( fctl + 8 );
+	r.x = AnimBE32( fctl + 12 );
+	r.y = AnimBE32( fctl + 16 );
+	delay_num = (fctl[20] << 8) | fctl[21];
+	delay_den = (fctl[22] << 8) | fctl[23];
+	blend = fctl[25];
+	if (!r.w || !r.h || r.w > a->width || r.h > a->height ||
+		r.x > a->width - r.w || r.y > a->height - r.h)
+		return -1;
+
+	a->png_len = 0;
+	ret = -1;
+	if ((p = ApngGrow( a, 8 )))
+	{
+		memcpy( p, "\x89PNG\r\n\x1a\n", 8 );
+		ret = 0;
+	}
+	for (pos = 8; !ret && !ApngChunk( a, pos, &type, &data, &len ) && pos < a->first; pos += len + 12)
+	{
+		if (!memcmp( type, "IHDR", 4 ))
+		{
+			unsigned char ihdr[13];
+
+			memcpy( ihdr, data, 13 );
+			memcpy( ihdr, fctl + 4, 8 );
+			ret = ApngPut( a, "IHDR", ihdr, 13 );
+		}
+		else if (memcmp( type, "acTL", 4 ))
+			ret = ApngPut( a, (const char *)type, data, len );
+	}
+	for (; !ret && !ApngChunk( a, a->pos, &type, &data, &len ); a->pos += len + 12)
+	{
+		if (!memcmp( type, "IDAT", 4 ))
+			ret = ApngPut( a, "IDAT", data, len );
+		else if (!memcmp( type, "fdAT", 4 ) && len >= 4)
+			ret = ApngPut( a, "IDAT", data + 4, len - 4 );
+		else if (!memcmp( type, "fcTL", 4 ) || !memcmp( type, "IEND", 4 ))
+			break;
+	}
+	if (ret || ApngPut( a, "IEND", NULL, 0 ) || !AnimPixels( a, (size_t)r.w * r.h ) ||
+		ApngDecode( a, a->png, a->png_len, a->pixels, r.w, r.h ))
+		return -1;
+
+	a->dispose = fctl[24] == 1 ? ANIM_DISPOSE_BACKGROUND :
+		fctl[24] == 2 ? (a->frame ? ANIM_DISPOSE_PREVIOUS : ANIM_DISPOSE_BACKGROUND) : ANIM_DISPOSE_NONE;
+	if (a->dispose == ANIM_DISPOSE_PREVIOUS)
+		AnimSave( a, &r );
+	for (y = 0; y < r.h; y++)
+	{
+		src = a->pixels + (size_t)y * r.w;
+		dst = a->canvas + (size_t)(r.y + y) * a->width + r.x;
+		if (blend == 0)
+		{
+			memcpy( dst, src, r.w * sizeof(uint32_t) );
+			continue;
+		}
+		// Source over: non-premultiplied, so weight the destination by its alpha
+		for (x = 0; x < r.w; x++)
+		{
+			s = src[x];
+			sa = s >> 24;
+			if (sa == 0xff || (dst[x] >> 24) == 0)
+				dst[x] = sa ? s : dst[x];
+			else if (sa)
+			{
+				d = dst[x];
+				da = (d >> 24) * (255 - sa) / 255;
+				oa = sa + da;
+				dst[x] = (oa << 24) |
+					((((s >> 16) & 0xff) * sa + ((d >> 16) & 0xff) * da) / oa) << 16 |
+					((((s >> 8) & 0xff) * sa + ((d >> 8) & 0xff) * da) / oa) << 8 |
+					(((s & 0xff) * sa + (d & 0xff) * da) / oa);
+			}
+		}
+	}
+	a->undo = r;
+	AnimUnion( dirty, &r );
+	*delay_ns = (uint64_t)delay_num * 1000000000ULL / (delay_den ? delay_den : 100);
+	return 1;
+}
+
+/*******************************************************
+ MJPEG
+********************************************************/
+
+static int MjpegOpen( struct anim *a )
+{
+	a->dinfo.err = jpeg_jmp_error( &a->jerr );
+	jpeg_create_decompress( &a->dinfo );
+	a->dinfo_ok = 1;
+	if (setjmp(a->jerr.jmp))
+		return -1;
+	InputOpenMem( &a->in, a->data, a->size );
+	jpeg_input_src( &a->dinfo, &a->in );
+	jpeg_read_header( &a->dinfo, TRUE );
+	a->width = a->dinfo.image_width;
+	a->height = a->dinfo.image_height;
+	jpeg_abort_decompress( &a->dinfo );
+	a->first = a->pos = 0;
+	a->loops = 1;
+	return 0;
+}
+
+// Next frame starts at the next SOI; a frame that fails to decode is
+// skipped with a warning
+static int MjpegNext( struct anim *a, struct anim_rect *dirty, uint64_t *delay_ns )
+{
+	const unsigned char *p;
+	unsigned int x, y, w;
+	struct anim_rect r;
+
+	while (a->pos + 3 < a->size)
+	{
+		p = a->data + a->pos;
+		if (p[0] != 0xff || p[1] != 0xd8 || p[2] != 0xff)
+		{
+			p = (const unsigned char *)memmem( p, a->size - a->pos, "\xff\xd8\xff", 3 );
+			if (!p)
+				break;
+			a->pos = p - a->data;
+		}
+		if (setjmp(a->jerr.jmp))
+		{
+			jpeg_abort_decompress( &a->dinfo );
+			fprintf( stderr, "Warning: skipping bad frame at offset %zu\n", a->pos );
+			a->pos += 2;
+			continue;
+		}
+		InputOpenMem( &a->in, p, a->size - a->pos );
+		jpeg_input_src( &a->dinfo, &a->in );
+		jpeg_read_header( &a->dinfo, TRUE );
+		a->dinfo.out_color_space = JCS_RGB;
+		jpeg_start_decompress( &a->dinfo );
+		if (a->dinfo.output_width * 3 > a->jrow_size)
+		{
+			free( a->jrow );
+			a->jrow_size = a->dinfo.output_width * 3;
+			if (!(a->jrow = (JSAMPROW)malloc( a->jrow_size )))
+			{
+				a->jrow_size = 0;
+				return -1;
+			}
+		}
+		w = a->dinfo.output_width < a->width ? a->dinfo.output_width : a->width;
+		while (a->dinfo.output_scanline < a->dinfo.output_height)
+		{
+			y = a->dinfo.output_scanline;
+			jpeg_read_scanlines( &a->dinfo, &a->jrow, 1 );
+			if (y >= a->height)
+				continue;
+			for (x = 0, p = a->jrow; x < w; x++, p += 3)
+				a->canvas[(size_t)y * a->width + x] = 0xff000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+		}
+		jpeg_finish_decompress( &a->dinfo );
+		a->pos += a->in.bytes - a->dinfo.src->bytes_in_buffer;
+
+		r.x = r.y = 0;
+		r.w = a->width;
+		r.h = a->height;
+		AnimUnion( dirty, &r );
+		*delay_ns = 1000000000ULL / ANIM_DEFAULT_FPS;
+		return 1;
+	}
+	a->pos = a->size;
+	return 0;
+}
+
+/*******************************************************
+ Decode ahead and presentation
+********************************************************/
+
+static void AnimRewind( struct anim *a )
+{
+	a->pos = a->first;
+	a->frame = 0;
+	a->full = 1;
+	a->dispose = ANIM_DISPOSE_NONE;
+	a->undo.w = a->undo.h = 0;
+	memset( a->canvas, 0, (size_t)a->width * a->height * sizeof(uint32_t) );
+}
+
+// Composite the next frame: 1 with the changed area, 0 at the end of the
+// file, -1 on error
+static int AnimNext( struct anim *a, struct anim_rect *dirty, uint64_t *delay_ns )
+{
+	int ret;
+
+	dirty->x = dirty->y = dirty->w = dirty->h = 0;
+	if (a->full)
+	{
+		dirty->w = a->width;
+		dirty->h = a->height;
+		a->full = 0;
+	}
+	AnimDispose( a, dirty );
+	switch (a->format)
+	{
+		case INPUT_GIF:
+			ret = GifNext( a, dirty, delay_ns );
+			break;
+		case INPUT_PNG:
+			ret = ApngNext( a, dirty, delay_ns );
+			break;
+		default:
+			ret = MjpegNext( a, dirty, delay_ns );
+			break;
+	}
+	if (ret > 0)
+		a->frame++;
+	return ret;
+}
+
+// Bring the native copy of the visible area up to date for r
+static void AnimConvert( struct anim *a, const struct anim_rect *r )
+{
+	unsigned int y;
+
+	for (y = r->y; y < r->y + r->h; y++)
+	{
+		ARGB8888toFB( &a->local, a->row, (const unsigned char *)(a->canvas + (size_t)y * a->width + r->x), r->w );
+		memcpy( a->native + ((size_t)y * a->vw + r->x) * a->bpp, a->row, r->w * a->bpp );
+	}
+}
+
+static void *AnimDecoder( void *arg )
+{
+	struct anim *a = (struct anim *)arg;
+	struct imgtool_conf *conf = a->conf;
+	struct anim_slot *slot;
+	struct anim_rect dirty, r;
+	uint64_t delay_ns, t0;
+	int plays, played = 0, shown = 0, ret, n;
+	unsigned int y;
+
+	plays = conf->loops > 0 ? conf->loops : conf->loops < 0 ? 0 : a->loops;
+	AnimRewind( a );
+	for (;;)
+	{
+		t0 = STATS_BEGIN(conf);
+		TRACE_BEGIN("decode", "frame", a->decoded);
+		ret = AnimNext( a, &dirty, &delay_ns );
+		if (ret > 0)
+		{
+			AnimClip( &dirty, a->vw, a->vh );
+			AnimConvert( a, &dirty );
+		}
+		TRACE_END("decode", "frame", a->decoded);
+		STATS_END(conf, PHASE_DECODE, t0);
+		if (ret < 0)
+		{
+			fprintf( stderr, "Error: cannot decode frame %u of %s\n", a->frame + 1, conf->filename );
+			a->error = 1;
+			break;
+		}
+		if (ret == 0)
+		{
+			// End of one play; stop on a file with no frames at all
+			if (!shown || (plays && ++played >= plays))
+				break;
+			shown = 0;
+			AnimRewind( a );
+			continue;
+		}
+		shown++;
+		if (conf->fps > 0)
+			delay_ns = 1000000000ULL / conf->fps;
+
+		pthread_mutex_lock( &a->lock );
+		while (a->count == ANIM_QUEUE && !a->stop)
+			pthread_cond_wait( &a->space, &a->lock );
+		slot = &a->slots[(a->head + a->count) % ANIM_QUEUE];
+		pthread_mutex_unlock( &a->lock );
+		if (a->stop)
+			break;
+
+		// Every slot has missed this frame's changes; this one catches up
+		// on everything since it was last filled
+		for (n = 0; n < ANIM_QUEUE; n++)
+			AnimUnion( &a->slots[n].stale, &dirty );
+		r = slot->stale;
+		for (y = r.y; y < r.y + r.h; y++)
+			memcpy( slot->pix + ((size_t)y * a->vw + r.x) * a->bpp,
+				a->native + ((size_t)y * a->vw + r.x) * a->bpp, r.w * a->bpp );
+		slot->stale.w = slot->stale.h = 0;
+		slot->dirty = dirty;
+		slot->delay_ns = delay_ns;
+		slot->index = a->decoded++;
+
+		pthread_mutex_lock( &a->lock );
+		a->count++;
+		pthread_cond_signal( &a->ready );
+		pthread_mutex_unlock( &a->lock );
+	}
+	pthread_mutex_lock( &a->lock );
+	a->done = 1;
+	pthread_cond_signal( &a->ready );
+	pthread_mutex_unlock( &a->lock );
+	return NULL;
+}
+
+// Write r of a queued frame to the screen
+static int AnimBlit( struct anim *a, struct fb_dev *fb, const struct anim_slot *slot, const struct anim_rect *r )
+{
+	size_t len = (size_t)r->w * a->bpp;
+	unsigned int y;
+
+	for (y = r->y; y < r->y + r->h; y++)
+		if (AnimWrite( fb, a->conf->output, slot->pix + ((size_t)y * a->vw + r->x) * a->bpp, len,
+			(off_t)y * fb->stride + (off_t)r->x * a->bpp ))
+			return -1;
+	STATS_ADD(a->conf, rows, r->h);
+	STATS_ADD(a->conf, bytes_written, (uint64_t)r->h * len);
+	return 0;
+}
+
+// Whole input in memory: the mapping, or read in full from a stream
+static int AnimLoad( struct anim *a, struct img_input *in, unsigned char **buf )
+{
+	size_t size = 0, got;
+
+	*buf = NULL;
+	if (in->map)
+	{
+		a->data = in->map;
+		a->size = in->map_size;
+		madvise( (void *)in->map, in->map_size, MADV_NORMAL );	// Played more than once
+		return 0;
+	}
+	do
+	{
+		unsigned char *p = (unsigned char *)realloc( *buf, size + INPUT_BUFFER_SIZE );
+
+		if (!p)
+			return -1;
+		*buf = p;
+		got = InputRead( in, p + size, INPUT_BUFFER_SIZE );
+		size += got;
+	} while (got == INPUT_BUFFER_SIZE);
+	a->data = *buf;
+	a->size = size;
+	return 0;
+}
+
+static int AnimPlay( struct imgtool_conf *conf, struct img_input *in )
+{
+	struct anim a;
+	struct fb_dev fb;
+	struct anim_slot *slot;
+	struct anim_rect pending = { 0, 0, 0, 0 };
+	unsigned char *buf = NULL;
+	pthread_t thread;
+	uint64_t start, due = 0, now, late, worst = 0, t0, hold = 0;
+	unsigned int shown = 0, dropped = 0, nlate = 0;
+	int vsync = 0, tfd = -1, ret = -1, n, nomem = 0, drop;
+	uint32_t crtc = 0;
+
+	memset( &a, 0, sizeof(a) );
+	a.conf = conf;
+	a.local = *conf;
+	a.local.mirror_h = 0;
+	a.local.resize = 0;
+	pthread_mutex_init( &a.lock, NULL );
+	pthread_cond_init( &a.ready, NULL );
+	pthread_cond_init( &a.space, NULL );
+
+	a.format = in->format;
+	t0 = STATS_BEGIN(conf);
+	if (AnimLoad( &a, in, &buf ))
+	{
+		fprintf( stderr, "Error: cannot read %s into memory\n", in->name );
+		goto out;
+	}
+	STATS_ADD(conf, bytes_read, a.size);
+	switch (a.format)
+	{
+		case INPUT_GIF:
+			n = GifOpen( &a );
+			break;
+		case INPUT_PNG:
+			n = ApngOpen( &a );
+			break;
+		case INPUT_JPEG:
+			n = MjpegOpen( &a );
+			break;
+		default:
+			fprintf( stderr, "%s: %s cannot be played - use a gif, png or mjpeg file\n",
+				in->name, input_format_names[a.format] );
+			goto out;
+	}
+	STATS_END(conf, PHASE_HEADER, t0);
+	if (n || !a.width || !a.height)
+	{
+		fprintf( stderr, "Error: %s: bad %s header\n", in->name, input_format_names[a.format] );
+		goto out;
+	}
+
+	if (FBOpen( &fb, conf, 1 ) < 0)
+		goto out;
+	a.bpp = BytesPerFBPixel(fb.fmt);
+	a.vw = a.width < fb.width ? a.width : fb.width;
+	a.vh = a.height < fb.height ? a.height : fb.height;
+	a.canvas = (uint32_t *)malloc( (size_t)a.width * a.height * sizeof(uint32_t) );
+	a.saved = (uint32_t *)malloc( (size_t)a.width * a.height * sizeof(uint32_t) );
+	a.native = (unsigned char *)calloc( (size_t)a.vw * a.vh, a.bpp );
+	a.row = (unsigned char *)malloc( 4 * (size_t)(fb.width > conf->width ? fb.width : conf->width) );
+	for (n = 0; n < ANIM_QUEUE; n++)
+	{
+		a.slots[n].pix = (unsigned char *)malloc( (size_t)a.vw * a.vh * a.bpp );
+		a.slots[n].stale.w = a.vw;
+		a.slots[n].stale.h = a.vh;
+		if (!a.slots[n].pix)
+			nomem = 1;
+	}
+	if (nomem || !a.canvas || !a.saved || !a.native || !a.row)
+	{
+		fprintf( stderr, "Error: cannot allocate %ux%u animation frames\n", a.width, a.height );
+		goto close;
+	}
+	STATS_ALLOC(conf, (size_t)a.width * a.height * 8 + (size_t)a.vw * a.vh * a.bpp * (ANIM_QUEUE + 1));
+
+	tfd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC );
+	if (tfd < 0)
+	{
+		fprintf( stderr, "Error: timerfd_create failed, errno=%d (%s)\n", errno, strerror(errno) );
+		goto close;
+	}
+	vsync = ioctl( fb.fd, FBIO_WAITFORVSYNC, &crtc ) == 0;
+	PROGRESS( conf, "Playing %s: %s %ux%u on %ux%u%s\n", in->name, input_format_names[a.format],
+		a.width, a.height, fb.width, fb.height, vsync ? ", synced to vblank" : "" );
+
+	if (pthread_create( &thread, NULL, AnimDecoder, &a ))
+	{
+		fprintf( stderr, "Error: cannot start decoder thread\n" );
+		goto close;
+	}
+	ret = 0;
+	start = StatsNow();
+	for (;;)
+	{
+		pthread_mutex_lock( &a.lock );
+		while (a.count == 0 && !a.done)
+			pthread_cond_wait( &a.ready, &a.lock );
+		if (a.count == 0)
+		{
+			pthread_mutex_unlock( &a.lock );
+			break;
+		}
+		slot = &a.slots[a.head];
+		drop = a.count > 1;
+		pthread_mutex_unlock( &a.lock );
+
+		if (!shown && !dropped)
+			due = StatsNow();
+		AnimUnion( &pending, &slot->dirty );
+		now = StatsNow();
+		if (drop && now > due + slot->delay_ns)
+		{
+			// Its whole interval has passed and the next one is ready
+			dropped++;
+			TRACE_BEGIN("fb", "drop", slot->index);
+			TRACE_END("fb", "drop", slot->index);
+		}
+		else
+		{
+			if (now < due)
+				AnimSleepUntil( tfd, due );
+			if (vsync)
+				ioctl( fb.fd, FBIO_WAITFORVSYNC, &crtc );
+			t0 = STATS_BEGIN(conf);
+			TRACE_BEGIN("fb", "present", slot->index);
+			if (AnimBlit( &a, &fb, slot, &pending ))
+				ret = -1;
+			TRACE_END("fb", "present", slot->index);
+			STATS_END(conf, PHASE_FB_WRITE, t0);
+			pending.w = pending.h = 0;
+			late = StatsNow();
+			late = late > due ? late - due : 0;
+			if (late > ANIM_LATE_NS)
+				nlate++;
+			if (late > worst)
+				worst = late;
+			shown += !ret;
+			hold = slot->delay_ns;
+		}
+		due += slot->delay_ns;
+
+		pthread_mutex_lock( &a.lock );
+		a.head = (a.head + 1) % ANIM_QUEUE;
+		a.count--;
+		if (ret)
+			a.stop = 1;
+		pthread_cond_signal( &a.space );
+		pthread_mutex_unlock( &a.lock );
+		if (ret)
+			break;
+	}
+	pthread_join( thread, NULL );
+	if (a.error)
+		ret = -1;
+	// The loop ends as the last frame goes up; it is on screen for its delay
+	now = StatsNow() - start + hold;
+	PROGRESS( conf, "Played %u frame%s in %.2f s (%.1f fps), %u dropped, %u late (worst %.1f ms)\n",
+		shown, shown == 1 ? "" : "s", now / 1e9, now ? shown * 1e9 / now : 0.0,
+		dropped, nlate, worst / 1e6 );
+
+close:
+	if (FBClose( &fb ) < 0)
+		ret = -1;
+out:
+	if (tfd >= 0)
+		close( tfd );
+	if (a.dinfo_ok)
+		jpeg_destroy_decompress( &a.dinfo );
+	for (n = 0; n < ANIM_QUEUE; n++)
+		free( a.slots[n].pix );
+	free( a.canvas );
+	free( a.saved );
+	free( a.pixels );
+	free( a.native );
+	free( a.row );
+	free( a.png );
+	free( a.jrow );
+	free( buf );
+	pthread_cond_destroy( &a.ready );
+	pthread_cond_destroy( &a.space );
+	pthread_mutex_destroy( &a.lock );
+	return ret;
+}
+
+#endif
+
+int PlayAnimation( struct imgtool_conf *conf )
+{
+	struct img_input in;
+	int ret;
+
+	if (InputOpen( &in, conf->filename ))
+		return -1;
+	if (in.format == INPUT_SEQ)
+		ret = SeqPlay( conf, &in );
+	else
+	{
+#ifndef NO_PNG
+		ret = AnimPlay( conf, &in );
+#else
+		fprintf( stderr, "%s: only frame sequences can be played (NO_PNG)\n", in.name );
+		ret = -1;
+#endif
+	}
+	InputClose( &in );
+	return ret;
+}
+
+///////////////////////// pyramids ////////////////////////
+
+// Tiled pyramids (--mode=pyramid) hold an image at full size and at every
+// halving of it, cut into tiles. A view (--mode=view) of some level at
+// some offset touches only the tiles under the screen. Native tiles are
+// copied straight from the mapping of the file; JPEG tiles are decoded into
+// a least recently used cache of --cache tiles (PYR_CACHE_SCREENS screens'
+// worth by default) and copied from there, so a pan decodes only the tiles
+// it brings on screen.
+#define PYR_DEFAULT_TILE	256
+#define PYR_MAX_TILE		4096
+#define PYR_MAX_LEVELS		32
+#define PYR_CACHE_SCREENS	2
+
+struct pyr_level {
+	unsigned int width, height, cols, rows;
+	const struct imgtool_pyr_tile *tiles;	// In the mapping, little endian
+};
+
+struct pyr_cached {
+	uint64_t key;			// level << 56 | row << 28 | col
+	uint64_t used;			// View that last showed it, 0 when free
+	unsigned char *pixels;		// Packed rows in the frame buffer format
+};
+
+struct pyramid {
+	struct img_input in;
+	char path[2048];
+	unsigned int width, height, tile, levels, jpeg;
+	enum bit_format fmt;		// Of native tiles
+	struct pyr_level level[PYR_MAX_LEVELS];
+	unsigned char *zero;		// A zeroed screen row, for the margins
+	size_t zero_len;
+	uint64_t views;
+
+	// JPEG tiles
+	struct pyr_cached *cache;
+	unsigned int ncache;
+	uint64_t hits, decoded;
+	unsigned char *rgb;		// One decoded tile row
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_jmp_error jerr;
+	int jpeg_ready;
+};
+
+static void PyrClose( struct pyramid *p )
+{
+	unsigned int i;
+
+	for (i = 0; i < p->ncache; i++)
+		free( p->cache[i].pixels );
+	free( p->cache );
+	free( p->rgb );
+	free( p->zero );
+	if (p->jpeg_ready)
+		jpeg_destroy_decompress( &p->dinfo );
+	InputClose( &p->in );
+	memset( p, 0, sizeof(*p) );
+}
+
+static int PyrOpen( struct pyramid *p, const char *path )
+{
+	const struct imgtool_pyr_header *hdr;
+	const struct imgtool_pyr_level *l;
+	uint64_t index, tiles;
+	unsigned int n, w, h;
+
+	memset( p, 0, sizeof(*p) );
+	strncpy( p->path, path, sizeof(p->path) - 1 );
+	if (InputOpen( &p->in, p->path ))
+		return -1;
+	if (!p->in.map)
+	{
+		fprintf( stderr, "Error: %s: pyramids are viewed from a file, not a pipe\n", p->in.name );
+		goto fail;
+	}
+	// Views hop about the file: drop the sequential read-ahead
+	madvise( (void *)p->in.map, p->in.map_size, MADV_NORMAL );
+
+	hdr = (const struct imgtool_pyr_header *)p->in.map;
+	if (p->in.format != INPUT_PYR || p->in.map_size < sizeof(*hdr) || le32toh( hdr->raw.header_size ) < sizeof(*hdr))
+		goto bad;
+	p->width = le32toh( hdr->raw.width );
+	p->height = le32toh( hdr->raw.height );
+	p->fmt = (enum bit_format)le32toh( hdr->raw.format );
+	p->tile = le32toh( hdr->tile );
+	p->levels = le32toh( hdr->levels );
+	p->jpeg = (le32toh( hdr->flags ) & IMGTOOL_PYR_JPEG) != 0;
+	index = le64toh( hdr->index );
+	if (!p->width || !p->height || (unsigned int)p->fmt > BF_ARGB8888 || !p->tile || p->tile > PYR_MAX_TILE ||
+		!p->levels || p->levels > PYR_MAX_LEVELS || (index & 7) || index > p->in.map_size ||
+		(p->in.map_size - index) / sizeof(*l) < p->levels)
+		goto bad;
+	l = (const struct imgtool_pyr_level *)(p->in.map + index);
+	for (n = 0, w = p->width, h = p->height; n < p->levels; n++, w = (w + 1) / 2, h = (h + 1) / 2)
+	{
+		p->level[n].width = le32toh( l[n].width );
+		p->level[n].height = le32toh( l[n].height );
+		p->level[n].cols = le32toh( l[n].cols );
+		p->level[n].rows = le32toh( l[n].rows );
+		tiles = le64toh( l[n].tiles );
+		if (p->level[n].width != w || p->level[n].height != h ||
+			p->level[n].cols != (w + p->tile - 1) / p->tile || p->level[n].rows != (h + p->tile - 1) / p->tile ||
+			(tiles & 7) || tiles > p->in.map_size ||
+			(p->in.map_size - tiles) / sizeof(*p->level[n].tiles) / p->level[n].cols < p->level[n].rows)
+			goto bad;
+		p->level[n].tiles = (const struct imgtool_pyr_tile *)(p->in.map + tiles);
+	}
+	if (p->jpeg)
+	{
+#ifdef NO_PNG
+		fprintf( stderr, "%s: JPEG tiles not supported (NO_PNG build also does not support jpeg decode)\n", p->in.name );
+		goto fail;
+#endif
+		// One spare byte: the ARGB converter reads a pixel's fourth byte
+		if (!(p->rgb = (unsigned char *)malloc( p->tile * 3 + 1 )))
+			goto fail;
+	}
+	return 0;
+bad:
+	fprintf( stderr, "Error: %s: not a valid pyramid\n", p->in.name );
+fail:
+	PyrClose( p );
+	return -1;
+}
+
+// Stored bytes of tile col,row of level n, checked against the file
+static const unsigned char *PyrTileData( struct pyramid *p, unsigned int n, unsigned int col, unsigned int row,
+	unsigned int tw, unsigned int th, size_t *size )
+{
+	const struct imgtool_pyr_tile *t = &p->level[n].tiles[(size_t)row * p->level[n].cols + col];
+	uint64_t off = le64toh( t->offset );
+
+	*size = le32toh( t->size );
+	if (off > p->in.map_size || p->in.map_size - off < *size ||
+		(!p->jpeg && *size != (size_t)tw * th * BytesPerFBPixel(p->fmt)))
+	{
+		fprintf( stderr, "Error: %s: level %u tile %u,%u is corrupt\n", p->in.name, n, col, row );
+		return NULL;
+	}
+	return p->in.map + off;
+}
+
+#ifndef NO_PNG
+// Decode a tw x th JPEG tile into packed rows in conf's frame buffer format
+static int PyrDecode( struct pyramid *p, struct imgtool_conf *conf, const unsigned char *data, size_t size,
+	unsigned int tw, unsigned int th, unsigned char *out )
+{
+	struct imgtool_conf tconf = *conf;
+	struct img_input in;
+	JSAMPROW row = p->rgb;
+	unsigned int bpp = BytesPerFBPixel(conf->fmt);
+	unsigned char *dest;
+
+	if (!p->jpeg_ready)
+		p->dinfo.err = jpeg_jmp_error( &p->jerr );
+	if (setjmp( p->jerr.jmp ))
+	{
+		if (p->jpeg_ready)
+			jpeg_abort_decompress( &p->dinfo );
+		return -1;
+	}
+	if (!p->jpeg_ready)
+	{
+		jpeg_create_decompress( &p->dinfo );
+		p->jpeg_ready = 1;
+	}
+	InputOpenMem( &in, data, size );
+	jpeg_input_src( &p->dinfo, &in );
+	(void) jpeg_read_header( &p->dinfo, TRUE );
+	p->dinfo.out_color_space = JCS_RGB;
+	(void) jpeg_start_decompress( &p->dinfo );
+	if (p->dinfo.output_width != tw || p->dinfo.output_height != th)
+	{
+		jpeg_abort_decompress( &p->dinfo );
+		return -1;
+	}
+	// The converters clip to, and clear, conf->width pixels
+	tconf.width = tw;
+	tconf.resize = 0;
+	tconf.mirror_h = 0;
+	while (p->dinfo.output_scanline < th)
+	{
+		dest = out + (size_t)p->dinfo.output_scanline * tw * bpp;
+		(void) jpeg_read_scanlines( &p->dinfo, &row, 1 );
+		RGB8toFBPng( &tconf, dest, p->rgb, tw, 0, NULL );
+	}
+	(void) jpeg_finish_decompress( &p->dinfo );
+	return 0;
+}
+#endif
+
+// Tile col,row of level n in the frame buffer's format: from the mapping
+// when stored that way, else from the cache, decoding it on a miss into
+// the entry shown longest ago
+static const unsigned char *PyrTile( struct pyramid *p, struct imgtool_conf *conf, unsigned int n,
+	unsigned int col, unsigned int row, unsigned int tw, unsigned int th )
+{
+	uint64_t key = (uint64_t)n << 56 | (uint64_t)row << 28 | col, t0;
+	struct pyr_cached *c = NULL;
+	const unsigned char *data;
+	unsigned int i;
+	size_t size;
+	int ret = -1;
+
+	if (!p->jpeg)
+		return PyrTileData( p, n, col, row, tw, th, &size );
+	for (i = 0; i < p->ncache; i++)
+	{
+		if (p->cache[i].used && p->cache[i].key == key)
+		{
+			p->cache[i].used = p->views;
+			p->hits++;
+			return p->cache[i].pixels;
+		}
+		if (!c || p->cache[i].used < c->used)
+			c = &p->cache[i];
+	}
+	if (!(data = PyrTileData( p, n, col, row, tw, th, &size )))
+		return NULL;
+	if (!c->pixels && !(c->pixels = (unsigned char *)malloc( (size_t)p->tile * p->tile * BytesPerFBPixel(conf->fmt) )))
+	{
+		fprintf( stderr, "Error: out of memory for the tile cache\n" );
+		return NULL;
+	}
+	c->used = 0;
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("decode", "tile", n);
+#ifndef NO_PNG
+	ret = PyrDecode( p, conf, data, size, tw, th, c->pixels );
+#endif
+	TRACE_END("decode", "tile", n);
+	STATS_END(conf, PHASE_DECODE, t0);
+	STATS_ADD(conf, bytes_read, size);
+	if (ret)
+	{
+		fprintf( stderr, "Error: %s: level %u tile %u,%u is corrupt\n", p->in.name, n, col, row );
+		return NULL;
+	}
+	c->key = key;
+	c->used = p->views;
+	p->decoded++;
+	return c->pixels;
+}
+
+// Show level n with its top left corner at x,y full size pixels, moved
+// back onto the image where the level is larger than the screen. Whatever
+// of the screen the level does not cover is cleared.
+static int PyrView( struct pyramid *p, struct imgtool_conf *conf, struct fb_dev *fb, unsigned int n,
+	unsigned int x, unsigned int y )
+{
+	const struct pyr_level *l;
+	const unsigned char *src;
+	unsigned int bpp = BytesPerFBPixel(fb->fmt), vw, vh, col, row, tx, ty, tw, th, x0, x1, y0, y1, r, shown = 0;
+	uint64_t t0;
+
+	if (!p->jpeg && fb->fmt != p->fmt)
+	{
+		fprintf( stderr, "Error: %s holds %s tiles, the frame buffer is %s\n", p->in.name,
+			bit_format_names[p->fmt], bit_format_names[fb->fmt] );
+		return -1;
+	}
+	if (n >= p->levels)
+		n = p->levels - 1;
+	l = &p->level[n];
+	x >>= n;
+	y >>= n;
+	if (x > (l->width > fb->width ? l->width - fb->width : 0))
+		x = l->width > fb->width ? l->width - fb->width : 0;
+	if (y > (l->height > fb->height ? l->height - fb->height : 0))
+		y = l->height > fb->height ? l->height - fb->height : 0;
+	vw = l->width - x < fb->width ? l->width - x : fb->width;
+	vh = l->height - y < fb->height ? l->height - y : fb->height;
+
+	if (p->jpeg && !p->cache)
+	{
+		p->ncache = conf->tile_cache ? conf->tile_cache : PYR_CACHE_SCREENS *
+			((fb->width + p->tile - 1) / p->tile + 1) * ((fb->height + p->tile - 1) / p->tile + 1);
+		if (!(p->cache = (struct pyr_cached *)calloc( p->ncache, sizeof(*p->cache) )))
+		{
+			fprintf( stderr, "Error: out of memory for a %u tile cache\n", p->ncache );
+			p->ncache = 0;
+			return -1;
+		}
+	}
+	if (p->zero_len < fb->row_bytes)
+	{
+		free( p->zero );
+		if (!(p->zero = (unsigned char *)calloc( 1, fb->row_bytes )))
+		{
+			p->zero_len = 0;
+			return -1;
+		}
+		p->zero_len = fb->row_bytes;
+	}
+	p->views++;
+
+	TRACE_BEGIN("fb", "view", n);
+	for (row = y / p->tile; row * p->tile < y + vh; row++)
+	{
+		for (col = x / p->tile; col * p->tile < x + vw; col++)
+		{
+			tx = col * p->tile;
+			ty = row * p->tile;
+			tw = l->width - tx < p->tile ? l->width - tx : p->tile;
+			th = l->height - ty < p->tile ? l->height - ty : p->tile;
+			if (!(src = PyrTile( p, conf, n, col, row, tw, th )))
+				return -1;
+
+			// Part of the tile on screen
+			x0 = tx > x ? tx : x;
+			x1 = tx + tw < x + vw ? tx + tw : x + vw;
+			y0 = ty > y ? ty : y;
+			y1 = ty + th < y + vh ? ty + th : y + vh;
+			t0 = STATS_BEGIN(conf);
+			for (r = y0; r < y1; r++)
+				if (AnimWrite( fb, conf->output, src + ((size_t)(r - ty) * tw + (x0 - tx)) * bpp,
+					(size_t)(x1 - x0) * bpp, (off_t)(r - y) * fb->stride + (off_t)(x0 - x) * bpp ))
+					return -1;
+			STATS_END(conf, PHASE_FB_WRITE, t0);
+			STATS_ADD(conf, bytes_written, (uint64_t)(y1 - y0) * (x1 - x0) * bpp);
+			shown++;
+		}
+	}
+
+	// Screen beyond a level smaller than it
+	t0 = STATS_BEGIN(conf);
+	for (r = 0; r < fb->height; r++)
+	{
+		if (r < vh && vw < fb->width &&
+			AnimWrite( fb, conf->output, p->zero, (size_t)(fb->width - vw) * bpp, (off_t)r * fb->stride + (off_t)vw * bpp ))
+			return -1;
+		if (r >= vh && AnimWrite( fb, conf->output, p->zero, fb->row_bytes, (off_t)r * fb->stride ))
+			return -1;
+	}
+	STATS_END(conf, PHASE_FB_WRITE, t0);
+	STATS_ADD(conf, rows, vh);
+	TRACE_END("fb", "view", n);
+	if (conf->debug_level > 0)
+		fprintf( stderr, "%s: level %u (%ux%u) at %u,%u, %u tiles\n", p->in.name, n, l->width, l->height,
+			x, y, shown );
+	return 0;
+}
+
+// One view through the frame buffer conf points at (library callers)
+static int PyrShow( struct pyramid *p, struct imgtool_conf *conf, unsigned int n, unsigned int x, unsigned int y )
+{
+	struct fb_dev fb;
+	int ret;
+
+	if (FBOpen( &fb, conf, 1 ) < 0)
+		return -1;
+	ret = PyrView( p, conf, &fb, n, x, y );
+	if (FBClose( &fb ) < 0)
+		ret = -1;
+	return ret;
+}
+
+int ViewPyramid( struct imgtool_conf *conf )
+{
+	struct pyramid p;
+	struct fb_dev fb;
+	FILE *f = NULL;
+	char line[256];
+	unsigned int n = conf->zoom, x = conf->crop_x, y = conf->crop_y, views = 0;
+	int ret;
+
+	if (PyrOpen( &p, conf->filename ))
+		return -1;
+	if (FBOpen( &fb, conf, 1 ) < 0)
+	{
+		PyrClose( &p );
+		return -1;
+	}
+	PROGRESS( conf, "Viewing %s: %ux%u, %u levels of %u pixel %s tiles\n", p.in.name, p.width, p.height,
+		p.levels, p.tile, p.jpeg ? "jpeg" : bit_format_names[p.fmt] );
+	ret = PyrView( &p, conf, &fb, n, x, y );
+	views += !ret;
+
+	// Further views (--views), one "level x y" line each, from a script or
+	// a pipe
+	if (ret == 0 && conf->views[0])
+	{
+		f = strcmp( conf->views, "-" ) ? fopen( conf->views, "r" ) : stdin;
+		if (!f)
+		{
+			fprintf( stderr, "Error: cannot open %s, errno=%d (%s)\n", conf->views, errno, strerror(errno) );
+			ret = -1;
+		}
+	}
+	while (ret == 0 && f && fgets( line, sizeof(line), f ))
+	{
+		if (line[strspn( line, " \t\r\n" )] == '\0')
+			continue;
+		if (sscanf( line, "%u %u %u", &n, &x, &y ) != 3)
+		{
+			fprintf( stderr, "Error: a view is level x y, not %s", line );
+			ret = -1;
+			break;
+		}
+		ret = PyrView( &p, conf, &fb, n, x, y );
+		views += !ret;
+	}
+	if (f && f != stdin)
+		fclose( f );
+	if (p.jpeg)
+		PROGRESS( conf, "Showed %u view%s, %llu tiles from the cache, %llu decoded\n", views, views == 1 ? "" : "s",
+			(unsigned long long)p.hits, (unsigned long long)p.decoded );
+	else
+		PROGRESS( conf, "Showed %u view%s\n", views, views == 1 ? "" : "s" );
+	if (FBClose( &fb ) < 0)
+		ret = -1;
+	PyrClose( &p );
+	return ret;
+}
+
+// Rectangle fills (--rect). Each rectangle is clipped to the frame buffer
+// and filled a row at a time in native format, straight into the mapping
+// and honouring its stride. Solid rows are stored from registers without
+// reading any source; pattern rows are converted once and copied. When a
+// call covers more than FILL_NT_BYTES the stores are non-temporal, so a
+// large clear does not evict the rest of the UI's working set on its way
+// to memory. A frame buffer that cannot be mapped is written with pwrite().
+#define FILL_NT_BYTES	(256*1024)
+#define FILL_CELL	8
+
+// Fill len bytes at dst with the bpp byte pixel px over and over
+static void FillSpanSolid( unsigned char *dst, size_t len, const unsigned char *px, unsigned int bpp, int nt )
+{
+	unsigned char pat[48];		// lcm(3, 16): whole pixels in three vectors
+	size_t n = 0, i;
+
+	// A byte at a time up to a 16 byte boundary, then 48 bytes per step
+	while (n < len && ((uintptr_t)(dst + n) & 15))
+	{
+		dst[n] = px[n % bpp];
+		n++;
+	}
+	for (i = 0; i < sizeof(pat); i++)
+		pat[i] = px[(n + i) % bpp];
+#ifdef __SSE2__
+	{
+		__m128i a = _mm_loadu_si128( (const __m128i *)pat );
+		__m128i b = _mm_loadu_si128( (const __m128i *)(pat + 16) );
+		__m128i c = _mm_loadu_si128( (const __m128i *)(pat + 32) );
+		if (nt)
+		{
+			for (; n + 48 <= len; n += 48)
+			{
+				_mm_stream_si128( (__m128i *)(dst + n), a );
+				_mm_stream_si128( (__m128i *)(dst + n + 16), b );
+				_mm_stream_si128( (__m128i *)(dst + n + 32), c );
+			}
+		}
+		else
+		{
+			for (; n + 48 <= len; n += 48)
+			{
+				_mm_store_si128( (__m128i *)(dst + n), a );
+				_mm_store_si128( (__m128i *)(dst + n + 16), b );
+				_mm_store_si128( (__m128i *)(dst + n + 32), c );
+			}
+		}
+	}
+#else
+	for (; n + 48 <= len; n += 48)
+		memcpy( dst + n, pat, sizeof(pat) );
+#endif
+	for (i = 0; n < len; n++, i++)
+		dst[n] = pat[i];
+}
+
+// Copy a prepared row of len bytes to dst
+static void FillSpanCopy( unsigned char *dst, const unsigned char *src, size_t len, int nt )
+{
+	size_t n = 0;
+
+#ifdef __SSE2__
+	if (nt)
+	{
+		while (n < len && ((uintptr_t)(dst + n) & 15))
+		{
+			dst[n] = src[n];
+			n++;
+		}
+		for (; n + 64 <= len; n += 64)
+		{
+			__m128i a = _mm_loadu_si128( (const __m128i *)(src + n) );
+			__m128i b = _mm_loadu_si128( (const __m128i *)(src + n + 16) );
+			__m128i c = _mm_loadu_si128( (const __m128i *)(src + n + 32) );
+			__m128i d = _mm_loadu_si128( (const __m128i *)(src + n + 48) );
+			_mm_stream_si128( (__m128i *)(dst + n), a );
+			_mm_stream_si128( (__m128i *)(dst + n + 16), b );
+			_mm_stream_si128( (__m128i *)(dst + n + 32), c );
+			_mm_stream_si128( (__m128i *)(dst + n + 48), d );
+		}
+	}
+#endif
+	memcpy( dst + n, src + n, len - n );
+}
+
+// Color i of n steps from a to b, per channel
+static uint32_t FillBlend( uint32_t a, uint32_t b, unsigned int i, unsigned int n )
+{
+	uint32_t out = 0;
+	int shift, ca, cb;
+
+	if (n < 2)
+		return a;
+	for (shift = 0; shift < 32; shift += 8)
+	{
+		ca = (a >> shift) & 0xff;
+		cb = (b >> shift) & 0xff;
+		out |= (uint32_t)(ca + (cb - ca) * (int)i / (int)(n - 1)) << shift;
+	}
+	return out;
+}
+
+// One pixel in native format. The converters always write out a whole row,
+// so go through the scratch row.
+static void FillPixel( struct imgtool_conf *conf, unsigned char *px, uint32_t argb, unsigned char *row )
+{
+	ARGB8888toFB( conf, row, (const unsigned char *)&argb, 1 );
+	memcpy( px, row, BytesPerFBPixel(conf->fmt) );
+}
+
+// Scratch for FillRect(): ARGB words for a row, and three native rows
+// (two checker phases or a gradient, plus one for single pixels and pwrite())
+struct fill_scratch {
+	uint32_t *argb;
+	unsigned char *rows;
+	int nt;
+};
+
+static int FillRect( struct imgtool_conf *conf, struct fb_dev *fb, const struct imgtool_rect *r, struct fill_scratch *s )
+{
+	unsigned int bpp = BytesPerFBPixel(fb->fmt);
+	unsigned int cell = r->cell ? r->cell : FILL_CELL;
+	int64_t x0 = r->x < 0 ? 0 : r->x, y0 = r->y < 0 ? 0 : r->y;
+	int64_t x1 = (int64_t)r->x + r->w, y1 = (int64_t)r->y + r->h;
+	unsigned char px[4], *line = s->rows + 2 * fb->row_bytes;
+	const unsigned char *src = NULL;
+	unsigned int i, w;
+	size_t len;
+	int64_t y;
+	uint32_t c;
+
+	if (x1 > fb->width)
+		x1 = fb->width;
+	if (y1 > fb->height)
+		y1 = fb->height;
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+	w = x1 - x0;
+	len = (size_t)w * bpp;
+
+	// Work out what does not change from row to row
+	switch (r->pattern)
+	{
+		case IMGTOOL_SOLID:
+		default:
+			FillPixel( conf, px, r->argb[0], line );
+			break;
+		case IMGTOOL_VGRADIENT:
+			break;
+		case IMGTOOL_HGRADIENT:
+			for (i = 0; i < w; i++)
+				s->argb[i] = FillBlend( r->argb[0], r->argb[1], x0 - r->x + i, r->w );
+			ARGB8888toFB( conf, s->rows, (const unsigned char *)s->argb, w );
+			src = s->rows;
+			break;
+		case IMGTOOL_CHECKER:
+			for (i = 0; i < w; i++)
+				s->argb[i] = r->argb[((x0 - r->x + i) / cell) & 1];
+			ARGB8888toFB( conf, s->rows, (const unsigned char *)s->argb, w );
+			for (i = 0; i < w; i++)
+				s->argb[i] = r->argb[!(((x0 - r->x + i) / cell) & 1)];
+			ARGB8888toFB( conf, s->rows + fb->row_bytes, (const unsigned char *)s->argb, w );
+			break;
+	}
+
+	for (y = y0; y < y1; y++)
+	{
+		if (r->pattern == IMGTOOL_VGRADIENT)
+		{
+			c = FillBlend( r->argb[0], r->argb[1], y - r->y, r->h );
+			FillPixel( conf, px, c, line );
+		}
+		else if (r->pattern == IMGTOOL_CHECKER)
+			src = s->rows + (((y - r->y) / cell) & 1) * fb->row_bytes;
+
+		if (fb->mem)
+		{
+			unsigned char *dst = fb->mem + (size_t)y * fb->stride + (size_t)x0 * bpp;
+			if (src)
+				FillSpanCopy( dst, src, len, s->nt );
+			else
+				FillSpanSolid( dst, len, px, bpp, s->nt );
+			continue;
+		}
+		if (!src)
+			FillSpanSolid( line, len, px, bpp, 0 );
+		if (pwrite( fb->fd, src ? src : line, len, (off_t)y * fb->row_bytes + (off_t)x0 * bpp ) != (ssize_t)len)
+		{
+			fprintf( stderr, "Error: rectangle fill could not write row %d, errno=%d (%s)%s\n", (int)y,
+				errno, strerror(errno), errno == ESPIPE ? " - needs a frame buffer or file" : "" );
+			return -1;
+		}
+	}
+	STATS_ADD(conf, bytes_written, (uint64_t)(y1 - y0) * len);
+	STATS_ADD(conf, rows, y1 - y0);
+	return 0;
+}
+
+// Fill rects[0..count) on an open frame buffer
+static int FillRectsFB( struct imgtool_conf *conf, struct fb_dev *fb, const struct imgtool_rect *rects, int count )
+{
+	struct imgtool_conf local = *conf;
+	struct fill_scratch s;
+	uint64_t area = 0, t0;
+	int64_t w, h;
+	int n, ret = 0;
+
+	// Rectangles are in screen coordinates: convert without mirroring or
+	// scaling left over from a draw
+	local.mirror_h = 0;
+	local.resize = 0;
+	for (n = 0; n < count; n++)
+	{
+		w = ((int64_t)rects[n].x + rects[n].w > fb->width ? fb->width : (int64_t)rects[n].x + rects[n].w)
+			- (rects[n].x < 0 ? 0 : rects[n].x);
+		h = ((int64_t)rects[n].y + rects[n].h > fb->height ? fb->height : (int64_t)rects[n].y + rects[n].h)
+			- (rects[n].y < 0 ? 0 : rects[n].y);
+		if (w > 0 && h > 0)
+			area += (uint64_t)w * h * BytesPerFBPixel(fb->fmt);
+	}
+	s.nt = area >= FILL_NT_BYTES;
+
+	ArenaReset( conf->arena );
+	ArenaReserve( conf->arena, ARENA_ROUND(sizeof(uint32_t) * fb->width) + ARENA_ROUND(3 * fb->row_bytes) );
+	s.argb = (uint32_t *)ArenaAlloc( conf->arena, sizeof(uint32_t) * fb->width );
+	s.rows = (unsigned char *)ArenaAlloc( conf->arena, 3 * fb->row_bytes );
+	if (!s.argb || !s.rows)
+	{
+		fprintf( stderr, "Error: cannot allocate fill rows for %u pixels\n", fb->width );
+		return -1;
+	}
+
+	PROGRESS( conf, "Filling %d rectangle%s, %llu bytes%s\n", count, count == 1 ? "" : "s",
+		(unsigned long long)area, s.nt ? " (non-temporal)" : "" );
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("fb", "fill_rects", count);
+	for (n = 0; n < count && ret == 0; n++)
+		ret = FillRect( &local, fb, &rects[n], &s );
+#ifdef __SSE2__
+	if (s.nt)
+		_mm_sfence();
+#endif
+	TRACE_END("fb", "fill_rects", count);
+	STATS_END(conf, PHASE_FB_WRITE, t0);
+	return ret;
+}
+
+int FillRects( struct imgtool_conf *conf )
+{
+	struct fb_dev fb;
+	int ret;
+
+	if (FBOpen( &fb, conf, 1 ) < 0)
+		return -1;
+	ret = FillRectsFB( conf, &fb, conf->rects, conf->nrects );
+	if (FBClose( &fb ) < 0)
+		ret = -1;
+	return ret;
+}
+
+// Fill frame buffer with rgb value
+int FillRGB(struct imgtool_conf *conf)
+{
+	int ret = -1;
+	struct fb_dev fb;
+	int bpp;
+	int bytes_per_pixel;
+	unsigned int row, col;
+	unsigned char *input_buff;
+	unsigned char *output_buff;
+	uint64_t t0;
+
+	// Now open output
+	if (FBOpen( &fb, conf, 1 ) < 0)
+	{
+		fprintf( stderr, "Error: failed to open %s (errno=%d)\n", conf->output, errno );
+		goto exit_close_input;
+	}
+
+	// A mapping gets the rectangle engine's wide stores
+	if (fb.mem)
+	{
+		struct imgtool_rect whole = { 0, 0, fb.width, fb.height, IMGTOOL_SOLID, { conf->fill_color, 0 }, 0 };
+		ret = FillRectsFB( conf, &fb, &whole, 1 );
+		goto exit_close_output;
+	}
+
+	// Allocate input and output buffers
+	bpp = 32;
+	bytes_per_pixel = bpp / 8;
+	ArenaReset( conf->arena );
+	ArenaReserve( conf->arena, ARENA_ROUND(bytes_per_pixel * conf->width)
+		+ ARENA_ROUND(BytesPerFBPixel(conf->fmt) * conf->width) );
+	input_buff = (unsigned char*)ArenaAlloc( conf->arena, bytes_per_pixel * conf->width );
+	if (input_buff == NULL)
+	{
+		fprintf( stderr, "Malloc failed for %d bytes\n", bytes_per_pixel * conf->width );
+		goto exit_close_output;
+	}
+	output_buff = (unsigned char*)ArenaAlloc( conf->arena, BytesPerFBPixel(conf->fmt) * conf->width );
+	if (output_buff == NULL)
+	{
+		fprintf( stderr, "malloc failed for %d bytes\n", 2 * conf->width );
+		goto exit_close_output;
+	}
+
+	// Set up input buffer
+	for (col = 0; col < conf->width; col++)
+	{
+		((unsigned int*)input_buff)[col] = (conf->fill_color<<0);
+	}
+	// Convert to frame buffer
+	t0 = STATS_BEGIN(conf);
+	TRACE_BEGIN("convert", "ARGB8888toFB", 0);
+	ARGB8888toFB( conf, output_buff, input_buff, conf->width );
+	TRACE_END("convert", "ARGB8888toFB", 0);
+	STATS_END(conf, PHASE_CONVERT, t0);
+	// Dump in hex for 8 columns
+	//HexDump( 0, "Fill pattern", output_buff, 4 * 8 );
+
+	// Black (and transparent) fills are zero rows, which cost no copying
+	for (col = 0; col < BytesPerFBPixel(conf->fmt) * conf->width && !output_buff[col]; col++)
+		;
+	t0 = STATS_BEGIN(conf);
+	row = 0;
+	if (col == BytesPerFBPixel(conf->fmt) * conf->width)
+	{
+		if (FBWriteZeroRows( &fb, 0, conf->height ) < 0)
+		{
+			fprintf( stderr, "write failed for %d rows\n", conf->height );
+			goto exit_close_output;
+		}
+		row = conf->height;
+	}
+	for (; row < conf->height; row++)
+	{
+		TRACE_BATCH(row);
+		if (FBWriteRow( &fb, row, output_buff ) != ((int)(BytesPerFBPixel(conf->fmt) * conf->width)))
+		{
+			fprintf( stderr, "write failed for %d bytes at row %d\n", BytesPerFBPixel(conf->fmt) * conf->width, row );
+			goto exit_close_output;
+		}
+	}
+	TRACE_BATCH_DONE(row);
+	STATS_END(conf, PHASE_FB_WRITE, t0);
+	STATS_ADD(conf, bytes_written, (uint64_t)conf->height * BytesPerFBPixel(conf->fmt) * conf->width);
+	STATS_ADD(conf, rows, conf->height);
+
+	ret = 0;
+
+exit_close_output:
+	if (FBClose( &fb ) < 0)
+		ret = -1;
+exit_close_input:
+	return ret;
+}
+
+
+int
+fill_fb_defaults (struct imgtool_conf *conf)
+{
+	int ret, fd;
+	struct fb_var_screeninfo var;
+
+	// Non-blocking so a fifo given as --output does not stall us here
+	fd = open(conf->output, O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		return -1;
+
+	ret = ioctl(fd, FBIOGET_VSCREENINFO, &var);
+	if (ret == -1)
+		goto out;
+
+	// Anything given on the command line takes precedence
+	if (!conf->width)
+		conf->width = var.xres;
+	if (!conf->height)
+		conf->height = var.yres;
+	if (!conf->fmt_given) {
+		if (var.bits_per_pixel == 16) {
+			if (var.red.offset)
+				conf->fmt = BF_RGB565;
+			else
+				conf->fmt = BF_BGR565;
+		}
+		else if (var.bits_per_pixel == 24)
+			conf->fmt = BF_RGB888;
+		else
+			conf->fmt = BF_ARGB8888;
+	}
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
+
+// Create an anonymous file sized for conf's geometry and point conf->output
+// at it. Returns the descriptor, which must stay open while it is in use.
+static int AnonFB( struct imgtool_conf *conf )
+{
+	size_t size = (size_t)(conf->stride ? conf->stride : BytesPerFBPixel(conf->fmt) * conf->width) * conf->height;
+	int fd = -1;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create( "imgtool-fb", 0 );
+#endif
+	if (fd < 0)
+	{
+		char tmpl[] = "/tmp/imgtool-fb.XXXXXX";
+		fd = mkstemp( tmpl );
+		if (fd >= 0)
+			unlink( tmpl );
+	}
+	if (fd < 0 || ftruncate( fd, size ) == -1)
+	{
+		fprintf( stderr, "Error: cannot create %lu byte stand-in frame buffer, errno=%d (%s)\n",
+			(unsigned long)size, errno, strerror(errno) );
+		if (fd >= 0)
+			close( fd );
+		return -1;
+	}
+	snprintf( conf->output, sizeof(conf->output), "/proc/self/fd/%d", fd );
+	return fd;
+}
+
+///////////////////////// library API ////////////////////////
+
+struct imgtool_ctx {
+	struct imgtool_conf conf;	// Template copied for every call
+	struct imgtool_arena arena;
+	struct fb_dev fb;		// Lent to calls through conf.fb when mapped
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_jmp_error djerr;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_jmp_error cjerr;
+	int jpeg_ready;
+	struct imgtool_target *targets;	// conf.targets, paths owned
+	struct pyramid *pyr;		// Last one viewed, tiles cached
+};
+
+static void ArenaFree( struct imgtool_arena *a )
+{
+	struct arena_block *b, *next;
+
+	for (b = a->head; b; b = next)
+	{
+		next = b->next;
+		free( b );
+	}
+	a->head = NULL;
+}
+
+imgtool_ctx *imgtool_open( const char *fb_path, const struct imgtool_geometry *geom )
+{
+	imgtool_ctx *ctx = (imgtool_ctx *)calloc( 1, sizeof(*ctx) );
+	struct imgtool_conf *conf;
+	struct stat st;
+
+	if (!ctx)
+		return NULL;
+	conf = &ctx->conf;
+	conf->gamma = 2.2;
+	conf->fill_color = 0xffffffff;
+	conf->x_pct = 100;
+	conf->y_pct = 100;
+	conf->jpeg_quality = 75;
+	conf->quiet = 1;
+	conf->arena = &ctx->arena;
+	strncpy( conf->output, fb_path ? fb_path : "/dev/fb0", sizeof(conf->output) - 1 );
+	if (geom)
+	{
+		conf->width = geom->width;
+		conf->height = geom->height;
+		conf->stride = geom->stride;
+		conf->fmt = (enum bit_format)geom->fmt;
+		conf->fmt_given = geom->fmt_given;
+	}
+	fill_fb_defaults( conf );
+	if (!conf->width || !conf->height)
+	{
+		fprintf( stderr, "Error: no geometry for %s\n", conf->output );
+		free( ctx );
+		return NULL;
+	}
+	if ((unsigned int)conf->fmt > BF_ARGB8888)
+	{
+		fprintf( stderr, "Error: unsupported bit format %d for %s\n", (int)conf->fmt, conf->output );
+		free( ctx );
+		return NULL;
+	}
+
+	// Keep a device, or a file big enough to stand in for one, mapped for
+	// the life of the context. Anything else is opened per call.
+	if (stat( conf->output, &st ) == 0 && (S_ISCHR( st.st_mode ) ||
+		(S_ISREG( st.st_mode ) && st.st_size >= (off_t)conf->height *
+			(conf->stride > BytesPerFBPixel(conf->fmt) * conf->width ?
+				conf->stride : BytesPerFBPixel(conf->fmt) * conf->width))))
+	{
+		if (FBOpen( &ctx->fb, conf, 1 ) == 0)
+		{
+			if (ctx->fb.mem)
+				conf->fb = &ctx->fb;
+			else
+				FBClose( &ctx->fb );
+		}
+	}
+
+	// The libjpeg objects are created once; each call reuses them
+	if (setjmp( ctx->djerr.jmp ) || setjmp( ctx->cjerr.jmp ))
+	{
+		imgtool_close( ctx );
+		return NULL;
+	}
+	ctx->dinfo.err = jpeg_jmp_error( &ctx->djerr );
+	jpeg_create_decompress( &ctx->dinfo );
+	ctx->cinfo.err = jpeg_jmp_error( &ctx->cjerr );
+	jpeg_create_compress( &ctx->cinfo );
+	ctx->jpeg_ready = 1;
+	conf->dinfo = &ctx->dinfo;
+	conf->cinfo = &ctx->cinfo;
+	return ctx;
+}
+
+void imgtool_close( imgtool_ctx *ctx )
+{
+	if (!ctx)
+		return;
+	if (ctx->conf.fb)
+		FBClose( &ctx->fb );
+	if (ctx->jpeg_ready)
+	{
+		jpeg_destroy_decompress( &ctx->dinfo );
+		jpeg_destroy_compress( &ctx->cinfo );
+	}
+	while (ctx->conf.ntargets > 0)
+		free( (void *)ctx->targets[--ctx->conf.ntargets].path );
+	free( ctx->targets );
+	if (ctx->pyr)
+	{
+		PyrClose( ctx->pyr );
+		free( ctx->pyr );
+	}
+	ArenaFree( &ctx->arena );
+	free( ctx );
+}
+
+void imgtool_get_geometry( imgtool_ctx *ctx, struct imgtool_geometry *geom )
+{
+	geom->width = ctx->conf.width;
+	geom->height = ctx->conf.height;
+	geom->stride = ctx->conf.fb ? ctx->fb.stride : ctx->conf.stride;
+	geom->fmt = (enum imgtool_bitfmt)ctx->conf.fmt;
+	geom->fmt_given = 1;
+}
+
+void imgtool_set_resize( imgtool_ctx *ctx, unsigned int resize_options )
+{
+	ctx->conf.resize_options = resize_options;
+}
+
+void imgtool_set_mirror( imgtool_ctx *ctx, int mirror )
+{
+	ctx->conf.mirror_h = mirror;
+}
+
+void imgtool_set_jpeg_quality( imgtool_ctx *ctx, int quality )
+{
+	ctx->conf.jpeg_quality = quality;
+}
+
+void imgtool_set_jpeg_scans( imgtool_ctx *ctx, int scans )
+{
+	ctx->conf.jpeg_scans = scans;
+}
+
+void imgtool_set_thumbnail( imgtool_ctx *ctx, int size )
+{
+	ctx->conf.thumbnail = size;
+}
+
+void imgtool_set_damage( imgtool_ctx *ctx, int damage )
+{
+	ctx->conf.damage = damage;
+}
+
+void imgtool_set_crop( imgtool_ctx *ctx, int crop, unsigned int x, unsigned int y, unsigned int w, unsigned int h )
+{
+	ctx->conf.crop = crop;
+	ctx->conf.crop_x = x;
+	ctx->conf.crop_y = y;
+	ctx->conf.crop_w = w;
+	ctx->conf.crop_h = h;
+}
+
+int imgtool_add_target( imgtool_ctx *ctx, const char *fb_path, const struct imgtool_geometry *geom )
+{
+	struct imgtool_target *targets, t;
+
+	memset( &t, 0, sizeof(t) );
+	if (geom)
+		t.geom = *geom;
+	if (t.geom.fmt_given && (unsigned int)t.geom.fmt > IMGTOOL_ARGB8888)
+	{
+		fprintf( stderr, "Error: unsupported bit format %d for %s\n", (int)t.geom.fmt, fb_path );
+		return -1;
+	}
+	targets = (struct imgtool_target *)realloc( ctx->targets, (ctx->conf.ntargets + 1) * sizeof(t) );
+	if (!targets)
+		return -1;
+	ctx->targets = targets;
+	ctx->conf.targets = targets;
+	if (!(t.path = strdup( fb_path )))
+		return -1;
+	targets[ctx->conf.ntargets++] = t;
+	return 0;
+}
+
+void imgtool_set_tile_cache( imgtool_ctx *ctx, unsigned int tiles )
+{
+	ctx->conf.tile_cache = tiles;
+}
+
+void imgtool_set_capture_threads( imgtool_ctx *ctx, int threads )
+{
+	ctx->conf.jobs = threads;
+}
+
+void imgtool_set_raw_packed( imgtool_ctx *ctx, int packed )
+{
+	ctx->conf.packed = packed;
+}
+
+void imgtool_set_snapshot( imgtool_ctx *ctx, int mode )
+{
+	ctx->conf.snapshot = mode;
+}
+
+void imgtool_set_background( imgtool_ctx *ctx, int nice_level, uint64_t bytes_per_sec )
+{
+	ctx->conf.background = nice_level >= 0;
+	ctx->conf.background_nice = nice_level;
+	ctx->conf.budget = bytes_per_sec;
+}
+
+void imgtool_set_verbose( imgtool_ctx *ctx, int verbose )
+{
+	ctx->conf.quiet = !verbose;
+}
+
+// Every call works on a copy of the context's conf, since a draw rewrites
+// the scaling state; the copy still points at the context's long-lived state
+int imgtool_draw_file( imgtool_ctx *ctx, const char *path )
+{
+	struct imgtool_conf conf = ctx->conf;
+
+	strncpy( conf.filename, path, sizeof(conf.filename) - 1 );
+	return ShowImage( &conf );
+}
+
+int imgtool_play_file( imgtool_ctx *ctx, const char *path, int fps, int loops )
+{
+	struct imgtool_conf conf = ctx->conf;
+
+	strncpy( conf.filename, path, sizeof(conf.filename) - 1 );
+	conf.fps = fps;
+	conf.loops = loops;
+	return PlayAnimation( &conf );
+}
+
+int imgtool_view_file( imgtool_ctx *ctx, const char *path, unsigned int level, unsigned int x, unsigned int y )
+{
+	struct imgtool_conf conf = ctx->conf;
+
+	if (ctx->pyr && strcmp( ctx->pyr->path, path ))
+	{
+		PyrClose( ctx->pyr );
+		free( ctx->pyr );
+		ctx->pyr = NULL;
+	}
+	if (!ctx->pyr)
+	{
+		if (!(ctx->pyr = (struct pyramid *)malloc( sizeof(*ctx->pyr) )))
+			return -1;
+		if (PyrOpen( ctx->pyr, path ))
+		{
+			free( ctx->pyr );
+			ctx->pyr = NULL;
+			return -1;
+		}
+	}
+	return PyrShow( ctx->pyr, &conf, level, x, y );
+}
+
+int imgtool_draw_mem( imgtool_ctx *ctx, const void *data, size_t size )
+{
+	struct imgtool_conf conf = ctx->conf;
+	struct img_input in;
+	int ret;
+
+	InputOpenMem( &in, data, size );
+	ret = ShowInput( &conf, &in );
+	InputClose( &in );
+	return ret;
+}
+
+int imgtool_fill( imgtool_ctx *ctx, uint32_t argb )
+{
+	struct imgtool_conf conf = ctx->conf;
+
+	conf.fill_color = argb;
+	return FillRGB( &conf );
+}
+
+int imgtool_fill_rects( imgtool_ctx *ctx, const struct imgtool_rect *rects, int count )
+{
+	struct imgtool_conf conf = ctx->conf;
+
+	conf.rects = rects;
+	conf.nrects = count;
+	return FillRects( &conf );
+}
+
+static int CaptureFormat( struct imgtool_conf *conf, enum imgtool_format fmt )
+{
+	if (fmt == IMGTOOL_FMT_JPEG)
+		return CaptureJpeg( conf );
+#ifndef NO_PNG
+	if (fmt == IMGTOOL_FMT_PNG)
+		return CapturePng( conf );
+#endif
+	if (fmt == IMGTOOL_FMT_RAW || fmt == IMGTOOL_FMT_RAW_HEADER)
+		return CaptureRaw( conf, fmt == IMGTOOL_FMT_RAW_HEADER );
+	fprintf( stderr, "Error: unsupported capture format %d\n", (int)fmt );
+	return -1;
+}
+
+int imgtool_capture_file( imgtool_ctx *ctx, const char *path, enum imgtool_format fmt )
+{
+	struct imgtool_conf conf = ctx->conf;
+
+	strncpy( conf.filename, path, sizeof(conf.filename) - 1 );
+	return CaptureFormat( &conf, fmt );
+}
+
+int imgtool_capture_mem( imgtool_ctx *ctx, enum imgtool_format fmt, void **data, size_t *size )
+{
+	struct imgtool_conf conf = ctx->conf;
+	char *buf = NULL;
+	size_t len = 0;
+	int ret;
+
+	if (!(conf.output_stream = open_memstream( &buf, &len )))
+		return -1;
+	strncpy( conf.filename, "<memory>", sizeof(conf.filename) - 1 );
+	ret = CaptureFormat( &conf, fmt );
+	fclose( conf.output_stream );
+	if (ret)
+	{
+		free( buf );
+		return ret;
+	}
+	*data = buf;
+	*size = len;
+	return 0;
+}
+
+
+///////////////////////// batch conversion ////////////////////////
+
+// Batch conversion (--mode=batch). Every image in a directory, or named in a
+// list file, is drawn into a worker's own stand-in frame buffer with the
+// configured geometry and bit format, then written to --outdir either as the
+// raw frame buffer contents or re-encoded as jpg/png.
+// Jobs are sorted largest first and dealt round-robin onto per-worker queues.
+// A worker takes from the front of its own queue and, once that runs dry,
+// steals from the back of the others', so a few large files cannot leave
+// the remaining cores idle.
+
+enum batch_output {
+	BATCH_RAW,
+	BATCH_JPEG,
+	BATCH_PNG,
+};
+
+struct batch_job {
+	char *path;
+	char *out;			// Output file, set by BatchOutputNames()
+	off_t size;
+};
+
+struct batch_state;
+
+struct batch_worker {
+	pthread_t thread;
+	int id;
+	struct batch_state *batch;
+	imgtool_ctx *ctx;
+	int fb_fd;
+
+	pthread_mutex_t lock;		// Guards queue, head and tail
+	unsigned int *queue;		// Job indices
+	unsigned int head, tail;
+
+	// Written by the owning worker only; read without locking for progress
+	unsigned int done, failed, skipped, steals;
+	uint64_t bytes_in, bytes_out;
+} __attribute__((aligned(64)));
+
+struct batch_state {
+	struct imgtool_conf *conf;
+	enum batch_output output;
+	const char *ext;
+	struct batch_job *jobs;
+	unsigned int njobs, jobs_alloc;
+	struct batch_worker *workers;
+	int nworkers;
+
+	pthread_mutex_t lock;		// Guards running
+	pthread_cond_t cond;
+	int running;
+};
+
+static int BatchAddJob( struct batch_state *b, const char *path )
+{
+	struct stat st;
+
+	if (stat( path, &st ) == -1 || !S_ISREG( st.st_mode ))
+	{
+		fprintf( stderr, "Warning: skipping %s, not a regular file\n", path );
+		return 0;
+	}
+	if (b->njobs == b->jobs_alloc)
+	{
+		unsigned int n = b->jobs_alloc ? b->jobs_alloc * 2 : 256;
+		struct batch_job *jobs = (struct batch_job *)realloc( b->jobs, n * sizeof(*jobs) );
+		if (!jobs)
+			return -1;
+		b->jobs = jobs;
+		b->jobs_alloc = n;
+	}
+	if (!(b->jobs[b->njobs].path = strdup( path )))
+		return -1;
+	b->jobs[b->njobs].out = NULL;
+	b->jobs[b->njobs].size = st.st_size;
+	b->njobs++;
+	return 0;
+}
+
+// Collect jobs from a directory (not recursive, dot files skipped) or from a
+// list file with one path per line ("-" reads the list from stdin)
+static int BatchList( struct batch_state *b, const char *source )
+{
+	struct stat st;
+	char path[2048];
+	int ret = 0;
+
+	if (strcmp( source, "-" ) && stat( source, &st ) == 0 && S_ISDIR( st.st_mode ))
+	{
+		DIR *dir = opendir( source );
+		struct dirent *de;
+
+		if (!dir)
+		{
+			fprintf( stderr, "Error: cannot read directory %s, errno=%d (%s)\n", source, errno, strerror(errno) );
+			return -1;
+		}
+		while (ret == 0 && (de = readdir( dir )))
+		{
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf( path, sizeof(path), "%s/%s", source, de->d_name );
+			ret = BatchAddJob( b, path );
+		}
+		closedir( dir );
+	}
+	else
+	{
+		FILE *f = strcmp( source, "-" ) ? fopen( source, "r" ) : stdin;
+
+		if (!f)
+		{
+			fprintf( stderr, "Error: cannot open list %s, errno=%d (%s)\n", source, errno, strerror(errno) );
+			return -1;
+		}
+		while (ret == 0 && fgets( path, sizeof(path), f ))
+		{
+			path[strcspn( path, "\r\n" )] = '\0';
+			if (path[0] && path[0] != '#')
+				ret = BatchAddJob( b, path );
+		}
+		if (f != stdin)
+			fclose( f );
+	}
+	if (ret)
+		fprintf( stderr, "Error: out of memory listing %s\n", source );
+	return ret;
+}
+
+// Output path for an input: its base name in --outdir with the extension
+// replaced, or with the extension kept (a.png.raw) when keep_ext is set
+static char *BatchOutputName( struct batch_state *b, const char *path, int keep_ext )
+{
+	char name[sizeof(((struct imgtool_conf *)0)->filename)];
+	const char *base, *dot;
+	int len;
+
+	base = strrchr( path, '/' );
+	base = base ? base + 1 : path;
+	dot = strrchr( base, '.' );
+	len = keep_ext || !dot || dot == base ? (int)strlen( base ) : (int)(dot - base);
+	if (snprintf( name, sizeof(name), "%s/%.*s.%s", b->conf->outdir, len, base, b->ext ) >= (int)sizeof(name))
+	{
+		fprintf( stderr, "Error: output path for %s is too long\n", path );
+		return NULL;
+	}
+	return strdup( name );
+}
+
+static int BatchCompareOut( const void *a, const void *b )
+{
+	return strcmp( ((const struct batch_job *)a)->out, ((const struct batch_job *)b)->out );
+}
+
+// Name every output before the workers start. Inputs that differ only in
+// extension (a.png, a.jpg) keep it in their output name; inputs with the
+// same base name from different directories cannot be told apart in one
+// --outdir and fail the batch rather than overwrite each other.
+static int BatchOutputNames( struct batch_state *b )
+{
+	unsigned int n, m;
+	int clash;
+
+	for (n = 0; n < b->njobs; n++)
+		if (!(b->jobs[n].out = BatchOutputName( b, b->jobs[n].path, 0 )))
+			return -1;
+	qsort( b->jobs, b->njobs, sizeof(*b->jobs), BatchCompareOut );
+	for (n = 0; n < b->njobs; n = m)
+	{
+		for (m = n + 1; m < b->njobs && !strcmp( b->jobs[m].out, b->jobs[n].out ); m++)
+			;
+		for (clash = m - n > 1; clash && n < m; n++)
+		{
+			free( b->jobs[n].out );
+			if (!(b->jobs[n].out = BatchOutputName( b, b->jobs[n].path, 1 )))
+				return -1;
+		}
+	}
+	qsort( b->jobs, b->njobs, sizeof(*b->jobs), BatchCompareOut );
+	for (n = 1; n < b->njobs; n++)
+		if (!strcmp( b->jobs[n].out, b->jobs[n - 1].out ))
+		{
+			fprintf( stderr, "Error: %s and %s would both be written to %s\n",
+				b->jobs[n - 1].path, b->jobs[n].path, b->jobs[n].out );
+			return -1;
+		}
+	return 0;
+}
+
+static int BatchCompareSize( const void *a, const void *b )
+{
+	off_t sa = ((const struct batch_job *)a)->size;
+	off_t sb = ((const struct batch_job *)b)->size;
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+// Next job for worker w: its own oldest, else the newest of another worker's.
+// Returns -1 once every queue is empty; nothing is queued after startup.
+static int BatchNext( struct batch_worker *w )
+{
+	struct batch_state *b = w->batch;
+	int job = -1;
+	int n;
+
+	pthread_mutex_lock( &w->lock );
+	if (w->head < w->tail)
+		job = w->queue[w->head++];
+	pthread_mutex_unlock( &w->lock );
+
+	for (n = 1; job < 0 && n < b->nworkers; n++)
+	{
+		struct batch_worker *victim = &b->workers[(w->id + n) % b->nworkers];
+
+		pthread_mutex_lock( &victim->lock );
+		if (victim->head < victim->tail)
+			job = victim->queue[--victim->tail];
+		pthread_mutex_unlock( &victim->lock );
+		if (job >= 0)
+			__sync_fetch_and_add( &w->steals, 1 );
+	}
+	return job;
+}
+
+static int BatchWriteRaw( const char *path, const unsigned char *data, size_t size )
+{
+	int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	size_t done = 0;
+	ssize_t n;
+
+	if (fd < 0)
+	{
+		fprintf( stderr, "Error: cannot create %s, errno=%d (%s)\n", path, errno, strerror(errno) );
+		return -1;
+	}
+	while (done < size)
+	{
+		n = write( fd, data + done, size - done );
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			fprintf( stderr, "Error: write to %s failed, errno=%d (%s)\n", path, errno, strerror(errno) );
+			close( fd );
+			return -1;
+		}
+		done += n;
+	}
+	return close( fd );
+}
+
+static void BatchConvert( struct batch_worker *w, struct batch_job *job )
+{
+	struct batch_state *b = w->batch;
+	struct imgtool_conf conf = w->ctx->conf;
+	struct img_input in;
+	struct stat st;
+	int ret;
+
+	if (InputOpen( &in, job->path ))
+	{
+		__sync_fetch_and_add( &w->failed, 1 );
+		return;
+	}
+	if (in.format == INPUT_UNKNOWN)
+	{
+		InputClose( &in );
+		__sync_fetch_and_add( &w->skipped, 1 );
+		return;
+	}
+
+	strcpy( conf.filename, job->out );
+
+	// Images smaller than the panel must not show the previous file
+	memset( w->ctx->fb.mem, 0, w->ctx->fb.size );
+	ret = ShowInput( &conf, &in );
+	InputClose( &in );
+
+	if (ret == 0)
+	{
+		if (b->output == BATCH_RAW)
+			ret = BatchWriteRaw( conf.filename, w->ctx->fb.mem, w->ctx->fb.size );
+		else
+			ret = CaptureFormat( &conf, b->output == BATCH_PNG ? IMGTOOL_FMT_PNG : IMGTOOL_FMT_JPEG );
+	}
+	if (ret)
+	{
+		fprintf( stderr, "Error: %s: conversion failed\n", job->path );
+		__sync_fetch_and_add( &w->failed, 1 );
+		return;
+	}
+	if (stat( conf.filename, &st ) == 0)
+		__sync_fetch_and_add( &w->bytes_out, (uint64_t)st.st_size );
+	__sync_fetch_and_add( &w->bytes_in, (uint64_t)job->size );
+	__sync_fetch_and_add( &w->done, 1 );
+}
+
+static void *BatchWorker( void *arg )
+{
+	struct batch_worker *w = (struct batch_worker *)arg;
+	struct batch_state *b = w->batch;
+	int job;
+
+	while ((job = BatchNext( w )) >= 0)
+		BatchConvert( w, &b->jobs[job] );
+
+	pthread_mutex_lock( &b->lock );
+	b->running--;
+	pthread_cond_signal( &b->cond );
+	pthread_mutex_unlock( &b->lock );
+	return NULL;
+}
+
+// Each worker owns a context over its own anonymous frame buffer, so decoder
+// state, arena and mapping are reused from one file to the next
+static int BatchWorkerInit( struct batch_worker *w, struct imgtool_conf *base )
+{
+	struct imgtool_conf conf = *base;
+	struct imgtool_geometry geom;
+	struct imgtool_conf *c;
+
+	if ((w->fb_fd = AnonFB( &conf )) < 0)
+		return -1;
+	geom.width = conf.width;
+	geom.height = conf.height;
+	geom.stride = conf.stride;
+	geom.fmt = (enum imgtool_bitfmt)conf.fmt;
+	geom.fmt_given = 1;
+	if (!(w->ctx = imgtool_open( conf.output, &geom )) || !w->ctx->conf.fb)
+	{
+		fprintf( stderr, "Error: cannot map batch frame buffer %s\n", conf.output );
+		return -1;
+	}
+	c = &w->ctx->conf;
+	c->gamma = base->gamma;
+	c->resize_options = base->resize_options;
+	c->mirror_h = base->mirror_h;
+	c->jpeg_quality = base->jpeg_quality;
+	c->jpeg_scans = base->jpeg_scans;
+	c->crop = base->crop;
+	c->crop_x = base->crop_x;
+	c->crop_y = base->crop_y;
+	c->crop_w = base->crop_w;
+	c->crop_h = base->crop_h;
+	c->debug_level = base->debug_level;
+	return 0;
+}
+
+static void BatchReport( struct batch_state *b, uint64_t start_ns, int final )
+{
+	struct imgtool_conf *conf = b->conf;
+	unsigned int done = 0, failed = 0, skipped = 0, steals = 0, finished;
+	uint64_t bytes_in = 0, bytes_out = 0;
+	double secs = (StatsNow() - start_ns) / 1e9;
+	int n;
+
+	for (n = 0; n < b->nworkers; n++)
+	{
+		struct batch_worker *w = &b->workers[n];
+		done += __atomic_load_n( &w->done, __ATOMIC_RELAXED );
+		failed += __atomic_load_n( &w->failed, __ATOMIC_RELAXED );
+		skipped += __atomic_load_n( &w->skipped, __ATOMIC_RELAXED );
+		steals += __atomic_load_n( &w->steals, __ATOMIC_RELAXED );
+		bytes_in += __atomic_load_n( &w->bytes_in, __ATOMIC_RELAXED );
+		bytes_out += __atomic_load_n( &w->bytes_out, __ATOMIC_RELAXED );
+	}
+	finished = done + failed + skipped;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	if (!final)
+	{
+		PROGRESS( conf, "batch: %u/%u files (%u%%), %.1f files/s, %.1f MB/s in\n",
+			finished, b->njobs, b->njobs ? finished * 100 / b->njobs : 100,
+			finished / secs, bytes_in / secs / 1e6 );
+		return;
+	}
+
+	fprintf( stderr, "batch: %u files in %.3f s on %d workers: %u converted, %u failed, %u skipped\n",
+		b->njobs, secs, b->nworkers, done, failed, skipped );
+	fprintf( stderr, "batch: %.1f files/s, %.1f MB/s in, %.1f MB/s out, %.1f Mpx/s, %u steals\n",
+		done / secs, bytes_in / secs / 1e6, bytes_out / secs / 1e6,
+		(double)done * conf->width * conf->height / secs / 1e6, steals );
+	if (conf->debug_level > 0)
+		for (n = 0; n < b->nworkers; n++)
+			fprintf( stderr, "batch: worker %2d: %u files, %u failed, %u steals, %.1f MB in\n",
+				n, b->workers[n].done, b->workers[n].failed, b->workers[n].steals,
+				b->workers[n].bytes_in / 1e6 );
+}
+
+// Convert everything named by conf->filename into conf->outdir
+int RunBatch( struct imgtool_conf *conf )
+{
+	struct batch_state batch;
+	struct batch_state *b = &batch;
+	struct timespec deadline;
+	uint64_t start_ns = StatsNow();
+	unsigned int job;
+	int n, started = 0, ret = -1;
+
+	memset( b, 0, sizeof(*b) );
+	b->conf = conf;
+	if (!strcmp( conf->output_format, "raw" ))
+		b->output = BATCH_RAW, b->ext = "raw";
+	else if (!strcmp( conf->output_format, "jpg" ))
+		b->output = BATCH_JPEG, b->ext = "jpg";
+#ifndef NO_PNG
+	else if (!strcmp( conf->output_format, "png" ))
+		b->output = BATCH_PNG, b->ext = "png";
+#endif
+	else
+	{
+		fprintf( stderr, "Error: unsupported batch format %s - use raw, jpg or png\n", conf->output_format );
+		return -1;
+	}
+	if (!conf->outdir[0] || !conf->width || !conf->height)
+	{
+		fprintf( stderr, "Error: batch mode needs --outdir and a --width/--height geometry\n" );
+		return -1;
+	}
+	if (mkdir( conf->outdir, 0755 ) == -1 && errno != EEXIST)
+	{
+		fprintf( stderr, "Error: cannot create %s, errno=%d (%s)\n", conf->outdir, errno, strerror(errno) );
+		return -1;
+	}
+
+	if (BatchList( b, conf->filename ) || BatchOutputNames( b ))
+		goto out;
+	qsort( b->jobs, b->njobs, sizeof(*b->jobs), BatchCompareSize );
+
+	b->nworkers = conf->jobs > 0 ? conf->jobs : (int)sysconf( _SC_NPROCESSORS_ONLN );
+	if (b->nworkers < 1)
+		b->nworkers = 1;
+	if ((unsigned int)b->nworkers > b->njobs)
+		b->nworkers = b->njobs ? b->njobs : 1;
+	if (posix_memalign( (void **)&b->workers, 64, b->nworkers * sizeof(*b->workers) ))
+		goto out;
+	memset( b->workers, 0, b->nworkers * sizeof(*b->workers) );
+	for (n = 0; n < b->nworkers; n++)
+	{
+		b->workers[n].id = n;
+		b->workers[n].batch = b;
+		b->workers[n].fb_fd = -1;
+		pthread_mutex_init( &b->workers[n].lock, NULL );
+	}
+	for (n = 0; n < b->nworkers; n++)
+	{
+		struct batch_worker *w = &b->workers[n];
+		if (!(w->queue = (unsigned int *)malloc( (b->njobs / b->nworkers + 1) * sizeof(*w->queue) )) ||
+			BatchWorkerInit( w, conf ))
+			goto out;
+	}
+	for (job = 0; job < b->njobs; job++)
+	{
+		struct batch_worker *w = &b->workers[job % b->nworkers];
+		w->queue[w->tail++] = job;
+	}
+
+	PROGRESS( conf, "batch: %u files to %s (%ux%u %s, %s) on %d workers\n", b->njobs, conf->outdir,
+		conf->width, conf->height, bit_format_names[conf->fmt], b->ext, b->nworkers );
+	pthread_mutex_init( &b->lock, NULL );
+	pthread_cond_init( &b->cond, NULL );
+	b->running = b->nworkers;
+	for (started = 0; started < b->nworkers; started++)
+		if (pthread_create( &b->workers[started].thread, NULL, BatchWorker, &b->workers[started] ))
+		{
+			fprintf( stderr, "Error: cannot start worker %d, errno=%d (%s)\n", started, errno, strerror(errno) );
+			break;
+		}
+
+	// Progress once a second until the workers drain every queue. Workers
+	// that failed to start leave their queues to be stolen by the others.
+	pthread_mutex_lock( &b->lock );
+	b->running -= b->nworkers - started;
+	while (b->running > 0)
+	{
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec++;
+		if (pthread_cond_timedwait( &b->cond, &b->lock, &deadline ) == ETIMEDOUT)
+		{
+			pthread_mutex_unlock( &b->lock );
+			BatchReport( b, start_ns, 0 );
+			pthread_mutex_lock( &b->lock );
+		}
+	}
+	pthread_mutex_unlock( &b->lock );
+	for (n = 0; n < started; n++)
+		pthread_join( b->workers[n].thread, NULL );
+	pthread_cond_destroy( &b->cond );
+	pthread_mutex_destroy( &b->lock );
+
+	if (started)
+	{
+		BatchReport( b, start_ns, 1 );
+		ret = 0;
+		for (n = 0; n < b->nworkers; n++)
+			if (b->workers[n].failed)
+				ret = -1;
+	}
+
+out:
+	for (n = 0; b->workers && n < b->nworkers; n++)
+	{
+		imgtool_close( b->workers[n].ctx );
+		if (b->workers[n].fb_fd >= 0)
+			close( b->workers[n].fb_fd );
+		free( b->workers[n].queue );
+		pthread_mutex_destroy( &b->workers[n].lock );
+	}
+	free( b->workers );
+	for (job = 0; job < b->njobs; job++)
+	{
+		free( b->jobs[job].path );
+		free( b->jobs[job].out );
+	}
+	free( b->jobs );
+	return ret;
+}
+
+///////////////////////// sequences ////////////////////////
+
+// Bake (--mode=bake): draw each frame named by conf->filename, in order,
+// into an anonymous frame buffer with the usual decoders and store it in a
+// frame sequence (IMGTOOL_SEQ_MAGIC) at conf->seq. Key frames are stored
+// whole; other frames as bands of changed rows, each narrowed to the
+// columns that changed.
+
+static int BakeComparePath( const void *a, const void *b )
+{
+	return strcmp( ((const struct batch_job *)a)->path, ((const struct batch_job *)b)->path );
+}
+
+// Columns [*x0, *x1) widened to take in the bytes that differ between two rows
+static void BakeRowDiff( const unsigned char *a, const unsigned char *b, size_t len, unsigned int bpp,
+	unsigned int *x0, unsigned int *x1 )
+{
+	size_t l = 0, r = len;
+
+	while (l < r && a[l] == b[l])
+		l++;
+	while (r > l && a[r - 1] == b[r - 1])
+		r--;
+	if (l / bpp < *x0)
+		*x0 = l / bpp;
+	if ((r + bpp - 1) / bpp > *x1)
+		*x1 = (r + bpp - 1) / bpp;
+}
+
+static int BakeRect( FILE *f, uint64_t *off, const struct fb_dev *fb, unsigned int x, unsigned int y,
+	unsigned int w, unsigned int h )
+{
+	struct imgtool_seq_rect r;
+	unsigned int bpp = BytesPerFBPixel(fb->fmt), row;
+
+	r.x = htole32( x );
+	r.y = htole32( y );
+	r.w = htole32( w );
+	r.h = htole32( h );
+	if (fwrite( &r, sizeof(r), 1, f ) != 1)
+		return -1;
+	for (row = y; row < y + h; row++)
+		if (w && fwrite( fb->mem + (size_t)row * fb->stride + (size_t)x * bpp, (size_t)w * bpp, 1, f ) != 1)
+			return -1;
+	*off += sizeof(r) + (uint64_t)w * h * bpp;
+	return 0;
+}
+
+int BakeSequence( struct imgtool_conf *conf )
+{
+	struct batch_state batch;
+	struct batch_worker w;
+	struct imgtool_seq_header hdr;
+	struct imgtool_seq_frame *index = NULL;
+	struct img_input in;
+	struct imgtool_conf frame_conf;
+	struct fb_dev *fb;
+	struct stat st;
+	unsigned char *prev = NULL;
+	FILE *f = NULL;
+	uint64_t off, full = 0;
+	unsigned int job, y, y1, x0, x1, nrects, keys = 0, bpp;
+	int ret = -1, key, created = 0;
+
+	memset( &batch, 0, sizeof(batch) );
+	memset( &w, 0, sizeof(w) );
+	w.fb_fd = -1;
+	batch.conf = conf;
+	if (!conf->seq[0] || !conf->width || !conf->height)
+	{
+		fprintf( stderr, "Error: bake mode needs --seq and a --width/--height geometry\n" );
+		return -1;
+	}
+	if (BatchList( &batch, conf->filename ))
+		goto out;
+	if (!batch.njobs)
+	{
+		fprintf( stderr, "Error: no frames in %s\n", conf->filename );
+		goto out;
+	}
+	// Directory entries come in no particular order: frames go by name
+	if (stat( conf->filename, &st ) == 0 && S_ISDIR( st.st_mode ))
+		qsort( batch.jobs, batch.njobs, sizeof(*batch.jobs), BakeComparePath );
+
+	if (BatchWorkerInit( &w, conf ))
+		goto out;
+	fb = &w.ctx->fb;
+	bpp = BytesPerFBPixel(fb->fmt);
+	prev = (unsigned char *)malloc( (size_t)fb->row_bytes * fb->height );
+	index = (struct imgtool_seq_frame *)calloc( batch.njobs, sizeof(*index) );
+	if (!prev || !index)
+	{
+		fprintf( stderr, "Error: out of memory baking %u frames\n", batch.njobs );
+		goto out;
+	}
+	if (!(f = fopen( conf->seq, "wb" )))
+	{
+		fprintf( stderr, "Error: cannot create %s, errno=%d (%s)\n", conf->seq, errno, strerror(errno) );
+		goto out;
+	}
+	created = 1;
+	setvbuf( f, NULL, _IOFBF, INPUT_BUFFER_SIZE );
+	memset( &hdr, 0, sizeof(hdr) );
+	if (fwrite( &hdr, sizeof(hdr), 1, f ) != 1)
+		goto write_error;
+	off = sizeof(hdr);
+
+	PROGRESS( conf, "Baking %u frames to %s (%ux%u %s)\n", batch.njobs, conf->seq,
+		fb->width, fb->height, bit_format_names[fb->fmt] );
+	for (job = 0; job < batch.njobs; job++)
+	{
+		frame_conf = w.ctx->conf;
+		if (InputOpen( &in, batch.jobs[job].path ))
+			goto out;
+		memset( fb->mem, 0, fb->size );
+		ret = ShowInput( &frame_conf, &in );
+		InputClose( &in );
+		if (ret)
+		{
+			fprintf( stderr, "Error: %s: cannot draw frame %u\n", batch.jobs[job].path, job );
+			ret = -1;
+			goto out;
+		}
+		ret = -1;
+
+		key = job == 0 || (conf->keyframes > 0 && job % conf->keyframes == 0);
+		index[job].offset = htole64( off );
+		index[job].flags = htole32( key ? IMGTOOL_SEQ_KEY : 0 );
+		nrects = 0;
+		if (key)
+		{
+			if (BakeRect( f, &off, fb, 0, 0, fb->width, fb->height ))
+				goto write_error;
+			nrects = 1;
+			keys++;
+		}
+		for (y = 0; !key && y < fb->height; y = y1)
+		{
+			// Next band of rows that changed
+			if (!memcmp( prev + (size_t)y * fb->row_bytes, fb->mem + (size_t)y * fb->stride, fb->row_bytes ))
+			{
+				y1 = y + 1;
+				continue;
+			}
+			x0 = fb->width;
+			x1 = 0;
+			for (y1 = y; y1 < fb->height &&
+				memcmp( prev + (size_t)y1 * fb->row_bytes, fb->mem + (size_t)y1 * fb->stride, fb->row_bytes ); y1++)
+				BakeRowDiff( prev + (size_t)y1 * fb->row_bytes, fb->mem + (size_t)y1 * fb->stride,
+					fb->row_bytes, bpp, &x0, &x1 );
+			if (BakeRect( f, &off, fb, x0, y, x1 - x0, y1 - y ))
+				goto write_error;
+			nrects++;
+		}
+		index[job].rects = htole32( nrects );
+		for (y = 0; y < fb->height; y++)
+			memcpy( prev + (size_t)y * fb->row_bytes, fb->mem + (size_t)y * fb->stride, fb->row_bytes );
+		full += sizeof(struct imgtool_seq_rect) + (uint64_t)fb->row_bytes * fb->height;
+		if (conf->debug_level > 0)
+			fprintf( stderr, "%s: frame %u, %u rectangle%s%s\n", batch.jobs[job].path, job,
+				nrects, nrects == 1 ? "" : "s", key ? " (key)" : "" );
+	}
+
+	// Index after the frames, 8 byte aligned so it can be used in place
+	while (off & 7)
+	{
+		if (fputc( 0, f ) == EOF)
+			goto write_error;
+		off++;
+	}
+	if (fwrite( index, sizeof(*index), batch.njobs, f ) != batch.njobs)
+		goto write_error;
+
+	memcpy( hdr.raw.magic, IMGTOOL_SEQ_MAGIC, sizeof(hdr.raw.magic) );
+	hdr.raw.header_size = htole32( sizeof(hdr) );
+	hdr.raw.width = htole32( fb->width );
+	hdr.raw.height = htole32( fb->height );
+	hdr.raw.stride = htole32( fb->row_bytes );
+	hdr.raw.format = htole32( fb->fmt );
+	hdr.frames = htole32( batch.njobs );
+	hdr.frame_ns = htole32( 1000000000U / (conf->fps > 0 ? conf->fps : ANIM_DEFAULT_FPS) );
+	hdr.loops = htole32( conf->loops < 0 ? 0 : conf->loops > 0 ? conf->loops : 1 );
+	hdr.index = htole64( off );
+	if (fseek( f, 0, SEEK_SET ) || fwrite( &hdr, sizeof(hdr), 1, f ) != 1)
+		goto write_error;
+	ret = fclose( f );
+	f = NULL;
+	if (ret)
+		goto write_error;
+
+	off += batch.njobs * sizeof(*index);
+	PROGRESS( conf, "Baked %u frames (%u key) into %llu bytes, %.1f%% of whole frames\n",
+		batch.njobs, keys, (unsigned long long)off, full ? off * 100.0 / full : 0.0 );
+	ret = 0;
+	goto out;
+
+write_error:
+	fprintf( stderr, "Error: failed writing %s, errno=%d (%s)\n", conf->seq, errno, strerror(errno) );
+	ret = -1;
+out:
+	if (f)
+		fclose( f );
+	if (ret && created)
+		unlink( conf->seq );
+	imgtool_close( w.ctx );
+	if (w.fb_fd >= 0)
+		close( w.fb_fd );
+	free( prev );
+	free( index );
+	for (job = 0; job < batch.njobs; job++)
+		free( batch.jobs[job].path );
+	free( batch.jobs );
+	return ret;
+}
+
+// Pyramid bake (--mode=pyramid): draw the image at full size into an
+// anonymous frame buffer with the usual decoders, then write its tiles and
+// those of every halving, each level box filtered 2x2 from the one before,
+// to conf->seq. Halved levels are kept as RGB888, so 16 bit formats do not
+// lose precision level by level; for JPEG tiles level 0 is drawn in rgb888
+// for the same reason.
+#ifndef NO_PNG
+
+// Pixels of the level being written: level 0 in frame buffer format, the
+// halvings RGB888
+struct pyr_src {
+	const unsigned char *mem;
+	size_t stride;
+	int native;
+};
+
+// w pixels at x,y of a level, in frame buffer format or as RGB888
+static const unsigned char *PyrBakeRow( struct imgtool_conf *tconf, const struct pyr_src *s, unsigned int x,
+	unsigned int y, unsigned int w, int native, unsigned char *buf )
+{
+	const unsigned char *p = s->mem + y * s->stride + (size_t)x * (s->native ? BytesPerFBPixel(tconf->fmt) : 3);
+
+	// The converters clip to, and clear, conf->width pixels
+	tconf->width = w;
+	if (s->native == native)
+		return p;
+	if (native)
+		RGB8toFBPng( tconf, buf, p, w, 0, NULL );
+	else
+		FBtoRGB888( tconf, buf, p, w );
+	return buf;
+}
+
+// The level after s, which is w x h, as RGB888 with a spare byte at the end
+// (the ARGB converter reads a pixel's fourth byte)
+static unsigned char *PyrHalve( struct imgtool_conf *tconf, const struct pyr_src *s, unsigned int w, unsigned int h,
+	unsigned char *buf0, unsigned char *buf1 )
+{
+	unsigned int w2 = (w + 1) / 2, h2 = (h + 1) / 2, x, y, c, xb;
+	const unsigned char *a, *b;
+	unsigned char *out, *d;
+
+	if (!(out = (unsigned char *)malloc( (size_t)w2 * h2 * 3 + 1 )))
+		return NULL;
+	for (y = 0, d = out; y < h2; y++)
+	{
+		// An odd last row or column is averaged with itself
+		a = PyrBakeRow( tconf, s, 0, 2 * y, w, 0, buf0 );
+		b = PyrBakeRow( tconf, s, 0, 2 * y + 1 < h ? 2 * y + 1 : 2 * y, w, 0, buf1 );
+		for (x = 0; x < w2; x++, d += 3)
+		{
+			xb = 2 * x + 1 < w ? 6 * x + 3 : 6 * x;
+			for (c = 0; c < 3; c++)
+				d[c] = (a[6 * x + c] + a[xb + c] + b[6 * x + c] + b[xb + c] + 2) >> 2;
+		}
+	}
+	*d = 0;
+	return out;
+}
+
+static int PyrBakeJpeg( struct jpeg_compress_struct *cinfo, struct jpeg_jmp_error *jerr, FILE *f,
+	struct imgtool_conf *tconf, const struct pyr_src *s, unsigned int x, unsigned int y, unsigned int w,
+	unsigned int h, unsigned char *buf )
+{
+	JSAMPROW row;
+	unsigned int r;
+
+	if (setjmp( jerr->jmp ))
+	{
+		jpeg_abort_compress( cinfo );
+		return -1;
+	}
+	cinfo->image_width = w;
+	cinfo->image_height = h;
+	jpeg_stdio_dest( cinfo, f );
+	jpeg_start_compress( cinfo, TRUE );
+	for (r = 0; r < h; r++)
+	{
+		row = (JSAMPROW)PyrBakeRow( tconf, s, x, y + r, w, 0, buf );
+		(void) jpeg_write_scanlines( cinfo, &row, 1 );
+	}
+	jpeg_finish_compress( cinfo );
+	return 0;
+}
+
+int BakePyramid( struct imgtool_conf *conf )
+{
+	struct imgtool_conf base = *conf, tconf, draw_conf;
+	struct batch_worker w;
+	struct imgtool_pyr_header hdr;
+	struct imgtool_pyr_level lv[PYR_MAX_LEVELS];
+	struct imgtool_pyr_tile *tiles[PYR_MAX_LEVELS];
+	unsigned int lw[PYR_MAX_LEVELS], lh[PYR_MAX_LEVELS];
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_jmp_error jerr;
+	struct img_input in;
+	struct pyr_src s;
+	unsigned char *level = NULL, *next = NULL, *buf0 = NULL, *buf1 = NULL;
+	const unsigned char *p;
+	unsigned int tile = conf->tile ? conf->tile : PYR_DEFAULT_TILE, levels, n, col, row, tx, ty, tw, th, r, bpp;
+	unsigned int ntiles = 0;
+	struct imgtool_pyr_tile *t;
+	uint64_t off, start;
+	int ret = -1, jpeg, created = 0, cinfo_ready = 0;
+	FILE *f = NULL;
+
+	memset( &w, 0, sizeof(w) );
+	memset( tiles, 0, sizeof(tiles) );
+	w.fb_fd = -1;
+	jpeg = !strcmp( conf->output_format, "jpg" );
+	if (!jpeg && strcmp( conf->output_format, "raw" ))
+	{
+		fprintf( stderr, "Error: pyramid tiles are jpg or raw, not %s\n", conf->output_format );
+		return -1;
+	}
+	if (!conf->seq[0])
+	{
+		fprintf( stderr, "Error: pyramid mode needs --seq\n" );
+		return -1;
+	}
+
+	// Full size: the image's own
+	if (InputOpen( &in, conf->filename ))
+		return -1;
+	if (!in.map)
+	{
+		fprintf( stderr, "Error: %s: pyramids are baked from a file, not a pipe\n", in.name );
+		InputClose( &in );
+		return -1;
+	}
+	if (!(in.format == INPUT_PNG && InputPngSize( &in, &lw[0], &lh[0] ) == 0) &&
+		!(in.format == INPUT_JPEG && JpegFrameSize( in.map, in.map_size, &lw[0], &lh[0] ) == 0))
+	{
+		fprintf( stderr, "Error: %s: no image size in this %s file\n", in.name, input_format_names[in.format] );
+		InputClose( &in );
+		return -1;
+	}
+	for (levels = 1; (lw[levels - 1] > tile || lh[levels - 1] > tile) && levels < PYR_MAX_LEVELS; levels++)
+	{
+		lw[levels] = (lw[levels - 1] + 1) / 2;
+		lh[levels] = (lh[levels - 1] + 1) / 2;
+	}
+
+	base.width = lw[0];
+	base.height = lh[0];
+	base.stride = 0;
+	if (jpeg)
+		base.fmt = BF_RGB888;
+	base.mirror_h = 0;
+	base.crop = 0;
+	base.resize_options = 0;
+	base.jpeg_scans = 0;
+	if (BatchWorkerInit( &w, &base ))
+	{
+		InputClose( &in );
+		goto out;
+	}
+	PROGRESS( conf, "Baking %s into %s: %ux%u, %u levels of %u pixel %s tiles\n", in.name, conf->seq,
+		lw[0], lh[0], levels, tile, jpeg ? "jpeg" : bit_format_names[base.fmt] );
+	// Every level is made from level 0: a draw that comes up short fails
+	// here rather than leaving a black edge in each level
+	draw_conf = w.ctx->conf;
+	draw_conf.stats = conf->stats;
+	ret = ShowInput( &draw_conf, &in );
+	InputClose( &in );
+	if (ret)
+	{
+		fprintf( stderr, "Error: %s: cannot draw the image\n", conf->filename );
+		ret = -1;
+		goto out;
+	}
+	ret = -1;
+	tconf = w.ctx->conf;
+	tconf.resize = 0;
+	bpp = BytesPerFBPixel(tconf.fmt);
+
+	if (jpeg)
+	{
+		cinfo.err = jpeg_jmp_error( &jerr );
+		if (setjmp( jerr.jmp ))
+			goto out;
+		jpeg_create_compress( &cinfo );
+		cinfo_ready = 1;
+		cinfo.in_color_space = JCS_RGB;
+		cinfo.input_components = 3;
+		jpeg_set_defaults( &cinfo );
+		jpeg_set_quality( &cinfo, conf->jpeg_quality, TRUE );
+	}
+	buf0 = (unsigned char *)malloc( (size_t)lw[0] * 4 + 4 );
+	buf1 = (unsigned char *)malloc( (size_t)lw[0] * 4 + 4 );
+	if (!buf0 || !buf1)
+		goto nomem;
+	if (!(f = fopen( conf->seq, "wb" )))
+	{
+		fprintf( stderr, "Error: cannot create %s, errno=%d (%s)\n", conf->seq, errno, strerror(errno) );
+		goto out;
+	}
+	created = 1;
+	setvbuf( f, NULL, _IOFBF, INPUT_BUFFER_SIZE );
+	memset( &hdr, 0, sizeof(hdr) );
+	if (fwrite( &hdr, sizeof(hdr), 1, f ) != 1)
+		goto write_error;
+	off = sizeof(hdr);
+
+	s.mem = w.ctx->fb.mem;
+	s.stride = w.ctx->fb.stride;
+	s.native = 1;
+	for (n = 0; n < levels; n++)
+	{
+		lv[n].width = htole32( lw[n] );
+		lv[n].height = htole32( lh[n] );
+		lv[n].cols = htole32( (lw[n] + tile - 1) / tile );
+		lv[n].rows = htole32( (lh[n] + tile - 1) / tile );
+		if (!(t = tiles[n] = (struct imgtool_pyr_tile *)calloc( (size_t)le32toh( lv[n].cols ) * le32toh( lv[n].rows ), sizeof(*t) )))
+			goto nomem;
+		for (row = 0, ty = 0; ty < lh[n]; row++, ty += tile)
+		{
+			for (col = 0, tx = 0; tx < lw[n]; col++, tx += tile, t++)
+			{
+				tw = lw[n] - tx < tile ? lw[n] - tx : tile;
+				th = lh[n] - ty < tile ? lh[n] - ty : tile;
+				start = off;
+				if (jpeg)
+				{
+					if (PyrBakeJpeg( &cinfo, &jerr, f, &tconf, &s, tx, ty, tw, th, buf0 ))
+						goto out;
+					off = ftello( f );
+					if (off == (uint64_t)-1)
+						goto write_error;
+				}
+				for (r = 0; !jpeg && r < th; r++)
+				{
+					p = PyrBakeRow( &tconf, &s, tx, ty + r, tw, 1, buf0 );
+					if (fwrite( p, (size_t)tw * bpp, 1, f ) != 1)
+						goto write_error;
+					off += (size_t)tw * bpp;
+				}
+				t->offset = htole64( start );
+				t->size = htole32( off - start );
+				ntiles++;
+			}
+		}
+		if (n + 1 < levels && !(next = PyrHalve( &tconf, &s, lw[n], lh[n], buf0, buf1 )))
+			goto nomem;
+
+		// Level 0 is not needed again: let its frame buffer go
+		if (n == 0)
+		{
+			imgtool_close( w.ctx );
+			w.ctx = NULL;
+			close( w.fb_fd );
+			w.fb_fd = -1;
+		}
+		free( level );
+		level = next;
+		next = NULL;
+		s.mem = level;
+		s.stride = (size_t)lw[n + 1] * 3;
+		s.native = 0;
+		if (conf->debug_level > 0)
+			fprintf( stderr, "%s: level %u, %ux%u\n", conf->seq, n, lw[n], lh[n] );
+	}
+
+	// Tile entries, then level entries after the tiles, 8 byte aligned so
+	// they can be used in place
+	while (off & 7)
+	{
+		if (fputc( 0, f ) == EOF)
+			goto write_error;
+		off++;
+	}
+	for (n = 0; n < levels; n++)
+	{
+		r = le32toh( lv[n].cols ) * le32toh( lv[n].rows );
+		lv[n].tiles = htole64( off );
+		if (fwrite( tiles[n], sizeof(*tiles[n]), r, f ) != r)
+			goto write_error;
+		off += (uint64_t)r * sizeof(*tiles[n]);
+	}
+	if (fwrite( lv, sizeof(*lv), levels, f ) != levels)
+		goto write_error;
+
+	memcpy( hdr.raw.magic, IMGTOOL_PYR_MAGIC, sizeof(hdr.raw.magic) );
+	hdr.raw.header_size = htole32( sizeof(hdr) );
+	hdr.raw.width = htole32( lw[0] );
+	hdr.raw.height = htole32( lh[0] );
+	hdr.raw.format = htole32( tconf.fmt );
+	hdr.tile = htole32( tile );
+	hdr.levels = htole32( levels );
+	hdr.flags = htole32( jpeg ? IMGTOOL_PYR_JPEG : 0 );
+	hdr.index = htole64( off );
+	if (fseek( f, 0, SEEK_SET ) || fwrite( &hdr, sizeof(hdr), 1, f ) != 1)
+		goto write_error;
+	ret = fclose( f );
+	f = NULL;
+	if (ret)
+		goto write_error;
+
+	off += levels * sizeof(*lv);
+	PROGRESS( conf, "Baked %u tiles into %llu bytes\n", ntiles, (unsigned long long)off );
+	ret = 0;
+	goto out;
+
+nomem:
+	fprintf( stderr, "Error: out of memory baking %s\n", conf->filename );
+	goto out;
+write_error:
+	fprintf( stderr, "Error: failed writing %s, errno=%d (%s)\n", conf->seq, errno, strerror(errno) );
+	ret = -1;
+out:
+	if (f)
+		fclose( f );
+	if (ret && created)
+		unlink( conf->seq );
+	if (cinfo_ready)
+		jpeg_destroy_compress( &cinfo );
+	imgtool_close( w.ctx );
+	if (w.fb_fd >= 0)
+		close( w.fb_fd );
+	for (n = 0; n < PYR_MAX_LEVELS; n++)
+		free( tiles[n] );
+	free( level );
+	free( next );
+	free( buf0 );
+	free( buf1 );
+	return ret;
+}
+#else
+int BakePyramid( struct imgtool_conf *conf )
+{
+	fprintf( stderr, "%s: pyramids not supported (NO_PNG build also does not support jpeg decode)\n", conf->filename );
+	return -1;
+}
+#endif
+
+
+#ifdef IMGTOOL_BENCH
+
+///////////////////////// benchmarks ////////////////////////
+
+#define BENCH_MIN_NS	20000000ULL	// Run each case for at least this long
+#define BENCH_BATCH	16		// Rows converted between clock reads
+#define BENCH_SLACK	64		// Converters may touch a pixel past either end
+
+#define BENCH_MAX_WIDTH	3840
+static const unsigned int bench_widths[] = { 320, 480, 640, 800, 1024, 1280, 1920, 2560, BENCH_MAX_WIDTH, 0 };
+
+// Row converters, grouped by the dispatcher that selects them for a bit format
+enum bench_kind {
+	BENCH_ARGB_TO_FB,	// ARGB8888toFB: fill and bmp draw
+	BENCH_RGB8_TO_FB,	// RGB8toFBPng: png and jpeg draw
+	BENCH_FB_TO_RGB,	// FBtoRGB888: capture
+};
+
+static const char *BenchConverterName( enum bench_kind kind, enum bit_format fmt )
+{
+	static const char *names[3][4] = {
+		{ "ARGB8888toRGB565", "ARGB8888toRGB888", "ARGB8888toRGB565", "ARGB8888toARGB8888" },
+		{ "RGB8toR5G6B5", "RGB8toR8G8B8", "RGB8toR5G6B5", "RGB8toARGB8888" },
+		{ "RGB565toRGB888", "RGB888toRGB888", "RGB565toRGB888", "ARGB8888toRGB888" },
+	};
+	return names[kind][fmt];
+}
+
+// Cycle source: perf_event_open where the kernel permits it, the TSC on x86,
+// otherwise none (cycles reported as 0)
+static const char *bench_cycle_source = "none";
+
+static int BenchCyclesOpen(void)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset( &attr, 0, sizeof(attr) );
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	fd = syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+	if (fd >= 0)
+	{
+		bench_cycle_source = "perf";
+		ioctl( fd, PERF_EVENT_IOC_ENABLE, 0 );
+		return fd;
+	}
+#if defined(__i386__) || defined(__x86_64__)
+	bench_cycle_source = "tsc";
+#endif
+	return -1;
+}
+
+static uint64_t BenchCycles( int fd )
+{
+	uint64_t count = 0;
+	if (fd >= 0)
+	{
+		if (read( fd, &count, sizeof(count) ) != sizeof(count))
+			count = 0;
+		return count;
+	}
+#if defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// Time one converter over one geometry. Returns ns per row and cycles per row.
+static void BenchConvertCase( struct imgtool_conf *conf, enum bench_kind kind, int palette,
+	unsigned char *dest, const unsigned char *src, unsigned int srcWidth, void *pal,
+	int cycles_fd, double *ns_per_row, double *cycles_per_row, uint64_t *rows )
+{
+	uint64_t iters = 0, t0, c0, elapsed;
+	int n, warm = 0;
+
+	t0 = StatsNow();
+	c0 = BenchCycles( cycles_fd );
+	do {
+		for (n = 0; n < BENCH_BATCH; n++)
+		{
+			switch (kind)
+			{
+				case BENCH_ARGB_TO_FB:
+					ARGB8888toFB( conf, dest, src, srcWidth );
+					break;
+#ifndef NO_PNG
+				case BENCH_RGB8_TO_FB:
+					RGB8toFBPng( conf, dest, src, srcWidth, palette ? 256 : 0, (png_colorp)pal );
+					break;
+#endif
+				case BENCH_FB_TO_RGB:
+				default:
+					FBtoRGB888( conf, dest, src, srcWidth );
+					break;
+			}
+		}
+		iters += BENCH_BATCH;
+		elapsed = StatsNow() - t0;
+		if (!warm)
+		{
+			// First batch only warms caches and branch predictors
+			warm = 1;
+			t0 = StatsNow();
+			c0 = BenchCycles( cycles_fd );
+			iters = 0;
+			elapsed = 0;
+		}
+	} while (elapsed < BENCH_MIN_NS);
+	*ns_per_row = (double)elapsed / iters;
+	*cycles_per_row = (double)(BenchCycles( cycles_fd ) - c0) / iters;
+	*rows = iters;
+}
+
+// Run every row converter across representative widths and all bit formats.
+// Human-readable table to stderr, CSV to stdout.
+static int BenchConvert( struct imgtool_conf *base )
+{
+	unsigned int maxWidth = BENCH_MAX_WIDTH;
+	unsigned char *src = (unsigned char *)malloc( maxWidth * 2 * 4 + BENCH_SLACK * 2 );
+	unsigned char *dest = (unsigned char *)malloc( maxWidth * 4 + BENCH_SLACK * 2 );
+	int cycles_fd = BenchCyclesOpen();
+	int w, kind, fmt, palette, mirror, shrink;
+	unsigned int n;
+#ifndef NO_PNG
+	png_color pal[256];
+#else
+	unsigned char pal[256*3];
+#endif
+
+	if (!src || !dest)
+	{
+		fprintf( stderr, "malloc failed for benchmark buffers\n" );
+		free( src );
+		free( dest );
+		return -1;
+	}
+	// Deterministic noise so no converter sees constant input
+	srand( 1 );
+	for (n = 0; n < maxWidth * 2 * 4 + BENCH_SLACK * 2; n++)
+		src[n] = (unsigned char)rand();
+	memcpy( pal, src, sizeof(pal) );
+
+	fprintf( stderr, "Converter benchmark, %llu ms per case, cycle source %s\n",
+		BENCH_MIN_NS / 1000000ULL, bench_cycle_source );
+	fprintf( stderr, "%-20s %-8s %5s %3s %3s %3s %10s %8s\n",
+		"converter", "bitfmt", "width", "pal", "mir", "shr", "Mpixel/s", "cyc/pix" );
+	printf( "converter,bitfmt,width,palette,mirror,shrink,mpixel_per_s,cycles_per_pixel,ns_per_row,rows,cycle_source,version\n" );
+
+	for (kind = BENCH_ARGB_TO_FB; kind <= BENCH_FB_TO_RGB; kind++)
+	{
+#ifdef NO_PNG
+		if (kind == BENCH_RGB8_TO_FB)
+			continue;
+#endif
+		for (fmt = BF_RGB565; fmt <= BF_ARGB8888; fmt++)
+		for (w = 0; bench_widths[w]; w++)
+		for (palette = 0; palette <= (kind == BENCH_RGB8_TO_FB); palette++)
+		// Capture converters ignore mirror and resize
+		for (mirror = 0; mirror <= (kind != BENCH_FB_TO_RGB); mirror++)
+		for (shrink = 0; shrink <= (kind != BENCH_FB_TO_RGB); shrink++)
+		{
+			struct imgtool_conf conf = *base;
+			unsigned int srcWidth, srcHeight = 1;
+			double ns_per_row, cycles_per_row, mpix;
+			uint64_t rows;
+
+			conf.stats = NULL;
+			conf.debug_level = 0;
+			conf.fmt = (enum bit_format)fmt;
+			conf.width = bench_widths[w];
+			conf.height = 1;
+			conf.mirror_h = mirror;
+			// Shrink cases halve a source twice the screen width
+			conf.resize_options = shrink ? RESIZE_SHRINK_X : 0;
+			srcWidth = shrink ? conf.width * 2 : conf.width;
+			AdjustOutputSize( &srcWidth, &srcHeight, &conf );
+			srcWidth = shrink ? conf.width * 2 : conf.width;
+
+			BenchConvertCase( &conf, (enum bench_kind)kind, palette, dest + BENCH_SLACK,
+				src + BENCH_SLACK, srcWidth, pal, cycles_fd,
+				&ns_per_row, &cycles_per_row, &rows );
+			mpix = conf.width * 1000.0 / ns_per_row;
+			fprintf( stderr, "%-20s %-8s %5u %3d %3d %3d %10.1f %8.2f\n",
+				BenchConverterName( (enum bench_kind)kind, conf.fmt ), bit_format_names[fmt],
+				conf.width, palette, mirror, shrink, mpix, cycles_per_row / conf.width );
+			printf( "%s,%s,%u,%d,%d,%d,%.3f,%.3f,%.1f,%llu,%s," VER_FMT "\n",
+				BenchConverterName( (enum bench_kind)kind, conf.fmt ), bit_format_names[fmt],
+				conf.width, palette, mirror, shrink, mpix, cycles_per_row / conf.width,
+				ns_per_row, (unsigned long long)rows, bench_cycle_source, VER_DATA );
+		}
+	}
+
+	if (cycles_fd >= 0)
+		close( cycles_fd );
+	free( src );
+	free( dest );
+	return 0;
+}
+
+// End-to-end latency: draw and capture against a memfd standing in for the
+// frame buffer, over a corpus of generated images
+#define BENCH_E2E_ITERS	30
+
+// Deterministic test pattern: gradients with some high-frequency detail
+static void BenchPatternRow( unsigned char *rgb, unsigned int width, unsigned int height, unsigned int y )
+{
+	unsigned int x;
+	for (x = 0; x < width; x++)
+	{
+		rgb[x*3 + 0] = (unsigned char)(x * 255 / width);
+		rgb[x*3 + 1] = (unsigned char)(y * 255 / height);
+		rgb[x*3 + 2] = (unsigned char)((x ^ y) * 7);
+	}
+}
+
+static int BenchWriteJpeg( const char *path, unsigned int width, unsigned int height )
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	JSAMPROW rowp[1];
+	FILE *f = fopen( path, "wb" );
+	unsigned char *row = (unsigned char *)malloc( width * 3 );
+
+	if (!f || !row)
+	{
+		if (f)
+			fclose( f );
+		free( row );
+		return -1;
+	}
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, f);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 85, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	rowp[0] = row;
+	while (cinfo.next_scanline < height)
+	{
+		BenchPatternRow( row, width, height, cinfo.next_scanline );
+		jpeg_write_scanlines(&cinfo, rowp, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	fclose( f );
+	free( row );
+	return 0;
+}
+
+#ifndef NO_PNG
+static int BenchWritePng( const char *path, unsigned int width, unsigned int height, int palette )
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_color pal[256];
+	unsigned char *row = (unsigned char *)malloc( width * 3 );
+	FILE *f = fopen( path, "wb" );
+	unsigned int x, y;
+
+	if (!f || !row)
+	{
+		if (f)
+			fclose( f );
+		free( row );
+		return -1;
+	}
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if (!info_ptr || setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		fclose( f );
+		free( row );
+		return -1;
+	}
+	png_init_io(png_ptr, f);
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8,
+		palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (palette)
+	{
+		for (x = 0; x < 256; x++)
+		{
+			pal[x].red = x;
+			pal[x].green = 255 - x;
+			pal[x].blue = (x * 7) & 0xff;
+		}
+		png_set_PLTE(png_ptr, info_ptr, pal, 256);
+	}
+	png_write_info(png_ptr, info_ptr);
+	for (y = 0; y < height; y++)
+	{
+		BenchPatternRow( row, width, height, y );
+		if (palette)
+		{
+			for (x = 0; x < width; x++)
+				row[x] = row[x*3] ^ row[x*3 + 1];
+		}
+		png_write_row(png_ptr, row);
+	}
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	fclose( f );
+	free( row );
+	return 0;
+}
+#endif
+
+static int BenchCompareNs( const void *a, const void *b )
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double BenchPercentileMs( const uint64_t *sorted, int n, double pct )
+{
+	return sorted[(int)((n - 1) * pct / 100.0 + 0.5)] / 1e6;
+}
+
+enum bench_e2e_op {
+	BENCH_DRAW,
+	BENCH_CAPTURE_JPG,
+	BENCH_CAPTURE_PNG,
+	BENCH_CAPTURE_RAW,
+};
+
+// Time one draw or capture BENCH_E2E_ITERS times (after one warm-up run)
+// with stderr chatter discarded, then report percentiles
+static void BenchE2ECase( struct imgtool_conf *base, enum bench_e2e_op op, const char *label,
+	const char *path, unsigned int resize_options )
+{
+	uint64_t ns[BENCH_E2E_ITERS];
+	int saved_stderr, devnull, n, ret = 0;
+
+	fflush( stderr );
+	saved_stderr = dup( 2 );
+	devnull = open( "/dev/null", O_WRONLY );
+	if (devnull >= 0)
+		dup2( devnull, 2 );
+	for (n = -1; n < BENCH_E2E_ITERS; n++)
+	{
+		struct imgtool_conf conf = *base;
+		uint64_t t0;
+
+		conf.resize_options = resize_options;
+		strncpy( conf.filename, path, sizeof(conf.filename) - 1 );
+		t0 = StatsNow();
+		switch (op)
+		{
+#ifndef NO_PNG
+			case BENCH_DRAW:
+				ret |= ShowImage(&conf);
+				break;
+			case BENCH_CAPTURE_PNG:
+				ret |= CapturePng(&conf);
+				break;
+#endif
+			case BENCH_CAPTURE_RAW:
+				ret |= CaptureRaw(&conf, 0);
+				break;
+			case BENCH_CAPTURE_JPG:
+			default:
+				ret |= CaptureJpeg(&conf);
+				break;
+		}
+		if (n >= 0)
+			ns[n] = StatsNow() - t0;
+	}
+	fflush( stderr );
+	if (saved_stderr >= 0)
+	{
+		dup2( saved_stderr, 2 );
+		close( saved_stderr );
+	}
+	if (devnull >= 0)
+		close( devnull );
+
+	qsort( ns, BENCH_E2E_ITERS, sizeof(ns[0]), BenchCompareNs );
+	fprintf( stderr, "%-12s %-28s %6s %8.2f %8.2f %8.2f %8.2f %8.2f%s\n",
+		op == BENCH_DRAW ? "draw" : "capture", label, resize_options ? "yes" : "no",
+		ns[0] / 1e6, BenchPercentileMs( ns, BENCH_E2E_ITERS, 50 ),
+		BenchPercentileMs( ns, BENCH_E2E_ITERS, 90 ), BenchPercentileMs( ns, BENCH_E2E_ITERS, 99 ),
+		ns[BENCH_E2E_ITERS - 1] / 1e6, ret ? "  (errors)" : "" );
+	printf( "%s,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%u,%u,%s,%d," VER_FMT "\n",
+		op == BENCH_DRAW ? "draw" : "capture", label, resize_options ? 1 : 0, BENCH_E2E_ITERS,
+		ns[0] / 1e6, BenchPercentileMs( ns, BENCH_E2E_ITERS, 50 ),
+		BenchPercentileMs( ns, BENCH_E2E_ITERS, 90 ), BenchPercentileMs( ns, BENCH_E2E_ITERS, 99 ),
+		ns[BENCH_E2E_ITERS - 1] / 1e6, base->width, base->height, bit_format_names[base->fmt],
+		ret, VER_DATA );
+}
+
+static int BenchE2E( struct imgtool_conf *base )
+{
+	static const struct {
+		const char *name;
+		unsigned int width, height;
+		int palette;
+	} corpus[] = {
+#ifndef NO_PNG
+		{ "rgb-640x480.png", 640, 480, 0 },
+		{ "rgb-1920x1080.png", 1920, 1080, 0 },
+		{ "pal-800x600.png", 800, 600, 1 },
+		{ "photo-640x480.jpg", 640, 480, 0 },
+		{ "photo-1920x1080.jpg", 1920, 1080, 0 },
+		{ "photo-3840x2160.jpg", 3840, 2160, 0 },
+#endif
+		{ NULL, 0, 0, 0 }
+	};
+	struct imgtool_conf conf = *base;
+	char dir[] = "/tmp/imgtool-bench.XXXXXX";
+	char path[2048];
+	char label[64];
+	int fbfd, n;
+
+	conf.stats = NULL;
+	conf.debug_level = 0;
+	if (!conf.width || !conf.height)
+	{
+		conf.width = 1280;
+		conf.height = 720;
+	}
+	if ((fbfd = AnonFB( &conf )) < 0)
+		return -1;
+	if (!mkdtemp( dir ))
+	{
+		fprintf( stderr, "Error: cannot create corpus directory, errno=%d (%s)\n", errno, strerror(errno) );
+		close( fbfd );
+		return -1;
+	}
+
+	fprintf( stderr, "End-to-end benchmark, %u x %u %s stand-in frame buffer (stride %u), %d runs per case\n",
+		conf.width, conf.height, bit_format_names[conf.fmt],
+		conf.stride ? conf.stride : BytesPerFBPixel(conf.fmt) * conf.width, BENCH_E2E_ITERS );
+	fprintf( stderr, "%-12s %-28s %6s %8s %8s %8s %8s %8s\n",
+		"op", "case", "resize", "min ms", "p50 ms", "p90 ms", "p99 ms", "max ms" );
+	printf( "op,case,resize,runs,min_ms,p50_ms,p90_ms,p99_ms,max_ms,fb_width,fb_height,bitfmt,errors,version\n" );
+
+	for (n = 0; corpus[n].name; n++)
+	{
+		snprintf( path, sizeof(path), "%s/%s", dir, corpus[n].name );
+#ifndef NO_PNG
+		if (strstr( corpus[n].name, ".png" ) ?
+			BenchWritePng( path, corpus[n].width, corpus[n].height, corpus[n].palette ) :
+			BenchWriteJpeg( path, corpus[n].width, corpus[n].height ))
+		{
+			fprintf( stderr, "Error: cannot generate %s\n", path );
+			continue;
+		}
+		BenchE2ECase( &conf, BENCH_DRAW, corpus[n].name, path, 0 );
+		BenchE2ECase( &conf, BENCH_DRAW, corpus[n].name, path, RESIZE_SHRINK_MAX );
+#endif
+		unlink( path );
+	}
+
+	// Serial captures, then threaded ones with --jobs=n
+	snprintf( path, sizeof(path), "%s/capture.jpg", dir );
+	conf.jobs = 0;
+	BenchE2ECase( &conf, BENCH_CAPTURE_JPG, "capture.jpg", path, 0 );
+	if (base->jobs > 1)
+	{
+		conf.jobs = base->jobs;
+		snprintf( label, sizeof(label), "capture.jpg/%d-strips", conf.jobs );
+		BenchE2ECase( &conf, BENCH_CAPTURE_JPG, label, path, 0 );
+	}
+	unlink( path );
+#ifndef NO_PNG
+	snprintf( path, sizeof(path), "%s/capture.png", dir );
+	conf.jobs = 0;
+	BenchE2ECase( &conf, BENCH_CAPTURE_PNG, "capture.png", path, 0 );
+	if (base->jobs > 1)
+	{
+		conf.jobs = base->jobs;
+		snprintf( label, sizeof(label), "capture.png/%d-threads", conf.jobs );
+		BenchE2ECase( &conf, BENCH_CAPTURE_PNG, label, path, 0 );
+	}
+	unlink( path );
+#endif
+	snprintf( path, sizeof(path), "%s/capture.raw", dir );
+	BenchE2ECase( &conf, BENCH_CAPTURE_RAW, "capture.raw", path, 0 );
+	unlink( path );
+
+	rmdir( dir );
+	close( fbfd );
+	return 0;
+}
+
+// Dispatch --bench=suite
+int RunBench( struct imgtool_conf *conf )
+{
+	if (!strcmp( conf->bench, "convert" ))
+		return BenchConvert( conf );
+	if (!strcmp( conf->bench, "e2e" ))
+		return BenchE2E( conf );
+	fprintf( stderr, "Error: unknown benchmark suite %s - use convert or e2e\n", conf->bench );
+	return -1;
+}
+
+#endif // IMGTOOL_BENCH
+
+